@@ -26,15 +26,42 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <libgen.h>
+#include <pthread.h>
+#include <unistd.h>
 
-/* Define the desired FUSE API (required before including fuse.h) */
+/* Define the desired FUSE API (required before including fuse_lowlevel.h) */
+#ifdef FATXFS_FUSE3
+#define FUSE_USE_VERSION 31
+#else
 #define FUSE_USE_VERSION 26
-#include <fuse.h>
+#endif
+#include <fuse_lowlevel.h>
 #include <fuse_opt.h>
 
 #include <time.h>
 
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE  (1 << 1)
+#endif
+
+/* Largest read or write request to ask the kernel for. */
+#define FATX_FUSE_MAX_IO                 (1024 * 1024)
+
+/*
+ * How long (in seconds) the kernel may cache names and attributes by default.
+ * A mounted partition only changes through fatxfs, so they can be kept long.
+ */
+#define FATX_FUSE_DEFAULT_ENTRY_TIMEOUT  60.0
+#define FATX_FUSE_DEFAULT_ATTR_TIMEOUT   60.0
+
+/* Initial number of buckets of each inode hash table. */
+#define FATX_FUSE_INODE_BUCKETS      1024
+
 enum {
     FATX_FUSE_OPT_KEY_HELP,
     FATX_FUSE_OPT_KEY_VERSION,
@@ -47,13 +74,72 @@ enum {
     FATX_FUSE_OPT_KEY_DESTROY_DATA,
     FATX_FUSE_OPT_KEY_LOG,
     FATX_FUSE_OPT_KEY_LOGLEVEL,
+    FATX_FUSE_OPT_KEY_FAT_MIRROR,
+    FATX_FUSE_OPT_KEY_FAT_CACHE_SIZE,
+    FATX_FUSE_OPT_KEY_DIR_CACHE_SIZE,
+    FATX_FUSE_OPT_KEY_READ_ONLY,
+    FATX_FUSE_OPT_KEY_MMAP,
+    FATX_FUSE_OPT_KEY_IO_URING,
+    FATX_FUSE_OPT_KEY_IGNORE_CASE,
+    FATX_FUSE_OPT_KEY_ENTRY_TIMEOUT,
+    FATX_FUSE_OPT_KEY_ATTR_TIMEOUT,
+    FATX_FUSE_OPT_KEY_NO_KEEP_CACHE,
+    FATX_FUSE_OPT_KEY_DISCARD,
+};
+
+/*
+ * An inode known to the kernel.
+ *
+ * Inodes are numbered after the location of their directory entry, and can
+ * be found both by number and by location, so that an entry that is looked
+ * up again gets the same inode. An inode keeps its number when its entry is
+ * moved by a rename; a new entry that then takes over the old location gets
+ * a number that is still free. The root directory has no directory entry
+ * and no location.
+ *
+ * An inode is kept as long as the kernel holds a lookup count on it, or any
+ * of its children are kept, since paths are built by walking up through the
+ * parents. A removed inode has no location anymore, and remembers the last
+ * attributes of its entry for handles that are still open.
+ */
+struct fatx_fuse_inode {
+    fuse_ino_t              ino;
+    struct fatx_fuse_inode *parent;
+    char                    name[FATX_MAX_FILENAME_LEN+1];
+    struct fatx_dir         dir;
+    size_t                  first_cluster;
+    bool                    removed;
+    struct fatx_attr        removed_attr;
+    uint64_t                nlookup;
+    size_t                  children;
+    struct fatx_fuse_inode *ino_next;
+    struct fatx_fuse_inode *dir_next;
+};
+
+struct fatx_fuse_inode_table {
+    struct fatx_fuse_inode **by_ino;
+    struct fatx_fuse_inode **by_dir;
+    size_t                   num_buckets;
+    size_t                   num_inodes;
+    size_t                   entries_per_cluster;
+    fuse_ino_t               next_ino;
+    struct fatx_fuse_inode   root;
+    pthread_mutex_t          lock;
+};
+
+/*
+ * An open directory, and where its listing stopped.
+ */
+struct fatx_fuse_dir_handle {
+    struct fatx_dir_iter     iter;
+    size_t                   cluster;
+    off_t                    offset;
 };
 
 struct fatx_fuse_private_data {
     struct fatx_fs   *fs;
     char const       *device_path;
     char const       *log_path;
-    char             *mount_point;
     char              mount_partition_drive;
     size_t            mount_partition_offset;
     size_t            mount_partition_size;
@@ -63,25 +149,67 @@ struct fatx_fuse_private_data {
     int               log_level;
     enum fatx_format  format;
     int               format_confirm;
+    struct fatx_open_options open_options;
+    uid_t             uid;
+    gid_t             gid;
+    double            entry_timeout;
+    double            attr_timeout;
+    bool              keep_cache;
+    /*
+     * File data moves straight between the kernel and device_fd when the
+     * device has one. Transfers hold data_lock shared, so that the clusters
+     * they were given cannot be freed and reused until they are done. Only
+     * truncating needs it exclusively: the clusters of a removed file are
+     * not freed before its last handle is released.
+     */
+    int               device_fd;
+    pthread_rwlock_t  data_lock;
+#if FUSE_USE_VERSION >= 30
+    struct fuse_session *se;
+#else
+    struct fuse_chan *ch;
+#endif
+    struct fatx_fuse_inode_table inodes;
+};
+
+/* Percentage of each partition formatted so far, in disk order. */
+struct fatx_fuse_format_progress {
+    unsigned int      percent[6];
+    size_t            num_partitions;
 };
 
 /*
  * Filesystem operation functions.
  */
-int fatx_fuse_get_attr(const char *path, struct stat *stbuf);
-int fatx_fuse_mkdir(const char *path, mode_t mode);
-int fatx_fuse_rmdir(const char *path);
-int fatx_fuse_mknod(const char *path, mode_t mode, dev_t dev);
-int fatx_fuse_open(const char *path, struct fuse_file_info *fi);
-int fatx_fuse_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
-int fatx_fuse_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi);
-int fatx_fuse_read_dir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi);
-int fatx_fuse_unlink(char const *path);
-int fatx_fuse_truncate(const char *path, off_t size);
-int fatx_fuse_rename(const char *from, const char *to);
-int fatx_fuse_utimens(const char *path, const struct timespec ts[2]);
-void *fatx_fuse_init(struct fuse_conn_info *conn);
-void fatx_fuse_destroy(void *data);
+void fatx_fuse_init(void *userdata, struct fuse_conn_info *conn);
+void fatx_fuse_destroy(void *userdata);
+void fatx_fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name);
+void fatx_fuse_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup);
+void fatx_fuse_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets);
+void fatx_fuse_get_attr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void fatx_fuse_set_attr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi);
+void fatx_fuse_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev);
+void fatx_fuse_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode);
+void fatx_fuse_unlink(fuse_req_t req, fuse_ino_t parent, const char *name);
+void fatx_fuse_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name);
+#if FUSE_USE_VERSION >= 30
+void fatx_fuse_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags);
+#else
+void fatx_fuse_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname);
+#endif
+void fatx_fuse_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi);
+void fatx_fuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void fatx_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi);
+void fatx_fuse_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi);
+void fatx_fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi);
+void fatx_fuse_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void fatx_fuse_open_dir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void fatx_fuse_read_dir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi);
+#if FUSE_USE_VERSION >= 30
+void fatx_fuse_read_dir_plus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi);
+#endif
+void fatx_fuse_release_dir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi);
+void fatx_fuse_statfs(fuse_req_t req, fuse_ino_t ino);
 
 /*
  * Command line processing functions.
@@ -92,458 +220,1767 @@ int fatx_fuse_opt_proc(void *data, const char *arg, int key, struct fuse_args *o
 /*
  * Helper functions.
  */
-struct fatx_fuse_private_data *fatx_fuse_get_private_data(void);
 void fatx_fuse_print_usage(void);
 void fatx_fuse_print_version(void);
+void fatx_fuse_format_progress(void *ctx, size_t partition, uint64_t done, uint64_t total);
 
 /* Define the operations supported by this filesystem */
-static struct fuse_operations fatx_fuse_oper = {
-    .destroy  = fatx_fuse_destroy,
-    .getattr  = fatx_fuse_get_attr,
-    .init     = fatx_fuse_init,
-    .mkdir    = fatx_fuse_mkdir,
-    .rmdir    = fatx_fuse_rmdir,
-    .mknod    = fatx_fuse_mknod,
-    .open     = fatx_fuse_open,
-    .read     = fatx_fuse_read,
-    .write    = fatx_fuse_write,
-    .readdir  = fatx_fuse_read_dir,
-    .unlink   = fatx_fuse_unlink,
-    .truncate = fatx_fuse_truncate,
-    .rename   = fatx_fuse_rename,
-    .utimens  = fatx_fuse_utimens,
+static struct fuse_lowlevel_ops fatx_fuse_oper = {
+    .init         = fatx_fuse_init,
+    .destroy      = fatx_fuse_destroy,
+    .lookup       = fatx_fuse_lookup,
+    .forget       = fatx_fuse_forget,
+    .forget_multi = fatx_fuse_forget_multi,
+    .getattr      = fatx_fuse_get_attr,
+    .setattr      = fatx_fuse_set_attr,
+    .mknod        = fatx_fuse_mknod,
+    .mkdir        = fatx_fuse_mkdir,
+    .unlink       = fatx_fuse_unlink,
+    .rmdir        = fatx_fuse_rmdir,
+    .rename       = fatx_fuse_rename,
+    .create       = fatx_fuse_create,
+    .open         = fatx_fuse_open,
+    .read         = fatx_fuse_read,
+    .write_buf    = fatx_fuse_write_buf,
+    .fsync        = fatx_fuse_fsync,
+    .release      = fatx_fuse_release,
+    .opendir      = fatx_fuse_open_dir,
+    .readdir      = fatx_fuse_read_dir,
+#if FUSE_USE_VERSION >= 30
+    .readdirplus  = fatx_fuse_read_dir_plus,
+#endif
+    .releasedir   = fatx_fuse_release_dir,
+    .statfs       = fatx_fuse_statfs,
 };
 
 /*
- * Simple convenince function to get the private data struct.
+ * Translate a libfatx status into an errno value.
  */
-struct fatx_fuse_private_data *fatx_fuse_get_private_data(void)
+static int fatx_fuse_errno(int status)
+{
+    switch (status)
+    {
+    case FATX_STATUS_SUCCESS:
+        return 0;
+
+    case FATX_STATUS_FILE_NOT_FOUND:
+        return ENOENT;
+
+    default:
+        return EIO;
+    }
+}
+
+static size_t fatx_fuse_inode_hash(fuse_ino_t ino)
+{
+    return ino * 0x9e3779b97f4a7c15ULL >> 16;
+}
+
+static size_t fatx_fuse_inode_dir_hash(struct fatx_dir const *dir)
 {
-    struct fuse_context *context;
-    context = fuse_get_context();
-    if (context == NULL) return NULL;
-    return (struct fatx_fuse_private_data *)(context->private_data);
+    return fatx_fuse_inode_hash(dir->cluster * 0x10001 + dir->entry);
 }
 
 /*
- * Initialize the filesystem
+ * Set up the inode table, with the root directory as its only inode.
  */
-void *fatx_fuse_init(struct fuse_conn_info *conn)
+static int fatx_fuse_inode_table_init(struct fatx_fuse_private_data *pd)
 {
-    return fatx_fuse_get_private_data();
+    struct fatx_fuse_inode_table *table = &pd->inodes;
+
+    memset(table, 0, sizeof(*table));
+
+    table->num_buckets         = FATX_FUSE_INODE_BUCKETS;
+    table->entries_per_cluster = pd->fs->bytes_per_cluster / 64;
+    table->next_ino            = (fuse_ino_t)1 << (sizeof(fuse_ino_t) * 8 - 1);
+    table->by_ino              = calloc(table->num_buckets, sizeof(struct fatx_fuse_inode *));
+    table->by_dir              = calloc(table->num_buckets, sizeof(struct fatx_fuse_inode *));
+
+    if (!table->by_ino || !table->by_dir || pthread_mutex_init(&table->lock, NULL))
+    {
+        free(table->by_ino);
+        free(table->by_dir);
+        return -1;
+    }
+
+    table->root.ino           = FUSE_ROOT_ID;
+    table->root.first_cluster = pd->fs->root_cluster;
+
+    return 0;
 }
 
 /*
- * Clean up the filesystem.
+ * Release every inode.
  */
-void fatx_fuse_destroy(void *data)
+static void fatx_fuse_inode_table_free(struct fatx_fuse_private_data *pd)
 {
-    struct fatx_fuse_private_data *pd = data;
+    struct fatx_fuse_inode_table *table = &pd->inodes;
+    struct fatx_fuse_inode *inode, *next;
+    size_t i;
 
-    fatx_close_device(pd->fs);
-    free(pd->fs);
-    pd->fs = NULL;
+    for (i = 0; i < table->num_buckets; i++)
+    {
+        for (inode = table->by_ino[i]; inode; inode = next)
+        {
+            next = inode->ino_next;
+            free(inode);
+        }
+    }
 
-    free(pd->mount_point);
+    free(table->by_ino);
+    free(table->by_dir);
+    pthread_mutex_destroy(&table->lock);
+}
 
-    if (pd->log_handle)
+/*
+ * Find an inode by number.
+ */
+static struct fatx_fuse_inode *fatx_fuse_inode_get(struct fatx_fuse_private_data *pd, fuse_ino_t ino)
+{
+    struct fatx_fuse_inode_table *table = &pd->inodes;
+    struct fatx_fuse_inode *inode;
+
+    if (ino == FUSE_ROOT_ID)
     {
-        fclose(pd->log_handle);
+        return &table->root;
+    }
+
+    for (inode = table->by_ino[fatx_fuse_inode_hash(ino) & (table->num_buckets - 1)]; inode; inode = inode->ino_next)
+    {
+        if (inode->ino == ino)
+        {
+            return inode;
+        }
     }
+
+    return NULL;
 }
 
-void fatx_attr_to_stat(const struct fatx_attr *attr, struct stat *stbuf)
+/*
+ * Find the inode of the directory entry at dir.
+ */
+static struct fatx_fuse_inode *fatx_fuse_inode_find(struct fatx_fuse_private_data *pd, struct fatx_dir const *dir)
 {
-    struct fuse_context *context;
-    context = fuse_get_context();
+    struct fatx_fuse_inode_table *table = &pd->inodes;
+    struct fatx_fuse_inode *inode;
 
-    stbuf->st_mode   = 0777;
-    stbuf->st_nlink  = 1;
-    stbuf->st_size   = attr->file_size;
-    stbuf->st_mtime  = fatx_ts_to_time_t(&(attr->modified));
-    stbuf->st_atime  = fatx_ts_to_time_t(&(attr->accessed));
-    stbuf->st_ctime  = fatx_ts_to_time_t(&(attr->created));
+    for (inode = table->by_dir[fatx_fuse_inode_dir_hash(dir) & (table->num_buckets - 1)]; inode; inode = inode->dir_next)
+    {
+        if (inode->dir.cluster == dir->cluster && inode->dir.entry == dir->entry)
+        {
+            return inode;
+        }
+    }
 
-    if (attr->attributes & FATX_ATTR_DIRECTORY)
+    return NULL;
+}
+
+static void fatx_fuse_inode_unlink_dir(struct fatx_fuse_private_data *pd, struct fatx_fuse_inode *inode)
+{
+    struct fatx_fuse_inode_table *table = &pd->inodes;
+    struct fatx_fuse_inode **link;
+
+    link = &table->by_dir[fatx_fuse_inode_dir_hash(&inode->dir) & (table->num_buckets - 1)];
+    while (*link && *link != inode)
     {
-        stbuf->st_mode |= S_IFDIR;
+        link = &(*link)->dir_next;
     }
-    else
+    if (*link)
     {
-        stbuf->st_mode |= S_IFREG;
+        *link = inode->dir_next;
     }
+    inode->dir_next = NULL;
+}
 
+static void fatx_fuse_inode_link_dir(struct fatx_fuse_private_data *pd, struct fatx_fuse_inode *inode)
+{
+    struct fatx_fuse_inode_table *table = &pd->inodes;
+    size_t bucket = fatx_fuse_inode_dir_hash(&inode->dir) & (table->num_buckets - 1);
 
-    stbuf->st_uid = context->uid;
-    stbuf->st_gid = context->gid;
+    inode->dir_next = table->by_dir[bucket];
+    table->by_dir[bucket] = inode;
 }
 
 /*
- * Read the next directory entry.
+ * Double the number of buckets of both hash tables. Failing to grow only
+ * makes the chains longer.
  */
-int fatx_fuse_read_dir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+static void fatx_fuse_inode_table_grow(struct fatx_fuse_private_data *pd)
 {
-    struct fatx_fuse_private_data *pd;
-    struct fatx_dirent dirent, *nextdirent;
-    struct fatx_attr attr;
-    struct fatx_dir dir;
-    struct stat stat_buf;
-    struct fuse_context *context;
-    int status;
+    struct fatx_fuse_inode_table *table = &pd->inodes;
+    struct fatx_fuse_inode **by_ino, **by_dir, **old;
+    struct fatx_fuse_inode *inode, *next;
+    size_t i, num_buckets, bucket;
+
+    num_buckets = table->num_buckets * 2;
+    by_ino = calloc(num_buckets, sizeof(struct fatx_fuse_inode *));
+    by_dir = calloc(num_buckets, sizeof(struct fatx_fuse_inode *));
+    if (!by_ino || !by_dir)
+    {
+        free(by_ino);
+        free(by_dir);
+        return;
+    }
 
-    pd = fatx_fuse_get_private_data();
-    if (pd == NULL) return -1;
+    old = table->by_ino;
+    for (i = 0; i < table->num_buckets; i++)
+    {
+        for (inode = old[i]; inode; inode = next)
+        {
+            next = inode->ino_next;
+            bucket = fatx_fuse_inode_hash(inode->ino) & (num_buckets - 1);
+            inode->ino_next = by_ino[bucket];
+            by_ino[bucket] = inode;
+
+            inode->dir_next = NULL;
+            if (!inode->removed)
+            {
+                bucket = fatx_fuse_inode_dir_hash(&inode->dir) & (num_buckets - 1);
+                inode->dir_next = by_dir[bucket];
+                by_dir[bucket] = inode;
+            }
+        }
+    }
+
+    free(table->by_ino);
+    free(table->by_dir);
+    table->by_ino      = by_ino;
+    table->by_dir      = by_dir;
+    table->num_buckets = num_buckets;
+}
 
-    fatx_debug(pd->fs, "fatx_fuse_read_dir(path=\"%s\", buf=0x%p, offset=0x%zx)\n", path, buf, offset);
+/*
+ * Count a lookup of the entry at dir, whose attributes are attr, in the
+ * directory of parent. The inode of the entry is created if it isn't known.
+ */
+static struct fatx_fuse_inode *fatx_fuse_inode_add(struct fatx_fuse_private_data *pd, struct fatx_fuse_inode *parent, struct fatx_dir const *dir, struct fatx_attr const *attr)
+{
+    struct fatx_fuse_inode_table *table = &pd->inodes;
+    struct fatx_fuse_inode *inode;
+    size_t bucket;
+    fuse_ino_t ino;
 
-    /* Return record for '.' */
-    memset(&stat_buf, 0, sizeof(stat_buf));
-    if (strcmp(path, "/") != 0)
+    inode = fatx_fuse_inode_find(pd, dir);
+    if (inode)
     {
-        status = fatx_get_attr(pd->fs, path, &attr);
-        if (status) return status;
+        inode->nlookup++;
+        return inode;
+    }
 
-        fatx_attr_to_stat(&attr, &stat_buf);
+    inode = calloc(1, sizeof(struct fatx_fuse_inode));
+    if (!inode)
+    {
+        return NULL;
     }
-    
-    status = filler(buf, ".", &stat_buf, 0);
-    if (status) return -ENOMEM;
 
-    /* Return record for '..' */
-    if (strcmp(path, "/") == 0)
+    /* Number the inode after its location, unless a moved inode has that number. */
+    ino = (fuse_ino_t)(dir->cluster * table->entries_per_cluster + dir->entry);
+    while (ino <= FUSE_ROOT_ID || fatx_fuse_inode_get(pd, ino))
     {
-        /* On the root path, stat the mount point's parent */
-        char *parent = fatx_dirname(pd->mount_point);
-        status = stat(parent, &stat_buf);
-        free(parent);
-        if (status) return -errno;
+        ino = table->next_ino++;
     }
-    else
+
+    inode->ino           = ino;
+    inode->parent        = parent;
+    inode->dir           = *dir;
+    inode->first_cluster = attr->first_cluster;
+    inode->nlookup       = 1;
+    strcpy(inode->name, attr->filename);
+    parent->children++;
+
+    bucket = fatx_fuse_inode_hash(ino) & (table->num_buckets - 1);
+    inode->ino_next = table->by_ino[bucket];
+    table->by_ino[bucket] = inode;
+    fatx_fuse_inode_link_dir(pd, inode);
+
+    if (++table->num_inodes > table->num_buckets)
     {
-        /* If not the root, stat the fs (or handle the root parent case) */
-        char *parent = fatx_dirname(path);
-        memset(&stat_buf, 0, sizeof(stat_buf));
-        if (strcmp(parent, "/") != 0)
-        {
-            status = fatx_get_attr(pd->fs, parent, &attr);
-            free(parent);
-            if (status) return status;
+        fatx_fuse_inode_table_grow(pd);
+    }
+
+    return inode;
+}
+
+/*
+ * Free an inode (and then its parents) once nothing refers to it anymore.
+ */
+static void fatx_fuse_inode_put(struct fatx_fuse_private_data *pd, struct fatx_fuse_inode *inode)
+{
+    struct fatx_fuse_inode_table *table = &pd->inodes;
+    struct fatx_fuse_inode **link, *parent;
 
-            fatx_attr_to_stat(&attr, &stat_buf);
+    while (inode != &table->root && inode->nlookup == 0 && inode->children == 0)
+    {
+        link = &table->by_ino[fatx_fuse_inode_hash(inode->ino) & (table->num_buckets - 1)];
+        while (*link != inode)
+        {
+            link = &(*link)->ino_next;
         }
-        else
+        *link = inode->ino_next;
+
+        if (!inode->removed)
         {
-            context = fuse_get_context();
-            stat_buf.st_uid = context->uid;
-            stat_buf.st_gid = context->gid;
-            stat_buf.st_mode = S_IFDIR | 0777;
-            stat_buf.st_nlink = 1;
-            free(parent);
+            fatx_fuse_inode_unlink_dir(pd, inode);
         }
+
+        table->num_inodes--;
+        parent = inode->parent;
+        parent->children--;
+        free(inode);
+
+        inode = parent;
     }
+}
+
+/*
+ * Note that the entry of an inode was removed.
+ */
+static void fatx_fuse_inode_removed(struct fatx_fuse_private_data *pd, struct fatx_fuse_inode *inode, struct fatx_attr const *attr)
+{
+    fatx_fuse_inode_unlink_dir(pd, inode);
+    inode->removed      = true;
+    inode->removed_attr = *attr;
+}
+
+/*
+ * Note that the entry of an inode was moved to dir, in the directory of
+ * parent, under a new name.
+ */
+static void fatx_fuse_inode_moved(struct fatx_fuse_private_data *pd, struct fatx_fuse_inode *inode, struct fatx_fuse_inode *parent, struct fatx_dir const *dir, char const *name)
+{
+    struct fatx_fuse_inode *old_parent = inode->parent;
 
-    status = filler(buf, "..", &stat_buf, 0);
-    if (status) return -ENOMEM;
+    fatx_fuse_inode_unlink_dir(pd, inode);
+    inode->dir = *dir;
+    fatx_fuse_inode_link_dir(pd, inode);
 
-    /* Open the directory. */
-    status = fatx_open_dir(pd->fs, path, &dir);
-    if (status) return status;
+    strcpy(inode->name, name);
 
-    /* Iterate over directory entries, calling filler() for each. */
-    while (1)
+    if (parent != old_parent)
     {
-        /* Get the current directory entry. */
-        status = fatx_read_dir(pd->fs, &dir, &dirent, &attr, &nextdirent);
+        parent->children++;
+        inode->parent = parent;
+        old_parent->children--;
+        fatx_fuse_inode_put(pd, old_parent);
+    }
+}
 
-        if (status == FATX_STATUS_SUCCESS)
-        {
-            memset(&stat_buf, 0, sizeof(stat_buf));
-            fatx_attr_to_stat(&attr, &stat_buf);
+/*
+ * Build the path of a name in the directory of an inode (or of the inode
+ * itself, when name is NULL). The result must be freed by the caller.
+ */
+static char *fatx_fuse_inode_path(struct fatx_fuse_inode const *inode, char const *name)
+{
+    struct fatx_fuse_inode const *i;
+    size_t len, pos;
+    char *path;
 
-            /* Found a directory entry, use the filler function to add it. */
-            status = filler(buf, nextdirent->filename, &stat_buf, 0);
+    len = name ? strlen(name) + 1 : 0;
+    for (i = inode; i->parent; i = i->parent)
+    {
+        len += strlen(i->name) + 1;
+    }
 
-            if (status)
-            {
-                /* Could not add directory entry. */
-                status = -ENOMEM;
-                break;
-            }
-        }
-        else if (status == FATX_STATUS_FILE_DELETED)
-        {
-            /* File deleted. Skip over it... */
-        }
-        else if (status == FATX_STATUS_END_OF_DIR)
-        {
-            /* End of directory entries. */
-            status = 0;
-            break;
-        }
-        else
-        {
-            /* Error */
-            break;
-        }
+    path = malloc(len + 2);
+    if (!path)
+    {
+        return NULL;
+    }
 
-        /* Get the next directory entry. */
-        status = fatx_next_dir_entry(pd->fs, &dir);
-        if (status != FATX_STATUS_SUCCESS) break;
+    if (len == 0)
+    {
+        strcpy(path, "/");
+        return path;
     }
 
-    fatx_close_dir(pd->fs, &dir);
-    return status;
+    pos = len;
+    path[pos] = '\0';
+
+    if (name)
+    {
+        pos -= strlen(name);
+        memcpy(path + pos, name, strlen(name));
+        path[--pos] = '/';
+    }
+
+    for (i = inode; i->parent; i = i->parent)
+    {
+        pos -= strlen(i->name);
+        memcpy(path + pos, i->name, strlen(i->name));
+        path[--pos] = '/';
+    }
+
+    return path;
 }
 
 /*
- * Get file attributes.
+ * Fill in the attributes of an inode.
+ */
+static void fatx_fuse_attr_to_stat(struct fatx_fuse_private_data *pd, fuse_ino_t ino, const struct fatx_attr *attr, struct stat *stbuf)
+{
+    memset(stbuf, 0, sizeof(struct stat));
+
+    stbuf->st_ino    = ino;
+    stbuf->st_mode   = 0777;
+    stbuf->st_nlink  = 1;
+    stbuf->st_uid    = pd->uid;
+    stbuf->st_gid    = pd->gid;
+
+    if (!attr)
+    {
+        /* The root directory has no directory entry. */
+        stbuf->st_mode |= S_IFDIR;
+        return;
+    }
+
+    stbuf->st_size   = attr->file_size;
+    stbuf->st_mtime  = fatx_ts_to_time_t(&(attr->modified));
+    stbuf->st_atime  = fatx_ts_to_time_t(&(attr->accessed));
+    stbuf->st_ctime  = fatx_ts_to_time_t(&(attr->created));
+
+    if (attr->attributes & FATX_ATTR_DIRECTORY)
+    {
+        stbuf->st_mode |= S_IFDIR;
+    }
+    else
+    {
+        stbuf->st_mode |= S_IFREG;
+    }
+}
+
+/*
+ * Get the current attributes of an inode. The inode table must be locked.
  */
-int fatx_fuse_get_attr(const char  *path, struct stat *stbuf)
+static int fatx_fuse_inode_stat(struct fatx_fuse_private_data *pd, struct fatx_fuse_inode *inode, struct stat *stbuf)
 {
-    struct fatx_fuse_private_data *pd;
+    struct fatx_dirent dirent, *result;
     struct fatx_attr attr;
-    struct fuse_context *context;
+    struct fatx_dir dir;
     int status;
 
-    pd = fatx_fuse_get_private_data();
-    if (pd == NULL) return -1;
+    if (inode == &pd->inodes.root)
+    {
+        fatx_fuse_attr_to_stat(pd, inode->ino, NULL, stbuf);
+        return 0;
+    }
 
-    fatx_debug(pd->fs, "fatx_fuse_get_attr(path=\"%s\")\n", path);
+    if (inode->removed)
+    {
+        fatx_fuse_attr_to_stat(pd, inode->ino, &inode->removed_attr, stbuf);
+        stbuf->st_nlink = 0;
+        return 0;
+    }
 
-    memset(stbuf, 0, sizeof(struct stat));
+    dir = inode->dir;
+    status = fatx_read_dir(pd->fs, &dir, &dirent, &attr, &result);
+    if (status == FATX_STATUS_FILE_DELETED || status == FATX_STATUS_END_OF_DIR)
+    {
+        return ENOENT;
+    }
+    else if (status)
+    {
+        return EIO;
+    }
+
+    fatx_fuse_attr_to_stat(pd, inode->ino, &attr, stbuf);
+    return 0;
+}
+
+/*
+ * Look up a name in the directory of parent, and count a lookup of its
+ * inode. The inode table must be locked.
+ */
+static int fatx_fuse_inode_lookup(struct fatx_fuse_private_data *pd, struct fatx_fuse_inode *parent, char const *name, struct fuse_entry_param *entry)
+{
+    struct fatx_fuse_inode *inode;
+    struct fatx_attr attr;
+    struct fatx_dir dir;
+    int status;
+
+    status = fatx_lookup(pd->fs, parent->first_cluster, name, &dir, &attr);
+    if (status) return fatx_fuse_errno(status);
+
+    inode = fatx_fuse_inode_add(pd, parent, &dir, &attr);
+    if (!inode) return ENOMEM;
 
-    if (strcmp(path, "/") == 0)
+    memset(entry, 0, sizeof(struct fuse_entry_param));
+    entry->ino           = inode->ino;
+    entry->attr_timeout  = pd->attr_timeout;
+    entry->entry_timeout = pd->entry_timeout;
+    fatx_fuse_attr_to_stat(pd, inode->ino, &attr, &entry->attr);
+
+    return 0;
+}
+
+/*
+ * Get the directory inode named by a request. The inode table must be
+ * locked.
+ */
+static struct fatx_fuse_inode *fatx_fuse_get_dir(struct fatx_fuse_private_data *pd, fuse_ino_t ino)
+{
+    struct fatx_fuse_inode *inode;
+
+    inode = fatx_fuse_inode_get(pd, ino);
+    if (!inode || inode->removed)
+    {
+        return NULL;
+    }
+
+    return inode;
+}
+
+/*
+ * Remember the on-disk name of an entry that a request changed, if the
+ * request spelled it differently (as with --ignore-case). The kernel only
+ * updates the name it was given, so a name it cached with the on-disk
+ * spelling must be dropped explicitly.
+ */
+static void fatx_fuse_note_stale_name(char *stale, char const *name, struct fatx_attr const *attr)
+{
+    if (strcmp(name, attr->filename))
     {
+        strcpy(stale, attr->filename);
+    }
+}
+
+/*
+ * Drop a name that a request made stale from the kernel cache.
+ *
+ * This must only be done after replying to the request, as the kernel holds
+ * the directory locked until then.
+ */
+static void fatx_fuse_invalidate_name(struct fatx_fuse_private_data *pd, fuse_ino_t parent, char const *name)
+{
+    if (name[0] == '\0' || pd->entry_timeout <= 0)
+    {
+        return;
+    }
+
+#if FUSE_USE_VERSION >= 30
+    if (pd->se)
+    {
+        fuse_lowlevel_notify_inval_entry(pd->se, parent, name, strlen(name));
+    }
+#else
+    if (pd->ch)
+    {
+        fuse_lowlevel_notify_inval_entry(pd->ch, parent, name, strlen(name));
+    }
+#endif
+}
+
+/*
+ * Drop the cached attributes of an inode that a request changed, so that
+ * other handles don't keep seeing the old size or times. The kernel already
+ * drops the pages a write or truncate replaced, so they are left alone.
+ *
+ * As with names, this must only be done after replying to the request.
+ */
+static void fatx_fuse_invalidate_attr(struct fatx_fuse_private_data *pd, fuse_ino_t ino)
+{
+    if (pd->attr_timeout <= 0)
+    {
+        return;
+    }
+
+#if FUSE_USE_VERSION >= 30
+    if (pd->se)
+    {
+        fuse_lowlevel_notify_inval_inode(pd->se, ino, -1, 0);
+    }
+#else
+    if (pd->ch)
+    {
+        fuse_lowlevel_notify_inval_inode(pd->ch, ino, -1, 0);
+    }
+#endif
+}
+
+/*
+ * Initialize the filesystem
+ */
+void fatx_fuse_init(void *userdata, struct fuse_conn_info *conn)
+{
+    /* Ask for large requests, and let data move through pipes where possible. */
+    conn->max_write = FATX_FUSE_MAX_IO;
+    conn->want     |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+
+#if FUSE_USE_VERSION < 30
+    conn->want     |= conn->capable & FUSE_CAP_BIG_WRITES;
+#endif
+}
+
+/*
+ * Clean up the filesystem.
+ */
+void fatx_fuse_destroy(void *userdata)
+{
+    struct fatx_fuse_private_data *pd = userdata;
+
+    fatx_fuse_inode_table_free(pd);
+    pthread_rwlock_destroy(&pd->data_lock);
+
+    fatx_close_device(pd->fs);
+    free(pd->fs);
+    pd->fs = NULL;
+
+    if (pd->log_handle)
+    {
+        fclose(pd->log_handle);
+        pd->log_handle = NULL;
+    }
+}
+
+/*
+ * Look up a name in a directory.
+ */
+void fatx_fuse_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fatx_fuse_inode *dir;
+    struct fuse_entry_param entry;
+    int status;
+
+    fatx_debug(pd->fs, "fatx_fuse_lookup(parent=%lu, name=\"%s\")\n", parent, name);
+
+    pthread_mutex_lock(&pd->inodes.lock);
+    dir = fatx_fuse_get_dir(pd, parent);
+    status = dir ? fatx_fuse_inode_lookup(pd, dir, name, &entry) : ENOENT;
+    pthread_mutex_unlock(&pd->inodes.lock);
+
+    if (status)
+    {
+        fuse_reply_err(req, status);
+        return;
+    }
+
+    fuse_reply_entry(req, &entry);
+}
+
+/*
+ * Drop lookups of an inode.
+ */
+void fatx_fuse_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fatx_fuse_inode *inode;
+
+    pthread_mutex_lock(&pd->inodes.lock);
+    inode = fatx_fuse_inode_get(pd, ino);
+    if (inode && inode != &pd->inodes.root)
+    {
+        inode->nlookup -= nlookup;
+        fatx_fuse_inode_put(pd, inode);
+    }
+    pthread_mutex_unlock(&pd->inodes.lock);
+
+    fuse_reply_none(req);
+}
+
+/*
+ * Drop lookups of several inodes.
+ */
+void fatx_fuse_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets)
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fatx_fuse_inode *inode;
+    size_t i;
+
+    pthread_mutex_lock(&pd->inodes.lock);
+    for (i = 0; i < count; i++)
+    {
+        inode = fatx_fuse_inode_get(pd, forgets[i].ino);
+        if (inode && inode != &pd->inodes.root)
+        {
+            inode->nlookup -= forgets[i].nlookup;
+            fatx_fuse_inode_put(pd, inode);
+        }
+    }
+    pthread_mutex_unlock(&pd->inodes.lock);
+
+    fuse_reply_none(req);
+}
+
+/*
+ * Get file attributes.
+ */
+void fatx_fuse_get_attr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fatx_fuse_inode *inode;
+    struct stat stbuf;
+    int status;
+
+    fatx_debug(pd->fs, "fatx_fuse_get_attr(ino=%lu)\n", ino);
+
+    pthread_mutex_lock(&pd->inodes.lock);
+    inode = fatx_fuse_inode_get(pd, ino);
+    status = inode ? fatx_fuse_inode_stat(pd, inode, &stbuf) : ENOENT;
+    pthread_mutex_unlock(&pd->inodes.lock);
+
+    if (status)
+    {
+        fuse_reply_err(req, status);
+        return;
+    }
+
+    fuse_reply_attr(req, &stbuf, pd->attr_timeout);
+}
+
+/*
+ * Change the size or the times of a file.
+ */
+void fatx_fuse_set_attr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fatx_fuse_inode *inode;
+    struct fatx_attr old_attr;
+    struct fatx_ts fat_time[2];
+    struct stat stbuf;
+    char *path = NULL;
+    int status;
+
+    fatx_debug(pd->fs, "fatx_fuse_set_attr(ino=%lu, to_set=0x%x)\n", ino, to_set);
+
+    /* There are no owners or permissions to change. */
+    if (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_UID | FUSE_SET_ATTR_GID))
+    {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+
+    pthread_mutex_lock(&pd->inodes.lock);
+
+    inode = fatx_fuse_get_dir(pd, ino);
+    if (!inode || inode == &pd->inodes.root)
+    {
+        status = inode ? EPERM : ENOENT;
+        goto cleanup;
+    }
+
+    path = fatx_fuse_inode_path(inode, NULL);
+    if (!path)
+    {
+        status = ENOMEM;
+        goto cleanup;
+    }
+
+    if (to_set & FUSE_SET_ATTR_SIZE)
+    {
+        fatx_debug(pd->fs, "truncating %s to 0x%zx\n", path, attr->st_size);
+
+        pthread_rwlock_wrlock(&pd->data_lock);
+        status = fatx_fuse_errno(fatx_truncate(pd->fs, path, attr->st_size));
+        pthread_rwlock_unlock(&pd->data_lock);
+        if (status) goto cleanup;
+    }
+
+    if (to_set & (FUSE_SET_ATTR_ATIME | FUSE_SET_ATTR_MTIME | FUSE_SET_ATTR_ATIME_NOW | FUSE_SET_ATTR_MTIME_NOW))
+    {
+        status = fatx_fuse_errno(fatx_get_attr(pd->fs, path, &old_attr));
+        if (status) goto cleanup;
+
+        fat_time[0] = old_attr.accessed;
+        fat_time[1] = old_attr.modified;
+
+        if (to_set & FUSE_SET_ATTR_ATIME_NOW)   fatx_time_t_to_fatx_ts(time(NULL), &fat_time[0]);
+        else if (to_set & FUSE_SET_ATTR_ATIME)  fatx_time_t_to_fatx_ts(attr->st_atime, &fat_time[0]);
+
+        if (to_set & FUSE_SET_ATTR_MTIME_NOW)   fatx_time_t_to_fatx_ts(time(NULL), &fat_time[1]);
+        else if (to_set & FUSE_SET_ATTR_MTIME)  fatx_time_t_to_fatx_ts(attr->st_mtime, &fat_time[1]);
+
+        status = fatx_fuse_errno(fatx_utime(pd->fs, path, fat_time));
+        if (status) goto cleanup;
+    }
+
+    status = fatx_fuse_inode_stat(pd, inode, &stbuf);
+
+cleanup:
+    pthread_mutex_unlock(&pd->inodes.lock);
+    free(path);
+
+    if (status)
+    {
+        fuse_reply_err(req, status);
+        return;
+    }
+
+    fuse_reply_attr(req, &stbuf, pd->attr_timeout);
+
+    if (to_set & FUSE_SET_ATTR_SIZE)
+    {
+        fatx_fuse_invalidate_attr(pd, ino);
+    }
+}
+
+/*
+ * Create a file or directory named name in the directory of parent, and
+ * look it up.
+ */
+static int fatx_fuse_make(struct fatx_fuse_private_data *pd, fuse_ino_t parent, const char *name, bool directory, struct fuse_entry_param *entry)
+{
+    struct fatx_fuse_inode *dir;
+    char *path;
+    int status;
+
+    pthread_mutex_lock(&pd->inodes.lock);
+
+    dir = fatx_fuse_get_dir(pd, parent);
+    if (!dir)
+    {
+        status = ENOENT;
+        goto cleanup;
+    }
+
+    path = fatx_fuse_inode_path(dir, name);
+    if (!path)
+    {
+        status = ENOMEM;
+        goto cleanup;
+    }
+
+    status = directory ? fatx_mkdir(pd->fs, path) : fatx_mknod(pd->fs, path);
+    free(path);
+
+    if (status)
+    {
+        status = fatx_fuse_errno(status);
+        goto cleanup;
+    }
+
+    status = fatx_fuse_inode_lookup(pd, dir, name, entry);
+
+cleanup:
+    pthread_mutex_unlock(&pd->inodes.lock);
+    return status;
+}
+
+/*
+ * Create a file.
+ */
+void fatx_fuse_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fuse_entry_param entry;
+    int status;
+
+    fatx_debug(pd->fs, "fatx_fuse_mknod(parent=%lu, name=\"%s\", mode=0%o, dev=0x%x)\n", parent, name, mode, rdev);
+
+    status = fatx_fuse_make(pd, parent, name, false, &entry);
+    if (status)
+    {
+        fuse_reply_err(req, status);
+        return;
+    }
+
+    fuse_reply_entry(req, &entry);
+}
+
+/*
+ * Create a directory.
+ */
+void fatx_fuse_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fuse_entry_param entry;
+    int status;
+
+    fatx_debug(pd->fs, "fatx_fuse_mkdir(parent=%lu, name=\"%s\", mode=0%o)\n", parent, name, mode);
+
+    status = fatx_fuse_make(pd, parent, name, true, &entry);
+    if (status)
+    {
+        fuse_reply_err(req, status);
+        return;
+    }
+
+    fuse_reply_entry(req, &entry);
+}
+
+/*
+ * Remove the entry named name from the directory of parent.
+ */
+static int fatx_fuse_remove(struct fatx_fuse_private_data *pd, fuse_ino_t parent, const char *name, bool directory, char *stale)
+{
+    struct fatx_fuse_inode *dir, *inode;
+    struct fatx_attr attr;
+    struct fatx_dir location;
+    char *path;
+    int status;
+
+    pthread_mutex_lock(&pd->inodes.lock);
+
+    dir = fatx_fuse_get_dir(pd, parent);
+    if (!dir)
+    {
+        status = ENOENT;
+        goto cleanup;
+    }
+
+    status = fatx_fuse_errno(fatx_lookup(pd->fs, dir->first_cluster, name, &location, &attr));
+    if (status) goto cleanup;
+
+    if (!!(attr.attributes & FATX_ATTR_DIRECTORY) != directory)
+    {
+        status = directory ? ENOTDIR : EISDIR;
+        goto cleanup;
+    }
+
+    path = fatx_fuse_inode_path(dir, name);
+    if (!path)
+    {
+        status = ENOMEM;
+        goto cleanup;
+    }
+
+    status = directory ? fatx_rmdir(pd->fs, path) : fatx_unlink(pd->fs, path);
+    free(path);
+
+    switch (status)
+    {
+    case FATX_STATUS_SUCCESS:
+        inode = fatx_fuse_inode_find(pd, &location);
+        if (inode)
+        {
+            fatx_fuse_inode_removed(pd, inode, &attr);
+        }
+        fatx_fuse_note_stale_name(stale, name, &attr);
+        break;
+
+    case FATX_STATUS_END_OF_DIR:
+        status = ENOTEMPTY;
+        break;
+
+    default:
+        status = fatx_fuse_errno(status);
+        break;
+    }
+
+cleanup:
+    pthread_mutex_unlock(&pd->inodes.lock);
+    return status;
+}
+
+/*
+ * Remove a file.
+ */
+void fatx_fuse_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    char stale[FATX_MAX_FILENAME_LEN+1] = "";
+
+    fatx_debug(pd->fs, "fatx_fuse_unlink(parent=%lu, name=\"%s\")\n", parent, name);
+
+    fuse_reply_err(req, fatx_fuse_remove(pd, parent, name, false, stale));
+    fatx_fuse_invalidate_name(pd, parent, stale);
+}
+
+/*
+ * Remove a directory.
+ */
+void fatx_fuse_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    char stale[FATX_MAX_FILENAME_LEN+1] = "";
+
+    fatx_debug(pd->fs, "fatx_fuse_rmdir(parent=%lu, name=\"%s\")\n", parent, name);
+
+    fuse_reply_err(req, fatx_fuse_remove(pd, parent, name, true, stale));
+    fatx_fuse_invalidate_name(pd, parent, stale);
+}
+
+/*
+ * Rename a file.
+ */
+#if FUSE_USE_VERSION >= 30
+void fatx_fuse_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname, unsigned int flags)
+#else
+void fatx_fuse_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname)
+#endif
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fatx_fuse_inode *from_dir, *to_dir, *inode, *replaced;
+    struct fatx_attr attr, replaced_attr;
+    struct fatx_dir from, to;
+    char *from_path = NULL, *to_path = NULL;
+    char from_stale[FATX_MAX_FILENAME_LEN+1] = "";
+    char to_stale[FATX_MAX_FILENAME_LEN+1] = "";
+    bool exists, exchange, no_replace;
+    int status;
+
+#if FUSE_USE_VERSION < 30
+    unsigned int flags = 0;
+#endif
+
+    fatx_debug(pd->fs, "fatx_fuse_rename(parent=%lu, name=\"%s\", newparent=%lu, newname=\"%s\", flags=0x%x)\n", parent, name, newparent, newname, flags);
+
+    if (flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE))
+    {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    exchange   = flags & RENAME_EXCHANGE;
+    no_replace = flags & RENAME_NOREPLACE;
+
+    pthread_mutex_lock(&pd->inodes.lock);
+
+    from_dir = fatx_fuse_get_dir(pd, parent);
+    to_dir   = fatx_fuse_get_dir(pd, newparent);
+    if (!from_dir || !to_dir)
+    {
+        status = ENOENT;
+        goto cleanup;
+    }
+
+    status = fatx_fuse_errno(fatx_lookup(pd->fs, from_dir->first_cluster, name, &from, &attr));
+    if (status) goto cleanup;
+
+    /* Find out whether an entry is about to be replaced (or exchanged). */
+    replaced = NULL;
+    exists   = fatx_lookup(pd->fs, to_dir->first_cluster, newname, &to, &replaced_attr) == FATX_STATUS_SUCCESS;
+    if (exists)
+    {
+        replaced = fatx_fuse_inode_find(pd, &to);
+    }
+
+    if (exchange && !exists)
+    {
+        status = ENOENT;
+        goto cleanup;
+    }
+
+    if (no_replace && exists && (from.cluster != to.cluster || from.entry != to.entry))
+    {
+        status = EEXIST;
+        goto cleanup;
+    }
+
+    from_path = fatx_fuse_inode_path(from_dir, name);
+    to_path   = fatx_fuse_inode_path(to_dir, newname);
+    if (!from_path || !to_path)
+    {
+        status = ENOMEM;
+        goto cleanup;
+    }
+
+    status = fatx_fuse_errno(fatx_rename(pd->fs, from_path, to_path, exchange, no_replace));
+    if (status) goto cleanup;
+
+    inode = fatx_fuse_inode_find(pd, &from);
+
+    if (exchange)
+    {
+        /* The entries keep their names and swap everything else. */
+        if (inode && replaced && replaced != inode)
+        {
+            fatx_fuse_inode_moved(pd, inode, to_dir, &to, newname);
+            fatx_fuse_inode_moved(pd, replaced, from_dir, &from, name);
+        }
+        else if (inode)
+        {
+            fatx_fuse_inode_moved(pd, inode, to_dir, &to, newname);
+        }
+        else if (replaced)
+        {
+            fatx_fuse_inode_moved(pd, replaced, from_dir, &from, name);
+        }
+        goto cleanup;
+    }
+
+    if (replaced && replaced != inode)
+    {
+        fatx_fuse_inode_removed(pd, replaced, &replaced_attr);
+    }
+
+    fatx_fuse_note_stale_name(from_stale, name, &attr);
+    if (replaced)
+    {
+        fatx_fuse_note_stale_name(to_stale, newname, &replaced_attr);
+    }
+
+    /* The entry may have been moved, so find it again. */
+    if (inode)
+    {
+        status = fatx_fuse_errno(fatx_lookup(pd->fs, to_dir->first_cluster, newname, &to, &attr));
+        if (status) goto cleanup;
+
+        fatx_fuse_inode_moved(pd, inode, to_dir, &to, attr.filename);
+    }
+
+cleanup:
+    pthread_mutex_unlock(&pd->inodes.lock);
+    free(from_path);
+    free(to_path);
+
+    fuse_reply_err(req, status);
+    fatx_fuse_invalidate_name(pd, parent, from_stale);
+    fatx_fuse_invalidate_name(pd, newparent, to_stale);
+}
+
+/*
+ * Open the file of an inode, and keep its handle in fi.
+ */
+static int fatx_fuse_open_file(struct fatx_fuse_private_data *pd, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct fatx_fuse_inode *inode;
+    struct fatx_file *file;
+    int status;
+
+    file = malloc(sizeof(struct fatx_file));
+    if (file == NULL) return ENOMEM;
+
+    pthread_mutex_lock(&pd->inodes.lock);
+    inode = fatx_fuse_get_dir(pd, ino);
+    status = inode ? fatx_fuse_errno(fatx_file_open_at(pd->fs, &inode->dir, file)) : ENOENT;
+    pthread_mutex_unlock(&pd->inodes.lock);
+
+    if (status)
+    {
+        free(file);
+        return status;
+    }
+
+    fi->fh = (uintptr_t)file;
+    fi->keep_cache = pd->keep_cache;
+    return 0;
+}
+
+/*
+ * Create and open a file.
+ */
+void fatx_fuse_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi)
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fuse_entry_param entry;
+    int status;
+
+    fatx_debug(pd->fs, "fatx_fuse_create(parent=%lu, name=\"%s\", mode=0%o)\n", parent, name, mode);
+
+    status = fatx_fuse_make(pd, parent, name, false, &entry);
+    if (status)
+    {
+        fuse_reply_err(req, status);
+        return;
+    }
+
+    status = fatx_fuse_open_file(pd, entry.ino, fi);
+    if (status)
+    {
+        fuse_reply_err(req, status);
+        return;
+    }
+
+    fuse_reply_create(req, &entry, fi);
+}
+
+/*
+ * Get the file handle of an open file.
+ */
+static struct fatx_file *fatx_fuse_get_file(struct fuse_file_info *fi)
+{
+    return (struct fatx_file *)(uintptr_t)fi->fh;
+}
+
+/*
+ * Open a file.
+ */
+void fatx_fuse_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    int status;
+
+    fatx_debug(pd->fs, "fatx_fuse_open(ino=%lu)\n", ino);
+
+    status = fatx_fuse_open_file(pd, ino, fi);
+    if (status)
+    {
+        fuse_reply_err(req, status);
+        return;
+    }
+
+    fuse_reply_open(req, fi);
+}
+
+/*
+ * Close a file.
+ */
+void fatx_fuse_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fatx_file *file;
+    int status;
+
+    fatx_debug(pd->fs, "fatx_fuse_release(ino=%lu)\n", ino);
+
+    file = fatx_fuse_get_file(fi);
+    status = fatx_file_close(pd->fs, file);
+    free(file);
+
+    fuse_reply_err(req, status == FATX_STATUS_SUCCESS ? 0 : EIO);
+}
+
+/*
+ * Sync a file.
+ */
+void fatx_fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    int status;
+
+    fatx_debug(pd->fs, "fatx_fuse_fsync(ino=%lu, datasync=%d)\n", ino, datasync);
+
+    status = fatx_file_fsync(pd->fs, fatx_fuse_get_file(fi));
+    fuse_reply_err(req, status == FATX_STATUS_SUCCESS ? 0 : EIO);
+}
+
+/*
+ * Find where size bytes at offset of a file are on the device, allocating
+ * them first for a write. Returns a buffer vector pointing at them, which
+ * the caller frees, or NULL on failure with *status set to an errno value.
+ * The caller must hold data_lock.
+ */
+static struct fuse_bufvec *fatx_fuse_map_file(struct fatx_fuse_private_data *pd, struct fatx_file *file, off_t offset, size_t size, bool write, int *status)
+{
+    struct fatx_file_span *spans;
+    struct fuse_bufvec *bufv;
+    size_t num_spans, i;
+    int bytes;
+
+    /* The range can touch no more clusters than this, so it is never cut short. */
+    num_spans = size / pd->fs->bytes_per_cluster + 2;
+
+    spans = malloc(num_spans * sizeof(*spans));
+    bufv  = malloc(sizeof(*bufv) + num_spans * sizeof(struct fuse_buf));
+    if (!spans || !bufv)
+    {
+        *status = ENOMEM;
+        goto error;
+    }
+
+    bytes = fatx_file_map(pd->fs, file, offset, size, write, spans, &num_spans);
+    if (bytes < 0)
+    {
+        *status = fatx_fuse_errno(bytes);
+        goto error;
+    }
+
+    bufv->count = num_spans;
+    bufv->idx   = 0;
+    bufv->off   = 0;
+
+    for (i = 0; i < num_spans; i++)
+    {
+        bufv->buf[i].size  = spans[i].size;
+        bufv->buf[i].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        bufv->buf[i].mem   = NULL;
+        bufv->buf[i].fd    = pd->device_fd;
+        bufv->buf[i].pos   = spans[i].offset;
+    }
+
+    free(spans);
+    return bufv;
+
+error:
+    free(spans);
+    free(bufv);
+    return NULL;
+}
+
+/*
+ * Read from a file.
+ *
+ * When the device has a file descriptor, the reply points into it and the
+ * kernel splices the data across without it being copied through here.
+ */
+void fatx_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fuse_bufvec *bufv;
+    char *buf;
+    int status;
+
+    fatx_debug(pd->fs, "fatx_fuse_read(ino=%lu, size=0x%zx, offset=0x%zx)\n", ino, size, offset);
+
+    if (pd->device_fd >= 0)
+    {
+        pthread_rwlock_rdlock(&pd->data_lock);
+
+        bufv = fatx_fuse_map_file(pd, fatx_fuse_get_file(fi), offset, size, false, &status);
+        if (bufv == NULL)
+        {
+            fuse_reply_err(req, status);
+        }
+        else if (bufv->count == 0)
+        {
+            fuse_reply_buf(req, NULL, 0);
+        }
+        else
+        {
+            fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+        }
+
+        pthread_rwlock_unlock(&pd->data_lock);
+        free(bufv);
+        return;
+    }
+
+    buf = malloc(size);
+    if (buf == NULL)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    status = fatx_file_pread(pd->fs, fatx_fuse_get_file(fi), offset, size, buf);
+    if (status < 0)
+    {
+        fuse_reply_err(req, fatx_fuse_errno(status));
+    }
+    else
+    {
+        fuse_reply_buf(req, buf, status);
+    }
+
+    free(buf);
+}
+
+/*
+ * Write to a file.
+ *
+ * The data may still be in the pipe it was spliced into from the kernel.
+ * When the device has a file descriptor, it goes straight from there to the
+ * clusters it belongs in; otherwise it is copied out and written as usual.
+ */
+void fatx_fuse_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset, struct fuse_file_info *fi)
+{
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fatx_file *file = fatx_fuse_get_file(fi);
+    struct fuse_bufvec *dst;
+    struct fuse_bufvec mem = FUSE_BUFVEC_INIT(0);
+    size_t size = fuse_buf_size(bufv);
+    const void *buf;
+    char *copy = NULL;
+    ssize_t copied;
+    int status;
+
+    fatx_debug(pd->fs, "fatx_fuse_write_buf(ino=%lu, size=0x%zx, offset=0x%zx)\n", ino, size, offset);
+
+    if (pd->device_fd >= 0)
+    {
+        pthread_rwlock_rdlock(&pd->data_lock);
+
+        dst = fatx_fuse_map_file(pd, file, offset, size, true, &status);
+        if (dst == NULL)
+        {
+            pthread_rwlock_unlock(&pd->data_lock);
+            fuse_reply_err(req, status);
+            return;
+        }
+
+        copied = size ? fuse_buf_copy(dst, bufv, 0) : 0;
+        if (copied > 0)
+        {
+            fatx_file_mark_written(pd->fs, file, offset, copied);
+        }
+
+        pthread_rwlock_unlock(&pd->data_lock);
+        free(dst);
+
+        if (copied < 0)
+        {
+            fuse_reply_err(req, -copied);
+            return;
+        }
+
+        fuse_reply_write(req, copied);
+
+        if (copied > 0)
+        {
+            fatx_fuse_invalidate_attr(pd, ino);
+        }
+        return;
+    }
+
+    if (bufv->count == 1 && !(bufv->buf[0].flags & FUSE_BUF_IS_FD))
+    {
+        buf = bufv->buf[0].mem;
+    }
+    else
+    {
+        copy = malloc(size);
+        if (copy == NULL)
+        {
+            fuse_reply_err(req, ENOMEM);
+            return;
+        }
+
+        mem.buf[0].mem  = copy;
+        mem.buf[0].size = size;
+
+        copied = fuse_buf_copy(&mem, bufv, 0);
+        if (copied < 0)
+        {
+            free(copy);
+            fuse_reply_err(req, -copied);
+            return;
+        }
 
-        context = fuse_get_context();
-        stbuf->st_uid = context->uid;
-        stbuf->st_gid = context->gid;
-        stbuf->st_mode = S_IFDIR | 0777;
-        stbuf->st_nlink = 1;
-        return 0;
+        buf  = copy;
+        size = copied;
     }
 
-    status = fatx_get_attr(pd->fs, path, &attr);
+    status = fatx_file_pwrite(pd->fs, file, offset, size, buf);
+    free(copy);
 
-    switch (status)
+    if (status < 0)
     {
-    case FATX_STATUS_SUCCESS:
-        break;
-
-    case FATX_STATUS_FILE_NOT_FOUND:
-        return -ENOENT;
-
-    default:
-        return -1;
+        fuse_reply_err(req, fatx_fuse_errno(status));
+        return;
     }
 
-    fatx_attr_to_stat(&attr, stbuf);
+    fuse_reply_write(req, status);
 
-    return 0;
+    if (status > 0)
+    {
+        fatx_fuse_invalidate_attr(pd, ino);
+    }
 }
 
 /*
- * Open a file.
+ * Get the readdir offset of an iterator position. Offsets 0 to 2 are taken
+ * by the start of the directory, "." and "..".
  */
-int fatx_fuse_open(const char *path, struct fuse_file_info *fi)
+static off_t fatx_fuse_dir_offset(struct fatx_fuse_private_data *pd, struct fatx_dir const *dir)
 {
-    struct fatx_fuse_private_data *pd;
-    struct fatx_attr attr;
-    int status;
+    return 3 + (off_t)dir->cluster * (pd->inodes.entries_per_cluster + 1) + dir->entry;
+}
+
+static void fatx_fuse_dir_position(struct fatx_fuse_private_data *pd, off_t offset, struct fatx_dir *dir)
+{
+    dir->cluster = (offset - 3) / (pd->inodes.entries_per_cluster + 1);
+    dir->entry   = (offset - 3) % (pd->inodes.entries_per_cluster + 1);
+}
 
-    pd = fatx_fuse_get_private_data();
-    if (pd == NULL) return -1;
+/*
+ * A readdir reply being put together.
+ */
+struct fatx_fuse_dir_reply {
+    char                    *buf;
+    size_t                   size;
+    size_t                   pos;
+    bool                     plus;
+};
 
-    fatx_debug(pd->fs, "fatx_fuse_open(path=\"%s\")\n", path);
+/*
+ * Check whether another entry fits into a readdir reply.
+ */
+static bool fatx_fuse_dir_fits(fuse_req_t req, struct fatx_fuse_dir_reply *reply, char const *name)
+{
+    size_t len;
 
-    if((fi->flags & O_CREAT) == O_CREAT)
+#if FUSE_USE_VERSION >= 30
+    if (reply->plus)
     {
-        status = fatx_mknod(pd->fs, path);
-        if (status) return -ENFILE;
+        len = fuse_add_direntry_plus(req, NULL, 0, name, NULL, 0);
     }
-
-    status = fatx_get_attr(pd->fs, path, &attr);
-
-    switch (status)
+    else
+#endif
     {
-    case FATX_STATUS_SUCCESS:
-        return 0;
-
-    case FATX_STATUS_FILE_NOT_FOUND:
-        return -ENOENT;
-
-    default:
-        return -1;
+        len = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
     }
+
+    return len <= reply->size - reply->pos;
 }
 
 /*
- * Read from a file.
+ * Add an entry that fits to a readdir reply.
  */
-int fatx_fuse_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+static void fatx_fuse_dir_add(fuse_req_t req, struct fatx_fuse_dir_reply *reply, char const *name, struct fuse_entry_param const *entry, off_t next)
 {
-    struct fatx_fuse_private_data *pd;
-
-    pd = fatx_fuse_get_private_data();
-    if (pd == NULL) return -1;
-
-    fatx_debug(pd->fs, "fatx_fuse_read(path=\"%s\", buf=0x%p, size=0x%zx, offset=0x%zx)\n", path, (void*)buf, size, offset);
+#if FUSE_USE_VERSION >= 30
+    if (reply->plus)
+    {
+        reply->pos += fuse_add_direntry_plus(req, reply->buf + reply->pos, reply->size - reply->pos, name, entry, next);
+        return;
+    }
+#endif
 
-    return fatx_read(pd->fs, path, offset, size, buf);
+    reply->pos += fuse_add_direntry(req, reply->buf + reply->pos, reply->size - reply->pos, name, &entry->attr, next);
 }
 
 /*
- * Write to a file.
+ * Open a directory.
  */
-int fatx_fuse_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+void fatx_fuse_open_dir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    struct fatx_fuse_private_data *pd;
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fatx_fuse_dir_handle *handle;
+    struct fatx_fuse_inode *inode;
+    size_t cluster = 0;
+
+    fatx_debug(pd->fs, "fatx_fuse_open_dir(ino=%lu)\n", ino);
+
+    pthread_mutex_lock(&pd->inodes.lock);
+    inode = fatx_fuse_get_dir(pd, ino);
+    if (inode)
+    {
+        cluster = inode->first_cluster;
+    }
+    pthread_mutex_unlock(&pd->inodes.lock);
+
+    if (!inode)
+    {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
 
-    pd = fatx_fuse_get_private_data();
-    if (pd == NULL) return -1;
+    handle = malloc(sizeof(struct fatx_fuse_dir_handle));
+    if (!handle || fatx_dir_iter_init(pd->fs, cluster, &handle->iter))
+    {
+        free(handle);
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
 
-    fatx_debug(pd->fs, "fatx_fuse_write(path=\"%s\", buf=0x%p, size=0x%zx, offset=0x%zx)\n", path, (void*)buf, size, offset);
+    handle->cluster = cluster;
+    handle->offset  = 2;
 
-    return fatx_write(pd->fs, path, offset, size, buf);
+    fi->fh = (uintptr_t)handle;
+    fuse_reply_open(req, fi);
 }
 
 /*
- * Remove a file.
+ * Read the next directory entries, with their attributes for readdirplus.
+ *
+ * The offset of an entry is made from the position of the next one, so a
+ * listing picks up where it left off without scanning the directory again,
+ * and only one cluster of it is held at a time.
  */
-int fatx_fuse_unlink(char const *path)
+static void fatx_fuse_list_dir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi, bool plus)
 {
-    struct fatx_fuse_private_data *pd;
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fatx_fuse_dir_handle *handle = (struct fatx_fuse_dir_handle *)(uintptr_t)fi->fh;
+    struct fatx_fuse_inode *inode, *child;
+    struct fatx_fuse_dir_reply reply;
+    struct fuse_entry_param entry;
+    struct fatx_attr attr;
+    struct fatx_dir dir, location;
+    fuse_ino_t parent = FUSE_ROOT_ID;
+    off_t next;
     int status;
 
-    pd = fatx_fuse_get_private_data();
-    if (pd == NULL) return -1;
+    pthread_mutex_lock(&pd->inodes.lock);
+    inode = fatx_fuse_get_dir(pd, ino);
+    if (inode && inode->parent)
+    {
+        parent = inode->parent->ino;
+    }
+    pthread_mutex_unlock(&pd->inodes.lock);
 
-    fatx_debug(pd->fs, "fatx_fuse_unlink(path=\"%s\")\n", path);
-    status = fatx_unlink(pd->fs, path);
+    /* A removed directory is empty. */
+    if (!inode)
+    {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
 
-    switch (status)
+    reply.buf  = malloc(size);
+    reply.size = size;
+    reply.pos  = 0;
+    reply.plus = plus;
+    if (reply.buf == NULL)
     {
-    case FATX_STATUS_SUCCESS:
-        return 0;
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
 
-    case FATX_STATUS_FILE_NOT_FOUND:
-        return -ENOENT;
+    /* The kernel doesn't count lookups of "." and "..". */
+    memset(&entry, 0, sizeof(entry));
+    entry.attr.st_mode = S_IFDIR;
 
-    default:
-        return -1;
+    if (offset < 1)
+    {
+        if (!fatx_fuse_dir_fits(req, &reply, ".")) goto reply;
+        entry.ino = entry.attr.st_ino = ino;
+        fatx_fuse_dir_add(req, &reply, ".", &entry, 1);
     }
-}
 
-/*
- * Create a directory.
- */
-int fatx_fuse_mkdir(const char *path, mode_t mode)
-{
-    struct fatx_fuse_private_data *pd;
-    int status;
+    if (offset < 2)
+    {
+        if (!fatx_fuse_dir_fits(req, &reply, "..")) goto reply;
+        entry.ino = entry.attr.st_ino = parent;
+        fatx_fuse_dir_add(req, &reply, "..", &entry, 2);
+    }
 
-    pd = fatx_fuse_get_private_data();
-    if (pd == NULL) return -1;
+    /* Move the iterator, unless the listing goes on from where it stopped. */
+    if (offset < 2)
+    {
+        offset = 2;
+    }
+    if (offset != handle->offset)
+    {
+        if (offset == 2)
+        {
+            dir.cluster = handle->cluster;
+            dir.entry   = 0;
+        }
+        else
+        {
+            fatx_fuse_dir_position(pd, offset, &dir);
+        }
 
-    fatx_debug(pd->fs, "fatx_fuse_mkdir(path=\"%s\", mode=0%o)\n", path, mode);
+        if (fatx_dir_iter_seek(pd->fs, &handle->iter, &dir))
+        {
+            free(reply.buf);
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        handle->offset = offset;
+    }
 
-    status = fatx_mkdir(pd->fs, path);
-    return (status == FATX_STATUS_SUCCESS ? 0 : -1);
-}
+    while (1)
+    {
+        dir = handle->iter.dir;
 
-/*
- * Remove a directory.
- */
-int fatx_fuse_rmdir(const char *path)
-{
-    struct fatx_fuse_private_data *pd;
-    int status;
+        status = fatx_dir_iter_next(pd->fs, &handle->iter, &attr);
+        if (status == FATX_STATUS_SUCCESS && !fatx_fuse_dir_fits(req, &reply, attr.filename))
+        {
+            fatx_dir_iter_seek(pd->fs, &handle->iter, &dir);
+            break;
+        }
+        else if (status == FATX_STATUS_END_OF_DIR)
+        {
+            fatx_dir_iter_seek(pd->fs, &handle->iter, &dir);
+            break;
+        }
+        else if (status)
+        {
+            fatx_dir_iter_seek(pd->fs, &handle->iter, &dir);
 
-    pd = fatx_fuse_get_private_data();
-    if (pd == NULL) return -1;
+            /* Report the error once the entries read so far are taken. */
+            if (reply.pos == 0)
+            {
+                free(reply.buf);
+                fuse_reply_err(req, EIO);
+                return;
+            }
+            break;
+        }
 
-    fatx_debug(pd->fs, "fatx_fuse_mkdir(path=\"%s\")\n", path);
+        next = fatx_fuse_dir_offset(pd, &handle->iter.dir);
 
-    status = fatx_rmdir(pd->fs, path);
-    switch (status)
-    {
-    case FATX_STATUS_SUCCESS:
-        return 0;
-    case FATX_STATUS_END_OF_DIR:
-        return -ENOTEMPTY;
-    case FATX_STATUS_ERROR:
-    default:
-        return -1;
+        if (plus)
+        {
+            /* The entry was the last one read, just before the iterator. */
+            location.cluster = handle->iter.dir.cluster;
+            location.entry   = handle->iter.dir.entry - 1;
+
+            pthread_mutex_lock(&pd->inodes.lock);
+            inode = fatx_fuse_get_dir(pd, ino);
+            child = inode ? fatx_fuse_inode_add(pd, inode, &location, &attr) : NULL;
+            pthread_mutex_unlock(&pd->inodes.lock);
+
+            if (!child)
+            {
+                fatx_dir_iter_seek(pd->fs, &handle->iter, &dir);
+                break;
+            }
+
+            memset(&entry, 0, sizeof(entry));
+            entry.ino           = child->ino;
+            entry.attr_timeout  = pd->attr_timeout;
+            entry.entry_timeout = pd->entry_timeout;
+            fatx_fuse_attr_to_stat(pd, child->ino, &attr, &entry.attr);
+        }
+        else
+        {
+            /* The kernel looks the entry up for anything but its type. */
+            memset(&entry, 0, sizeof(entry));
+            entry.attr.st_mode = (attr.attributes & FATX_ATTR_DIRECTORY) ? S_IFDIR : S_IFREG;
+            entry.attr.st_ino  = -1;
+        }
+
+        fatx_fuse_dir_add(req, &reply, attr.filename, &entry, next);
+        handle->offset = next;
     }
+
+reply:
+    fuse_reply_buf(req, reply.buf, reply.pos);
+    free(reply.buf);
 }
 
 /*
- * Create a file.
+ * Read the next directory entries.
  */
-int fatx_fuse_mknod(const char *path, mode_t mode, dev_t dev)
+void fatx_fuse_read_dir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    struct fatx_fuse_private_data *pd;
-    int status;
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
 
-    pd = fatx_fuse_get_private_data();
-    if (pd == NULL) return -1;
+    fatx_debug(pd->fs, "fatx_fuse_read_dir(ino=%lu, size=0x%zx, offset=0x%zx)\n", ino, size, offset);
 
-    fatx_debug(pd->fs, "fatx_fuse_mknod(path=\"%s\", mode=0%o, dev=0x%x)\n", path, mode, dev);
-
-    status = fatx_mknod(pd->fs, path);
-    return (status == FATX_STATUS_SUCCESS ? 0 : -1);
+    fatx_fuse_list_dir(req, ino, size, offset, fi, false);
 }
 
+#if FUSE_USE_VERSION >= 30
 /*
- * Truncate a file.
+ * Read the next directory entries along with their attributes, and count a
+ * lookup of each, so the kernel doesn't have to look them up one by one.
  */
-int fatx_fuse_truncate(const char *path, off_t size)
+void fatx_fuse_read_dir_plus(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    struct fatx_fuse_private_data *pd;
-    int status;
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
 
-    pd = fatx_fuse_get_private_data();
-    if(pd == NULL) return -1;
+    fatx_debug(pd->fs, "fatx_fuse_read_dir_plus(ino=%lu, size=0x%zx, offset=0x%zx)\n", ino, size, offset);
 
-    fatx_debug(pd->fs, "fatx_fuse_truncate(path=\"%s\", size=0x%x)\n", path, size);
-
-    status = fatx_truncate(pd->fs, path, size);
-    return (status == FATX_STATUS_SUCCESS ? 0 : -1);
+    fatx_fuse_list_dir(req, ino, size, offset, fi, true);
 }
+#endif
 
 /*
- * Rename a file.
+ * Close a directory.
  */
-int fatx_fuse_rename(const char *from, const char *to)
+void fatx_fuse_release_dir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
 {
-    struct fatx_fuse_private_data *pd;
-    int status;
-
-    pd = fatx_fuse_get_private_data();
-    if(pd == NULL) return -1;
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fatx_fuse_dir_handle *handle = (struct fatx_fuse_dir_handle *)(uintptr_t)fi->fh;
 
-    fatx_debug(pd->fs, "fatx_fuse_rename(from=\"%s\", to=\"%s\")\n", from, to);
-
-    status = fatx_rename(pd->fs, from, to, false, false);
-    return (status == FATX_STATUS_SUCCESS ? 0 : -1);
+    fatx_dir_iter_close(pd->fs, &handle->iter);
+    free(handle);
+    fuse_reply_err(req, 0);
 }
 
 /*
- * Set access and modification time for a file
+ * Report the size of the filesystem and how much of it is free.
  */
-int fatx_fuse_utimens(const char *path, const struct timespec ts[2])
+void fatx_fuse_statfs(fuse_req_t req, fuse_ino_t ino)
 {
-    struct fatx_fuse_private_data *pd;
-    struct fatx_ts fat_time[2];
+    struct fatx_fuse_private_data *pd = fuse_req_userdata(req);
+    struct fatx_statfs fst;
+    struct statvfs stbuf;
     int status;
 
-    pd = fatx_fuse_get_private_data();
-    if(pd == NULL) return -1;
+    fatx_debug(pd->fs, "fatx_fuse_statfs(ino=%lu)\n", ino);
+
+    status = fatx_statfs(pd->fs, &fst);
+    if (status)
+    {
+        fuse_reply_err(req, fatx_fuse_errno(status));
+        return;
+    }
 
-    fatx_time_t_to_fatx_ts(ts[0].tv_sec, &(fat_time[0]));
-    fatx_time_t_to_fatx_ts(ts[1].tv_sec, &(fat_time[1]));
-    status = fatx_utime(pd->fs, path, fat_time);
-    return (status == FATX_STATUS_SUCCESS ? 0 : -1);
+    memset(&stbuf, 0, sizeof(stbuf));
+    stbuf.f_bsize   = fst.bytes_per_cluster;
+    stbuf.f_frsize  = fst.bytes_per_cluster;
+    stbuf.f_blocks  = fst.total_clusters;
+    stbuf.f_bfree   = fst.free_clusters;
+    stbuf.f_bavail  = fst.free_clusters;
+    stbuf.f_files   = fst.total_dirents;
+    stbuf.f_ffree   = fst.free_dirents;
+    stbuf.f_favail  = fst.free_dirents;
+    stbuf.f_namemax = FATX_MAX_FILENAME_LEN;
+
+    fuse_reply_statfs(req, &stbuf);
 }
 
 /*
@@ -588,17 +2025,9 @@ int fatx_fuse_opt_proc(void *data, const char *arg, int key, struct fuse_args *o
             pd->device_path = arg;
             return 0;
         }
-        /* Copy second non option arg (mount point) */
-        else if (pd->mount_point == NULL)
-        {
-            pd->mount_point = malloc(strlen(arg)+1);
-            strcpy(pd->mount_point, arg);
-            /* Pass it to FUSE */
-            return 1;
-        }
         else
         {
-            /* Pass it on to FUSE. */
+            /* Pass it (and the mount point) on to FUSE. */
             return 1;
         }
         break;
@@ -663,6 +2092,54 @@ int fatx_fuse_opt_proc(void *data, const char *arg, int key, struct fuse_args *o
         pd->log_level = strtol(arg, NULL, 0);
         return 0;
 
+    case FATX_FUSE_OPT_KEY_FAT_MIRROR:
+        pd->open_options.flags |= FATX_OPEN_FAT_MIRROR;
+        return 0;
+
+    case FATX_FUSE_OPT_KEY_FAT_CACHE_SIZE:
+        arg = fatx_fuse_opt_consume_key(arg);
+        pd->open_options.fat_cache_size = strtol(arg, NULL, 0);
+        return 0;
+
+    case FATX_FUSE_OPT_KEY_DIR_CACHE_SIZE:
+        arg = fatx_fuse_opt_consume_key(arg);
+        pd->open_options.dir_cache_size = strtol(arg, NULL, 0);
+        return 0;
+
+    case FATX_FUSE_OPT_KEY_READ_ONLY:
+        pd->open_options.flags |= FATX_OPEN_READ_ONLY;
+        return 0;
+
+    case FATX_FUSE_OPT_KEY_MMAP:
+        pd->open_options.flags |= FATX_OPEN_READ_ONLY | FATX_OPEN_MMAP;
+        return 0;
+
+    case FATX_FUSE_OPT_KEY_IO_URING:
+        pd->open_options.flags |= FATX_OPEN_IO_URING;
+        return 0;
+
+    case FATX_FUSE_OPT_KEY_IGNORE_CASE:
+        pd->open_options.flags |= FATX_OPEN_IGNORE_CASE;
+        return 0;
+
+    case FATX_FUSE_OPT_KEY_ENTRY_TIMEOUT:
+        arg = fatx_fuse_opt_consume_key(arg);
+        pd->entry_timeout = strtod(arg, NULL);
+        return 0;
+
+    case FATX_FUSE_OPT_KEY_ATTR_TIMEOUT:
+        arg = fatx_fuse_opt_consume_key(arg);
+        pd->attr_timeout = strtod(arg, NULL);
+        return 0;
+
+    case FATX_FUSE_OPT_KEY_NO_KEEP_CACHE:
+        pd->keep_cache = false;
+        return 0;
+
+    case FATX_FUSE_OPT_KEY_DISCARD:
+        pd->open_options.flags |= FATX_OPEN_DISCARD;
+        return 0;
+
     default:
         /* Pass it on to FUSE. */
         return 1;
@@ -688,7 +2165,10 @@ void fatx_fuse_print_version(void)
  */
 void fatx_fuse_print_usage(void)
 {
+#if FUSE_USE_VERSION < 30
     char *argv[2];
+    struct fuse_args args = FUSE_ARGS_INIT(2, argv);
+#endif
 
     /* Print basic usage */
     fprintf(stderr, "FATXFS - Userspace FATX Filesystem Driver\n\n");
@@ -705,17 +2185,155 @@ void fatx_fuse_print_usage(void)
                     "    --size=<size>                  specify the size (in bytes) of a partition manually\n"
                     "    --sector-size=<size>           specify the size (in bytes) of a device sector (default is 512)\n"
                     "    --log=<log path>               enable fatxfs logging\n"
-                    "    --loglevel=<level>             control the log output level (a higher value yields more output)\n\n"
+                    "    --loglevel=<level>             control the log output level (a higher value yields more output)\n"
+                    "    --fat-mirror                   load the entire FAT into memory when mounting\n"
+                    "    --fat-cache-size=<size>        specify the size (in bytes) of the FAT cache (default is 1 MiB)\n"
+                    "    --dir-cache-size=<size>        specify the size (in bytes) of the directory cache (default is 1 MiB)\n"
+                    "    --read-only                    mount the partition read-only\n"
+                    "    --mmap                         mount the partition read-only, reading it through a memory mapping\n"
+                    "    --io-uring                     do device I/O through io_uring, where available\n"
+                    "    --ignore-case                  match file names without regard to case\n"
+                    "    --entry-timeout=<seconds>      specify how long the kernel may cache names (default is 60)\n"
+                    "    --attr-timeout=<seconds>       specify how long the kernel may cache attributes (default is 60)\n"
+                    "    --no-keep-cache                drop the cached contents of a file whenever it is opened\n"
+                    "    --discard                      discard the clusters of deleted files on the device\n\n"
                     "Disk formatting options:\n"
                     "    --format=<format>              specify the format (retail, f-takes-all) to initialize the device to\n"
                     "    --sectors-per-cluster=<size>   specify the sectors per cluster when initializing non-retail partitions (default is 128)\n"
                     "    --destroy-all-existing-data    acknowledge that device formatting will destroy all existing data\n\n");
 
     /* Print FUSE options */
+#if FUSE_USE_VERSION >= 30
+    fuse_cmdline_help();
+    fuse_lowlevel_help();
+#else
     argv[0] = prog_short_name;
     argv[1] = "-ho";
-    fuse_main(2, argv, &fatx_fuse_oper, NULL);
+    fuse_parse_cmdline(&args, NULL, NULL, NULL);
+    fuse_mount(NULL, &args);
+    fuse_lowlevel_new(&args, &fatx_fuse_oper, sizeof(fatx_fuse_oper), NULL);
+    fuse_opt_free_args(&args);
+#endif
+}
+
+
+/*
+ * Show the progress of a format as one status line on the terminal.
+ */
+void fatx_fuse_format_progress(void *ctx, size_t partition, uint64_t done, uint64_t total)
+{
+    static char const letters[] = "xyzcef";
+    struct fatx_fuse_format_progress *progress = ctx;
+    unsigned int percent;
+    size_t i;
+
+    percent = total ? (unsigned int)(done * 100 / total) : 100;
+    if (partition >= progress->num_partitions || percent == progress->percent[partition])
+    {
+        return;
+    }
+
+    progress->percent[partition] = percent;
+
+    fprintf(stderr, "\rformatting:");
+    for (i = 0; i < progress->num_partitions; i++)
+    {
+        fprintf(stderr, " %c %3u%%", letters[i], progress->percent[i]);
+    }
+    fflush(stderr);
+}
+
+
+#if FUSE_USE_VERSION >= 30
+/*
+ * Mount the filesystem and serve requests until it is unmounted.
+ */
+static int fatx_fuse_run(struct fatx_fuse_private_data *pd, struct fuse_args *args)
+{
+    struct fuse_cmdline_opts opts;
+    struct fuse_session *se;
+    int status = -1;
+
+    if (fuse_parse_cmdline(args, &opts) != 0)
+    {
+        return -1;
+    }
+
+    if (opts.mountpoint == NULL)
+    {
+        fprintf(stderr, "please specify mount point\n");
+        return -1;
+    }
+
+    se = fuse_session_new(args, &fatx_fuse_oper, sizeof(fatx_fuse_oper), pd);
+    if (se != NULL)
+    {
+        if (fuse_set_signal_handlers(se) == 0)
+        {
+            if (fuse_session_mount(se, opts.mountpoint) == 0)
+            {
+                pd->se = se;
+
+                if (fuse_daemonize(opts.foreground) == 0)
+                {
+                    status = opts.singlethread ? fuse_session_loop(se) : fuse_session_loop_mt(se, opts.clone_fd);
+                }
+
+                fuse_session_unmount(se);
+            }
+            fuse_remove_signal_handlers(se);
+        }
+        fuse_session_destroy(se);
+    }
+
+    free(opts.mountpoint);
+    return status;
+}
+#else
+/*
+ * Mount the filesystem and serve requests until it is unmounted.
+ */
+static int fatx_fuse_run(struct fatx_fuse_private_data *pd, struct fuse_args *args)
+{
+    struct fuse_session *se;
+    struct fuse_chan *ch;
+    char *mount_point = NULL;
+    int multithreaded, foreground;
+    int status = -1;
+
+    if (fuse_parse_cmdline(args, &mount_point, &multithreaded, &foreground) == -1)
+    {
+        return -1;
+    }
+
+    ch = fuse_mount(mount_point, args);
+    if (ch != NULL)
+    {
+        se = fuse_lowlevel_new(args, &fatx_fuse_oper, sizeof(fatx_fuse_oper), pd);
+        if (se != NULL)
+        {
+            if (fuse_set_signal_handlers(se) != -1)
+            {
+                fuse_session_add_chan(se, ch);
+                pd->ch = ch;
+
+                if (fuse_daemonize(foreground) != -1)
+                {
+                    status = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+                }
+
+                fuse_remove_signal_handlers(se);
+                fuse_session_remove_chan(ch);
+            }
+            fuse_session_destroy(se);
+        }
+        fuse_unmount(mount_point, ch);
+    }
+
+    free(mount_point);
+    return status;
 }
+#endif
 
 /*
  * Program entry point.
@@ -724,7 +2342,10 @@ int main(int argc, char *argv[])
 {
     struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
     struct fatx_fuse_private_data pd;
-    int status;
+    struct fatx_fuse_format_progress format_progress;
+    struct fatx_format_options format_options;
+    bool device_open = false, lock_ready = false, inodes_ready = false;
+    int status, retval = 1;
 
     prog_short_name = basename(argv[0]);
 
@@ -743,6 +2364,17 @@ int main(int argc, char *argv[])
         FUSE_OPT_KEY("--destroy-all-existing-data",  FATX_FUSE_OPT_KEY_DESTROY_DATA),
         FUSE_OPT_KEY("--log=",                       FATX_FUSE_OPT_KEY_LOG),
         FUSE_OPT_KEY("--loglevel=",                  FATX_FUSE_OPT_KEY_LOGLEVEL),
+        FUSE_OPT_KEY("--fat-mirror",                 FATX_FUSE_OPT_KEY_FAT_MIRROR),
+        FUSE_OPT_KEY("--fat-cache-size=",            FATX_FUSE_OPT_KEY_FAT_CACHE_SIZE),
+        FUSE_OPT_KEY("--dir-cache-size=",            FATX_FUSE_OPT_KEY_DIR_CACHE_SIZE),
+        FUSE_OPT_KEY("--read-only",                  FATX_FUSE_OPT_KEY_READ_ONLY),
+        FUSE_OPT_KEY("--mmap",                       FATX_FUSE_OPT_KEY_MMAP),
+        FUSE_OPT_KEY("--io-uring",                   FATX_FUSE_OPT_KEY_IO_URING),
+        FUSE_OPT_KEY("--ignore-case",                FATX_FUSE_OPT_KEY_IGNORE_CASE),
+        FUSE_OPT_KEY("--entry-timeout=",             FATX_FUSE_OPT_KEY_ENTRY_TIMEOUT),
+        FUSE_OPT_KEY("--attr-timeout=",              FATX_FUSE_OPT_KEY_ATTR_TIMEOUT),
+        FUSE_OPT_KEY("--no-keep-cache",              FATX_FUSE_OPT_KEY_NO_KEEP_CACHE),
+        FUSE_OPT_KEY("--discard",                    FATX_FUSE_OPT_KEY_DISCARD),
         FUSE_OPT_END,
     };
 
@@ -753,18 +2385,21 @@ int main(int argc, char *argv[])
     pd.device_sector_size         = 512;
     pd.device_sectors_per_cluster = 128;
     pd.log_level                  = FATX_LOG_LEVEL_INFO;
+    pd.entry_timeout              = FATX_FUSE_DEFAULT_ENTRY_TIMEOUT;
+    pd.attr_timeout               = FATX_FUSE_DEFAULT_ATTR_TIMEOUT;
+    pd.keep_cache                 = true;
 
     /* Parse command line arguments. */
     if (fuse_opt_parse(&args, &pd, opts, &fatx_fuse_opt_proc) != 0)
     {
-        return -1;
+        goto cleanup;
     }
 
     /* Check */
     if (pd.device_path == NULL)
     {
         fprintf(stderr, "please specify device path\n");
-        goto error_nofs;
+        goto cleanup;
     }
 
     if (pd.mount_partition_offset != -1 || pd.mount_partition_size != -1)
@@ -774,19 +2409,19 @@ int main(int argc, char *argv[])
         if (pd.mount_partition_drive != 0x00)
         {
             fprintf(stderr, "--drive cannot be used with --offset or --size\n");
-            goto error_nofs;
+            goto cleanup;
         }
 
         if (pd.mount_partition_offset == -1)
         {
             fprintf(stderr, "please specify partition offset\n");
-            goto error_nofs;
+            goto cleanup;
         }
 
         if (pd.mount_partition_size == -1)
         {
             fprintf(stderr, "please specify partition size\n");
-            goto error_nofs;
+            goto cleanup;
         }
     }
     else
@@ -803,7 +2438,7 @@ int main(int argc, char *argv[])
         if (status)
         {
             fprintf(stderr, "unknown drive letter '%c'\n", pd.mount_partition_drive);
-            goto error_nofs;
+            goto cleanup;
         }
     }
 
@@ -811,7 +2446,7 @@ int main(int argc, char *argv[])
     if (pd.fs == NULL)
     {
         fprintf(stderr, "no memory\n");
-        goto error_nofs;
+        goto cleanup;
     }
 
     /*
@@ -824,58 +2459,110 @@ int main(int argc, char *argv[])
         if (pd.log_handle == NULL)
         {
             fprintf(stderr, "failed to open %s for writing\n", pd.log_path);
-            goto error_fs;
+            goto cleanup;
         }
         setbuf(pd.log_handle, NULL);
-        fatx_log_init(pd.fs, pd.log_handle, pd.log_level);
     }
 
+    fatx_log_init(pd.fs, pd.log_handle, pd.log_level);
+
     /* Reformat the drive (if desired) */
     if (pd.format)
     {
         if (pd.format_confirm)
         {
-            return fatx_disk_format(pd.fs, pd.device_path, pd.device_sector_size, pd.format, pd.device_sectors_per_cluster);
+            memset(&format_progress, 0, sizeof(format_progress));
+            format_progress.num_partitions = (pd.format == FATX_FORMAT_F_TAKES_ALL) ? 6 : 5;
+
+            memset(&format_options, 0, sizeof(format_options));
+            if (isatty(fileno(stderr)))
+            {
+                format_options.progress     = fatx_fuse_format_progress;
+                format_options.progress_ctx = &format_progress;
+            }
+
+            status = fatx_disk_format_ex(pd.fs, pd.device_path, pd.device_sector_size, pd.format, pd.device_sectors_per_cluster, &format_options);
+
+            if (format_options.progress)
+            {
+                fprintf(stderr, "\n");
+            }
+
+            retval = status ? 1 : 0;
+            goto cleanup;
         }
         else
         {
             fprintf(stderr, "please specify --destroy-all-existing-data to perform device formatting\n");
-            goto error_fs;
+            goto cleanup;
         }
     }
     else if (pd.format_confirm)
     {
         fprintf(stderr, "--destroy-all-existing-data can only be used with --format\n");
-        goto error_fs;
+        goto cleanup;
     }
 
     /* Open the device */
-    status = fatx_open_device(pd.fs,
-                              pd.device_path,
-                              pd.mount_partition_offset,
-                              pd.mount_partition_size,
-                              pd.device_sector_size,
-                              FATX_READ_FROM_SUPERBLOCK);
+    status = fatx_open_device_ex(pd.fs,
+                                 pd.device_path,
+                                 pd.mount_partition_offset,
+                                 pd.mount_partition_size,
+                                 pd.device_sector_size,
+                                 FATX_READ_FROM_SUPERBLOCK,
+                                 &pd.open_options);
     if (status)
     {
         fprintf(stderr, "failed to initialize the filesystem\n");
-        goto error_fs;
+        goto cleanup;
+    }
+
+    device_open = true;
+
+    /* Let the kernel reject writes to a read-only mount up front. */
+    if (pd.open_options.flags & FATX_OPEN_READ_ONLY)
+    {
+        fuse_opt_add_arg(&args, "-oro");
+    }
+
+    pd.uid = getuid();
+    pd.gid = getgid();
+    pd.device_fd = fatx_device_fd(pd.fs);
+
+    if (pthread_rwlock_init(&pd.data_lock, NULL))
+    {
+        fprintf(stderr, "no memory\n");
+        goto cleanup;
     }
 
-    /* Force single threaded operation .*/
-    fuse_opt_insert_arg(&args, 1, "-s");
+    lock_ready = true;
 
-    return fuse_main(args.argc, args.argv, &fatx_fuse_oper, &pd);
+    if (fatx_fuse_inode_table_init(&pd))
+    {
+        fprintf(stderr, "no memory\n");
+        goto cleanup;
+    }
+
+    inodes_ready = true;
+
+    status = fatx_fuse_run(&pd, &args);
+    retval = status ? 1 : 0;
+
+cleanup:
+    /* The filesystem is cleaned up on unmount, unless it was never mounted. */
+    if (pd.fs)
+    {
+        if (inodes_ready) fatx_fuse_inode_table_free(&pd);
+        if (lock_ready)   pthread_rwlock_destroy(&pd.data_lock);
+        if (device_open)  fatx_close_device(pd.fs);
+        free(pd.fs);
+    }
 
-error_fs:
     if (pd.log_handle)
     {
         fclose(pd.log_handle);
-        pd.log_handle = NULL;
     }
 
-    free(pd.fs);
-error_nofs:
-    free(pd.mount_point);
-    return -1;
+    fuse_opt_free_args(&args);
+    return retval;
 }
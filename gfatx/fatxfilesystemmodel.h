@@ -48,8 +48,7 @@ protected:
 
     void populateFileNodeChildren(struct fatx_fs *fs, struct NodeBase *node)
     {
-        struct fatx_dir dir;
-        struct fatx_dirent dirent, *nextdirent;
+        struct fatx_dir_iter iter;
         struct fatx_attr attr;
         int s;
 
@@ -64,11 +63,11 @@ protected:
             path = fsnode->path.c_str();
         }
 
-        s = fatx_open_dir(fs, path, &dir);
+        s = fatx_dir_iter_open(fs, path, &iter);
         assert(s == FATX_STATUS_SUCCESS);
 
         for (int i = 0; true; i++) {
-            s = fatx_read_dir(fs, &dir, &dirent, &attr, &nextdirent);
+            s = fatx_dir_iter_next(fs, &iter, &attr);
             if (s != FATX_STATUS_SUCCESS) break;
 
             std::string child_path("");
@@ -85,12 +84,9 @@ protected:
             child->path = child_path;
             child->rowInParent = i;
             node->children.emplace_back(child);
-
-            s = fatx_next_dir_entry(fs, &dir);
-            if (s != FATX_STATUS_SUCCESS) break;
         }
 
-        fatx_close_dir(fs, &dir);
+        fatx_dir_iter_close(fs, &iter);
 
         // XXX: It would be better to populate this on demand when a user
         // expands a directory.
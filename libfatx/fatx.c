@@ -28,6 +28,16 @@
  * Open a device.
  */
 int fatx_open_device(struct fatx_fs *fs, char const *path, uint64_t offset, uint64_t size, size_t sector_size, size_t sectors_per_cluster)
+{
+    return fatx_open_device_ex(fs, path, offset, size, sector_size, sectors_per_cluster, NULL);
+}
+
+/*
+ * Open a device, with additional options.
+ *
+ * options may be NULL, in which case the defaults are used.
+ */
+int fatx_open_device_ex(struct fatx_fs *fs, char const *path, uint64_t offset, uint64_t size, size_t sector_size, size_t sectors_per_cluster, struct fatx_open_options const *options)
 {
     int retval = 0;
 
@@ -43,40 +53,61 @@ int fatx_open_device(struct fatx_fs *fs, char const *path, uint64_t offset, uint
         return FATX_STATUS_ERROR;
     }
 
+    fs->device_path      = path;
+    fs->sector_size      = sector_size;
+    fs->partition_offset = offset;
+    fs->open_flags       = options ? options->flags : 0;
+    fs->open_files       = NULL;
+    fs->removed_files    = 0;
+
+    /* A mapping is only ever read from. */
+    if (fs->open_flags & FATX_OPEN_MMAP)
+    {
+        fs->open_flags |= FATX_OPEN_READ_ONLY;
+    }
+
+    if (fatx_lock_init(fs))
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    if (fatx_dev_open(fs, options))
+    {
+        fatx_lock_free(fs);
+        return FATX_STATUS_ERROR;
+    }
+
     /* Compute partition size using remaining disk space and align down to nearest sector */
     if (size == -1)
     {
-        if (fatx_disk_size_remaining(path, offset, &size))
+        if (fatx_dev_size(fs, &size) || offset > size)
         {
             fatx_error(fs, "failed to resolve partition size");
-            return FATX_STATUS_ERROR;
+            retval = FATX_STATUS_ERROR;
+            goto cleanup;
         }
-        size &= ~(sector_size - 1);
+        size = (size - offset) & ~(sector_size - 1);
     }
 
     if (size % sector_size)
     {
         fatx_error(fs, "specified partition size does not reside on sector boundary (%d bytes)\n", sector_size);
-        return FATX_STATUS_ERROR;
+        retval = FATX_STATUS_ERROR;
+        goto cleanup;
     }
 
-    fs->device_path      = path;
-    fs->sector_size      = sector_size;
-    fs->partition_offset = offset;
-    fs->partition_size   = size;
-
-    memset(&fs->fat_cache, 0, sizeof(fs->fat_cache));
+    fs->partition_size = size;
 
-    fs->device = fopen(fs->device_path, "r+b");
-    if (!fs->device)
+    if ((fs->open_flags & FATX_OPEN_MMAP) && fatx_dev_map(fs))
     {
-        fatx_error(fs, "failed to open %s for reading and writing\n", path);
-        return FATX_STATUS_ERROR;
+        retval = FATX_STATUS_ERROR;
+        goto cleanup;
     }
 
     if (fatx_init_superblock(fs, sectors_per_cluster))
     {
-        return FATX_STATUS_ERROR;
+        retval = FATX_STATUS_ERROR;
+        goto cleanup;
     }
 
     /* Validate that an acceptable cluster+sector combo was configured */
@@ -153,11 +184,64 @@ int fatx_open_device(struct fatx_fs *fs, char const *path, uint64_t offset, uint
     fatx_info(fs, "  FAT Type:            %s\n",          fs->fat_type == FATX_FAT_TYPE_16 ? "16" : "32");
     fatx_info(fs, "  Root Cluster:        %d\n",          fs->root_cluster);
     fatx_info(fs, "  Cluster Offset:      0x%zx bytes\n", fs->cluster_offset);
+
+    if (fatx_init_fat_cache(fs, options))
+    {
+        retval = FATX_STATUS_ERROR;
+        goto cleanup;
+    }
+
+    if (fatx_free_map_init(fs))
+    {
+        fatx_free_fat_cache(fs);
+        retval = FATX_STATUS_ERROR;
+        goto cleanup;
+    }
+
+    if (fatx_extent_cache_init(fs))
+    {
+        fatx_free_map_free(fs);
+        fatx_free_fat_cache(fs);
+        retval = FATX_STATUS_ERROR;
+        goto cleanup;
+    }
+
+    if (fatx_init_dir_cache(fs, options))
+    {
+        fatx_extent_cache_free(fs);
+        fatx_free_map_free(fs);
+        fatx_free_fat_cache(fs);
+        retval = FATX_STATUS_ERROR;
+        goto cleanup;
+    }
+
+    if (fatx_dentry_cache_init(fs))
+    {
+        fatx_free_dir_cache(fs);
+        fatx_extent_cache_free(fs);
+        fatx_free_map_free(fs);
+        fatx_free_fat_cache(fs);
+        retval = FATX_STATUS_ERROR;
+        goto cleanup;
+    }
+
+    if (fatx_dir_index_init(fs))
+    {
+        fatx_dentry_cache_free(fs);
+        fatx_free_dir_cache(fs);
+        fatx_extent_cache_free(fs);
+        fatx_free_map_free(fs);
+        fatx_free_fat_cache(fs);
+        retval = FATX_STATUS_ERROR;
+        goto cleanup;
+    }
+
     return FATX_STATUS_SUCCESS;
 
     /* Close device. */
 cleanup:
-    fclose(fs->device);
+    fatx_dev_close(fs);
+    fatx_lock_free(fs);
     return retval;
 }
 
@@ -170,7 +254,68 @@ int fatx_close_device(struct fatx_fs *fs)
 
     fatx_debug(fs, "fatx_close_device()\n");
 
-    status = fatx_flush_fat_cache(fs);
-    fclose(fs->device);
+    status = fatx_file_flush_all(fs);
+    if (!status)
+    {
+        status = fatx_flush_dir_cache(fs);
+    }
+    if (!status)
+    {
+        status = fatx_flush_fat_cache(fs);
+    }
+    if (!status && !(fs->open_flags & FATX_OPEN_READ_ONLY))
+    {
+        status = fatx_dev_flush(fs);
+    }
+
+    fatx_free_dir_cache(fs);
+    fatx_free_fat_cache(fs);
+    fatx_free_map_free(fs);
+    fatx_extent_cache_free(fs);
+    fatx_dentry_cache_free(fs);
+    fatx_dir_index_free(fs);
+
+    if (fatx_dev_close(fs))
+    {
+        status = FATX_STATUS_ERROR;
+    }
+
+    fatx_lock_free(fs);
     return status;
 }
+
+/*
+ * Get the file descriptor the device is accessed through, so that file data
+ * can be transferred to and from it directly (see fatx_file_map(...)).
+ *
+ * Returns -1 if the device is not accessed through a file descriptor.
+ */
+int fatx_device_fd(struct fatx_fs *fs)
+{
+    return fatx_dev_fd(fs);
+}
+
+/*
+ * Get the size of the filesystem and how much of it is in use. The number
+ * of free clusters is kept up to date as clusters are allocated and freed,
+ * so this does not have to look at the FAT.
+ */
+int fatx_statfs(struct fatx_fs *fs, struct fatx_statfs *st)
+{
+    size_t dirents_per_cluster = fs->bytes_per_cluster / sizeof(struct fatx_raw_directory_entry);
+
+    fatx_debug(fs, "fatx_statfs()\n");
+
+    fatx_lock_shared(fs);
+
+    st->bytes_per_cluster = fs->bytes_per_cluster;
+    st->total_clusters    = fs->num_clusters - FATX_FAT_RESERVED_ENTRIES_COUNT;
+    st->free_clusters     = fs->free_map.num_free;
+    st->used_clusters     = st->total_clusters - st->free_clusters;
+    st->total_dirents     = (uint64_t)st->total_clusters * dirents_per_cluster;
+    st->free_dirents      = (uint64_t)st->free_clusters * dirents_per_cluster;
+
+    fatx_unlock(fs);
+
+    return FATX_STATUS_SUCCESS;
+}
@@ -27,6 +27,10 @@
 #include <string.h>
 #include <sys/types.h>
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -63,19 +67,260 @@ extern "C" {
  */
 #define FATX_READ_FROM_SUPERBLOCK    0
 
-#define FATX_FAT_CACHE_NUM_ENTRIES   512
+/*
+ * The amount of memory used to cache pages of the FAT when a size is not
+ * given in struct fatx_open_options.
+ */
+#define FATX_FAT_CACHE_DEFAULT_SIZE  (1024 * 1024)
+
+/*
+ * The amount of memory used to cache directory clusters when a size is not
+ * given in struct fatx_open_options.
+ */
+#define FATX_DIR_CACHE_DEFAULT_SIZE  (1024 * 1024)
+
+/*
+ * Flags that may be passed to fatx_open_device_ex(...) in
+ * struct fatx_open_options.
+ *
+ * FATX_OPEN_FAT_MIRROR loads the entire FAT into memory when the device is
+ * opened. Every FAT access then becomes a memory access, and only the 4 KiB
+ * pages of the FAT that were modified are written back when the FAT is
+ * flushed. A FAT16 partition has a FAT well under 1 MiB in size, but the FAT
+ * of a very large FAT32 partition can be hundreds of megabytes.
+ */
+#define FATX_OPEN_FAT_MIRROR         (1<<0)
+
+/*
+ * FATX_OPEN_DISCARD passes the clusters of deleted and truncated files to
+ * the device backend's discard operation, a contiguous run at a time, so
+ * that an SSD can reclaim them or an image file can give the space back to
+ * the host. Discarded clusters are not recoverable afterwards.
+ */
+#define FATX_OPEN_DISCARD            (1<<1)
+
+/*
+ * FATX_OPEN_READ_ONLY opens the device for reading only. Every call that
+ * would modify the filesystem fails with FATX_STATUS_ERROR before touching
+ * the device.
+ *
+ * FATX_OPEN_MMAP maps the partition into memory and serves directory, FAT and
+ * file reads straight from the mapping, so that processes inspecting the same
+ * image share a single copy of it in the page cache. It implies
+ * FATX_OPEN_READ_ONLY, and is only available with the default device backend
+ * on POSIX systems.
+ */
+#define FATX_OPEN_READ_ONLY          (1<<2)
+#define FATX_OPEN_MMAP               (1<<3)
+
+/*
+ * FATX_OPEN_IO_URING does device I/O through io_uring on Linux, so that the
+ * reads and writes of fragmented files and FAT flushes are queued together
+ * instead of being issued one system call at a time. If libfatx was built
+ * without io_uring support, or the kernel refuses to set up a ring, the
+ * default pread/pwrite backend is used instead. Ignored with FATX_OPEN_MMAP.
+ */
+#define FATX_OPEN_IO_URING           (1<<4)
+
+/*
+ * FATX_OPEN_IGNORE_CASE looks names up without regard to the case of ASCII
+ * letters, as the Xbox does. Names are still stored as they were given.
+ */
+#define FATX_OPEN_IGNORE_CASE        (1<<5)
+
+/*
+ * A single read or write in a batch of device I/O. For writes, buf is only
+ * read from.
+ */
+struct fatx_dev_io {
+    bool      write;
+    void     *buf;
+    size_t    size;
+    uint64_t  offset;
+};
+
+/*
+ * Operations of a block device backend. Each is passed the dev_ctx pointer
+ * given alongside the operations, and returns FATX_STATUS_SUCCESS or
+ * FATX_STATUS_ERROR.
+ *
+ * read_at and write_at only succeed when all of the bytes were transferred.
+ * flush makes prior writes durable, size gets the size of the device in bytes
+ * and discard hints that a byte range is no longer in use; its contents are
+ * undefined afterwards. close is called when the filesystem is closed. submit
+ * performs a batch of independent reads and writes, in any order, and only
+ * succeeds when all of them were transferred completely. zero_range fills a
+ * byte range with zeros, ideally without transferring them, and must leave
+ * the range allocated: the zeroed clusters are in use, and writing to them
+ * later must not fail for lack of space. discard, close, submit and
+ * zero_range may be NULL; a batch is then performed with read_at and
+ * write_at, one I/O at a time, and zeros are written out with write_at.
+ *
+ * read_at and submit may be called from several threads at once, by reads
+ * of open files. The other operations are only called while no other
+ * operation is in progress.
+ */
+struct fatx_dev_ops {
+    int (*read_at)(void *ctx, void *buf, size_t size, uint64_t offset);
+    int (*write_at)(void *ctx, const void *buf, size_t size, uint64_t offset);
+    int (*flush)(void *ctx);
+    int (*size)(void *ctx, uint64_t *size);
+    int (*discard)(void *ctx, uint64_t offset, uint64_t size);
+    int (*close)(void *ctx);
+    int (*submit)(void *ctx, struct fatx_dev_io *ios, size_t count);
+    int (*zero_range)(void *ctx, uint64_t offset, uint64_t size);
+};
+
+/*
+ * Options for fatx_open_device_ex(...). Zeroed fields select the defaults.
+ *
+ * fat_cache_size is the memory budget (in bytes) of the FAT page cache that
+ * is used when the FAT is not mirrored.
+ *
+ * dir_cache_size is the memory budget (in bytes) of the cache of directory
+ * clusters. Directory entries are read and modified in this cache, and
+ * modified clusters are written back when the filesystem is closed.
+ *
+ * dev_ops selects a device backend to use instead of opening the device path
+ * (which is then only used in log messages). dev_ctx is passed to each of its
+ * operations. By default a file descriptor backend is used, or a stdio one on
+ * Windows.
+ */
+struct fatx_open_options {
+    uint32_t                   flags;
+    size_t                     fat_cache_size;
+    size_t                     dir_cache_size;
+    struct fatx_dev_ops const *dev_ops;
+    void                      *dev_ctx;
+};
+
+struct fatx_cache_page {
+    size_t                  block;
+    bool                    valid;
+    bool                    dirty;
+    void                   *data;
+    struct fatx_cache_page *hash_next;
+    struct fatx_cache_page *lru_prev;
+    struct fatx_cache_page *lru_next;
+};
 
 struct fatx_cache {
-    size_t position;
-    size_t entries;
-    size_t entry_size;
-    bool   dirty;
-    void  *data;
+    uint64_t                 offset;
+    size_t                   block_size;
+    size_t                   num_blocks;
+    size_t                   num_buckets;
+    struct fatx_cache_page  *pages;
+    struct fatx_cache_page **buckets;
+    struct fatx_cache_page  *lru_head;
+    struct fatx_cache_page  *lru_tail;
+    uint8_t                 *data;
+    uint8_t                 *bounce;
+};
+
+struct fatx_fat_mirror {
+    void    *data;
+    uint8_t *dirty;
+    size_t   num_pages;
+};
+
+struct fatx_free_map {
+    uint64_t *bits;
+    uint64_t *summary;
+    size_t    num_words;
+    size_t    num_free;
+    size_t    cursor;
+};
+
+struct fatx_extent {
+    size_t file_cluster;
+    size_t cluster;
+    size_t count;
+};
+
+struct fatx_extent_map {
+    size_t              first_cluster;
+    size_t              num_clusters;
+    uint64_t            last_used;
+    struct fatx_extent *extents;
+    size_t              num_extents;
+    size_t              capacity;
+};
+
+struct fatx_extent_cache {
+    struct fatx_extent_map *maps;
+    size_t                  num_maps;
+    uint64_t                clock;
+};
+
+struct fatx_dir_index_slot {
+    uint32_t hash;
+    uint32_t cluster;
+    uint32_t entry;
+};
+
+struct fatx_dir_index {
+    size_t                       first_cluster;
+    uint64_t                     last_used;
+    struct fatx_dir_index_slot  *slots;
+    size_t                       num_slots;
+    size_t                       num_used;
+    struct fatx_dir             *free;
+    size_t                       num_free;
+    size_t                       max_free;
+    size_t                       end_cluster;
+    size_t                       end_entry;
+    size_t                       tail_cluster;
+};
+
+struct fatx_dir_index_cache {
+    struct fatx_dir_index *indexes;
+    size_t                 num_indexes;
+    uint64_t               clock;
+};
+
+struct fatx_dentry {
+    size_t              parent;
+    char               *name;
+    size_t              hash;
+    size_t              cluster;
+    size_t              entry;
+    struct fatx_dentry *hash_next;
+    struct fatx_dentry *lru_prev;
+    struct fatx_dentry *lru_next;
+};
+
+struct fatx_dentry_cache {
+    struct fatx_dentry  *dentries;
+    size_t               num_dentries;
+    struct fatx_dentry **buckets;
+    size_t               num_buckets;
+    struct fatx_dentry  *lru_head;
+    struct fatx_dentry  *lru_tail;
+};
+
+/*
+ * The lock of a filesystem. Operations hold it exclusively, and may nest.
+ * Reads of open files only hold it shared, so that they run in parallel,
+ * and take cache_lock around the few cache lookups they make.
+ *
+ * On Windows there is no locking, and a filesystem must only be used by one
+ * thread at a time.
+ */
+struct fatx_lock {
+#ifndef _WIN32
+    pthread_rwlock_t  rwlock;
+    pthread_mutex_t   cache_lock;
+    uintptr_t         owner;
+    size_t            depth;
+    size_t            readers;
+#endif
 };
 
 struct fatx_fs {
     char const       *device_path;
-    FILE             *device;
+    struct fatx_dev_ops const *dev_ops;
+    void             *dev_ctx;
+    uint32_t          open_flags;
     size_t            sector_size;
     uint64_t          partition_offset;
     uint64_t          partition_size;
@@ -92,6 +337,15 @@ struct fatx_fs {
     FILE             *log_handle;
     int               log_level;
     struct fatx_cache fat_cache;
+    struct fatx_cache dir_cache;
+    struct fatx_fat_mirror fat_mirror;
+    struct fatx_free_map   free_map;
+    struct fatx_extent_cache extent_cache;
+    struct fatx_dentry_cache dentry_cache;
+    struct fatx_dir_index_cache dir_index_cache;
+    struct fatx_file *open_files;
+    size_t            removed_files;
+    struct fatx_lock  lock;
 };
 
 struct fatx_dir {
@@ -99,6 +353,16 @@ struct fatx_dir {
     size_t entry;
 };
 
+/*
+ * An iterator over the entries of a directory, which reads the directory a
+ * whole cluster at a time. dir is the position of the next entry to look at.
+ */
+struct fatx_dir_iter {
+    struct fatx_dir dir;
+    uint8_t        *data;
+    size_t          data_cluster;
+};
+
 struct fatx_ts {
     uint16_t year;
     uint8_t  month; // 1 = January
@@ -122,6 +386,54 @@ struct fatx_attr {
     struct fatx_ts accessed;
 };
 
+/*
+ * An open file.
+ *
+ * A file handle keeps the attributes and the location of the directory entry
+ * of a file, so that reads and writes through it do not have to look the
+ * path up again. Changes to the size and modification time are kept in attr
+ * and written to the directory entry when the file is synced or closed.
+ *
+ * A file that is removed while it is open keeps its clusters, and can still
+ * be read and written through its handles, until the last of them is closed.
+ *
+ * The cursor remembers the run of contiguous clusters that was last
+ * accessed, so sequential I/O does not have to look at the extent map.
+ */
+struct fatx_file {
+    struct fatx_attr  attr;
+    struct fatx_dir   dir;
+    bool              dirty;
+    size_t            cursor_file_cluster;
+    size_t            cursor_cluster;
+    size_t            cursor_count;
+    struct fatx_file *next;
+};
+
+/*
+ * Space usage of a filesystem, as found by fatx_statfs(...).
+ *
+ * FATX has no fixed number of directory entries, so total_dirents and
+ * free_dirents estimate how many would fit if every cluster, or every free
+ * cluster, were used for them.
+ */
+struct fatx_statfs {
+    size_t   bytes_per_cluster;
+    size_t   total_clusters;
+    size_t   free_clusters;
+    size_t   used_clusters;
+    uint64_t total_dirents;
+    uint64_t free_dirents;
+};
+
+/*
+ * A range of the device holding part of a file, as found by fatx_file_map(...).
+ */
+struct fatx_file_span {
+    uint64_t offset;
+    size_t   size;
+};
+
 /*
  * Xbox Harddisk Partition Map
  */
@@ -138,21 +450,60 @@ enum fatx_format {
     FATX_FORMAT_F_TAKES_ALL
 };
 
+/*
+ * Options for fatx_disk_format_ex(...) and fatx_disk_format_partition_ex(...).
+ * Zeroed fields select the defaults.
+ *
+ * The partitions of a disk are formatted concurrently, each through its own
+ * handle on the device, unless FATX_FORMAT_SEQUENTIAL is set.
+ *
+ * progress, if set, is called with progress_ctx as each partition is
+ * formatted, with the number of bytes of filesystem metadata written so far
+ * and in total for that partition. Partitions are numbered in the order they
+ * are laid out on the disk, from 0 for the x partition (or for the only
+ * partition formatted by fatx_disk_format_partition_ex). progress is never
+ * called concurrently.
+ */
+#define FATX_FORMAT_SEQUENTIAL       (1<<0)
+
+struct fatx_format_options {
+    uint32_t   flags;
+    void     (*progress)(void *ctx, size_t partition, uint64_t done, uint64_t total);
+    void      *progress_ctx;
+};
+
 /* FATX Functions */
 int fatx_open_device(struct fatx_fs *fs, char const *path, uint64_t offset, uint64_t size, size_t sector_size, size_t sectors_per_cluster);
+int fatx_open_device_ex(struct fatx_fs *fs, char const *path, uint64_t offset, uint64_t size, size_t sector_size, size_t sectors_per_cluster, struct fatx_open_options const *options);
 int fatx_close_device(struct fatx_fs *fs);
+int fatx_device_fd(struct fatx_fs *fs);
+int fatx_statfs(struct fatx_fs *fs, struct fatx_statfs *st);
 int fatx_open_dir(struct fatx_fs *fs, char const *path, struct fatx_dir *dir);
 int fatx_read_dir(struct fatx_fs *fs, struct fatx_dir *dir, struct fatx_dirent *entry, struct fatx_attr *attr, struct fatx_dirent **result);
 int fatx_write_dir(struct fatx_fs *fs, struct fatx_dir *dir, struct fatx_dirent *entry, struct fatx_attr *attr);
 int fatx_next_dir_entry(struct fatx_fs *fs, struct fatx_dir *dir);
 int fatx_alloc_dir_entry(struct fatx_fs *fs, struct fatx_dir *dir);
 int fatx_close_dir(struct fatx_fs *fs, struct fatx_dir *dir);
+int fatx_dir_iter_open(struct fatx_fs *fs, char const *path, struct fatx_dir_iter *iter);
+int fatx_dir_iter_init(struct fatx_fs *fs, size_t cluster, struct fatx_dir_iter *iter);
+int fatx_dir_iter_seek(struct fatx_fs *fs, struct fatx_dir_iter *iter, struct fatx_dir const *dir);
+int fatx_dir_iter_next(struct fatx_fs *fs, struct fatx_dir_iter *iter, struct fatx_attr *attr);
+int fatx_dir_iter_close(struct fatx_fs *fs, struct fatx_dir_iter *iter);
 int fatx_get_attr(struct fatx_fs *fs, char const *path, struct fatx_attr *attr);
+int fatx_lookup(struct fatx_fs *fs, size_t parent, char const *name, struct fatx_dir *dir, struct fatx_attr *attr);
 int fatx_set_attr(struct fatx_fs *fs, char const *path, struct fatx_attr *attr);
 int fatx_attr_atomic_swap(struct fatx_fs *fs, char const *dir1, char const *base1, char const *dir2, char const *base2);
 int fatx_utime(struct fatx_fs *fs, char const *path, struct fatx_ts ts[2]);
 int fatx_read(struct fatx_fs *fs, char const *path, off_t offset, size_t size, void *buf);
 int fatx_write(struct fatx_fs *fs, char const *path, off_t offset, size_t size, const void *buf);
+int fatx_file_open(struct fatx_fs *fs, char const *path, struct fatx_file *file);
+int fatx_file_open_at(struct fatx_fs *fs, struct fatx_dir const *dir, struct fatx_file *file);
+int fatx_file_pread(struct fatx_fs *fs, struct fatx_file *file, off_t offset, size_t size, void *buf);
+int fatx_file_pwrite(struct fatx_fs *fs, struct fatx_file *file, off_t offset, size_t size, const void *buf);
+int fatx_file_map(struct fatx_fs *fs, struct fatx_file *file, off_t offset, size_t size, bool write, struct fatx_file_span *spans, size_t *num_spans);
+int fatx_file_mark_written(struct fatx_fs *fs, struct fatx_file *file, off_t offset, size_t size);
+int fatx_file_fsync(struct fatx_fs *fs, struct fatx_file *file);
+int fatx_file_close(struct fatx_fs *fs, struct fatx_file *file);
 int fatx_create_dirent(struct fatx_fs *fs, char const *path, struct fatx_dir *dir, uint8_t attributes);
 int fatx_unlink(struct fatx_fs *fs, char const *path);
 int fatx_mkdir(struct fatx_fs *fs, char const *path);
@@ -168,6 +519,8 @@ int fatx_disk_size(char const *path, uint64_t *size);
 int fatx_disk_size_remaining(char const *path, uint64_t offset, uint64_t *size);
 int fatx_disk_format(struct fatx_fs *fs, char const *path, size_t sector_size, enum fatx_format format_type, size_t sectors_per_cluster);
 int fatx_disk_format_partition(struct fatx_fs *fs, char const *path, uint64_t offset, uint64_t size, size_t sector_size, size_t sectors_per_cluster);
+int fatx_disk_format_ex(struct fatx_fs *fs, char const *path, size_t sector_size, enum fatx_format format_type, size_t sectors_per_cluster, struct fatx_format_options const *options);
+int fatx_disk_format_partition_ex(struct fatx_fs *fs, char const *path, uint64_t offset, uint64_t size, size_t sector_size, size_t sectors_per_cluster, struct fatx_format_options const *options);
 int fatx_drive_to_offset_size(char drive_letter, uint64_t *offset, uint64_t *size);
 int fatx_disk_write_refurb_info(char const *path, uint32_t number_of_boots, uint64_t first_power_on);
 
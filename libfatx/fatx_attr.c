@@ -23,7 +23,7 @@
 /*
  * Populate a fatx_attr struct given a low-level directory entry.
  */
-int fatx_dirent_to_attr(struct fatx_fs *fs, struct fatx_raw_directory_entry *entry, struct fatx_attr *attr)
+int fatx_dirent_to_attr(struct fatx_fs *fs, const struct fatx_raw_directory_entry *entry, struct fatx_attr *attr)
 {
     memcpy(attr->filename, entry->filename, entry->filename_len);
     attr->filename[entry->filename_len] = '\0';
@@ -67,20 +67,47 @@ int fatx_attr_to_dirent(struct fatx_fs *fs, struct fatx_attr *attr, struct fatx_
 
 /*
  * Get attributes.
+ *
+ * Finds the entry named start in the directory opened as dir, and leaves dir
+ * positioned at that entry.
  */
 int fatx_get_attr_dir(struct fatx_fs *fs, char const *start, struct fatx_dir *dir, struct fatx_dirent *dirent, struct fatx_attr *attr)
 {
     struct fatx_dirent *nextdirent;
+    size_t parent = dir->cluster;
+    bool cached = dir->entry == 0;
     int status;
 
+    /* Entries are cached by the first cluster of their directory. */
+    if (cached)
+    {
+        if (fatx_dentry_lookup(fs, parent, start, start, dir, dirent, attr) == FATX_STATUS_SUCCESS)
+        {
+            return FATX_STATUS_SUCCESS;
+        }
+
+        /* Fall back to scanning only if the directory can't be indexed. */
+        status = fatx_dir_index_lookup(fs, parent, start, dir, dirent, attr);
+        if (status == FATX_STATUS_SUCCESS)
+        {
+            fatx_dentry_insert(fs, parent, start, dir);
+            return status;
+        }
+        else if (status == FATX_STATUS_FILE_NOT_FOUND)
+        {
+            return status;
+        }
+    }
+
     while (1)
     {
         status = fatx_read_dir(fs, dir, dirent, attr, &nextdirent);
         if (status == FATX_STATUS_SUCCESS)
         {
-            if (strcmp(start, dirent->filename) == 0)
+            if (fatx_name_match(fs, start, dirent->filename, SIZE_MAX))
             {
                 /* Found! */
+                if (cached) fatx_dentry_insert(fs, parent, start, dir);
                 status = FATX_STATUS_SUCCESS;
                 break;
             }
@@ -110,7 +137,7 @@ int fatx_get_attr_dir(struct fatx_fs *fs, char const *start, struct fatx_dir *di
     return status;
 }
 
-int fatx_get_attr(struct fatx_fs *fs, const char *path, struct fatx_attr *attr)
+static int fatx_get_attr_locked(struct fatx_fs *fs, const char *path, struct fatx_attr *attr)
 {
     struct fatx_dir dir;
     struct fatx_dirent dirent;
@@ -132,24 +159,45 @@ int fatx_get_attr(struct fatx_fs *fs, const char *path, struct fatx_attr *attr)
     return status;
 }
 
+/*
+ * Find the entry named name in the directory starting at cluster parent, and
+ * get its location and attributes. Only that directory is searched, so the
+ * cost does not depend on how deep the directory is.
+ */
+static int fatx_lookup_locked(struct fatx_fs *fs, size_t parent, char const *name, struct fatx_dir *dir, struct fatx_attr *attr)
+{
+    struct fatx_dirent dirent;
+
+    fatx_debug(fs, "fatx_lookup(parent=%zd, name=\"%s\")\n", parent, name);
+
+    dir->cluster = parent;
+    dir->entry   = 0;
+
+    return fatx_get_attr_dir(fs, name, dir, &dirent, attr);
+}
+
 /*
  * Write attributes to an existing file.
  */
-int fatx_set_attr(struct fatx_fs *fs, char const *path, struct fatx_attr *attr)
+static int fatx_set_attr_locked(struct fatx_fs *fs, char const *path, struct fatx_attr *attr)
 {
     struct fatx_dir dir;
     struct fatx_dirent dirent;
     struct fatx_attr old_attr;
+    size_t parent;
     int status;
     char *path_dirname, *path_basename;
 
     fatx_debug(fs, "fatx_write_attr(path=\"%s\")\n", path);
 
+    if (fatx_check_writable(fs)) return FATX_STATUS_ERROR;
+
     path_dirname = fatx_dirname(path);
     status = fatx_open_dir(fs, path_dirname, &dir);
     free(path_dirname);
     if (status) return status;
 
+    parent = dir.cluster;
     path_basename = fatx_basename(path);
     status = fatx_get_attr_dir(fs, path_basename, &dir, &dirent, &old_attr);
     free(path_basename);
@@ -159,10 +207,23 @@ int fatx_set_attr(struct fatx_fs *fs, char const *path, struct fatx_attr *attr)
 
     status = fatx_write_dir(fs, &dir, &dirent, attr);
     fatx_close_dir(fs, &dir);
+
+    if (strcmp(old_attr.filename, attr->filename) != 0)
+    {
+        /* The entry was renamed. */
+        if (status == FATX_STATUS_SUCCESS)
+        {
+            fatx_dir_index_remove(fs, parent, old_attr.filename, &dir);
+            fatx_dir_index_add(fs, parent, attr->filename, &dir);
+        }
+        fatx_dentry_forget_name(fs, parent, old_attr.filename);
+        fatx_dentry_forget_path(fs, path, NULL);
+    }
+
     return status;
 }
 
-int fatx_attr_atomic_swap(struct fatx_fs *fs, char const *path1, char const *base1, char const *path2, char const *base2)
+static int fatx_attr_atomic_swap_locked(struct fatx_fs *fs, char const *path1, char const *base1, char const *path2, char const *base2)
 {
     struct fatx_dir dir1, dir2;
     struct fatx_dirent dirent1, dirent2;
@@ -171,6 +232,8 @@ int fatx_attr_atomic_swap(struct fatx_fs *fs, char const *path1, char const *bas
 
     fatx_debug(fs, "fatx_attr_atomic_swap(path1=\"%s/%s\", path2=\"%s/%s\")\n", path1, base1, path2, base2);
 
+    if (fatx_check_writable(fs)) return FATX_STATUS_ERROR;
+
     status = fatx_open_dir(fs, path1, &dir1);
     if (status) return status;
 
@@ -188,13 +251,21 @@ int fatx_attr_atomic_swap(struct fatx_fs *fs, char const *path1, char const *bas
     strcpy(dirent2.filename, base1);
     strcpy(attr2.filename, base1);
 
+    /* Open files follow their contents. */
+    fatx_file_entry_swapped(fs, &dir1, &dir2);
+
     status = fatx_write_dir(fs, &dir2, &dirent2, &attr1);
-    if (status) goto done;
+    if (status)
+    {
+        fatx_file_entry_swapped(fs, &dir1, &dir2);
+        goto done;
+    }
 
     status = fatx_write_dir(fs, &dir1, &dirent1, &attr2);
     if (status)
     {
         int restore_status;
+        fatx_file_entry_swapped(fs, &dir1, &dir2);
         /* Restore dirent2 */
         strcpy(dirent2.filename, base2);
         strcpy(attr2.filename, base2);
@@ -210,16 +281,23 @@ int fatx_attr_atomic_swap(struct fatx_fs *fs, char const *path1, char const *bas
 done:
     fatx_close_dir(fs, &dir1);
     fatx_close_dir(fs, &dir2);
+
+    /* The names stay where they were, but what is beneath them has moved. */
+    fatx_dentry_forget_path(fs, path1, base1);
+    fatx_dentry_forget_path(fs, path2, base2);
+
     return status;
 }
 
-int fatx_utime(struct fatx_fs *fs, char const *path, struct fatx_ts ts[2])
+static int fatx_utime_locked(struct fatx_fs *fs, char const *path, struct fatx_ts ts[2])
 {
     int status;
     struct fatx_attr attr;
 
     fatx_debug(fs, "fatx_utime(path=\"%s\")\n", path);
 
+    if (fatx_check_writable(fs)) return FATX_STATUS_ERROR;
+
     status = fatx_get_attr(fs, path, &attr);
     if (status) return status;
 
@@ -230,3 +308,60 @@ int fatx_utime(struct fatx_fs *fs, char const *path, struct fatx_ts ts[2])
     return status;
 }
 
+/*
+ * Entry points, which hold the filesystem lock around the functions above.
+ */
+int fatx_get_attr(struct fatx_fs *fs, const char *path, struct fatx_attr *attr)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_get_attr_locked(fs, path, attr);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_lookup(struct fatx_fs *fs, size_t parent, char const *name, struct fatx_dir *dir, struct fatx_attr *attr)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_lookup_locked(fs, parent, name, dir, attr);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_set_attr(struct fatx_fs *fs, char const *path, struct fatx_attr *attr)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_set_attr_locked(fs, path, attr);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_attr_atomic_swap(struct fatx_fs *fs, char const *path1, char const *base1, char const *path2, char const *base2)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_attr_atomic_swap_locked(fs, path1, base1, path2, base2);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_utime(struct fatx_fs *fs, char const *path, struct fatx_ts ts[2])
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_utime_locked(fs, path, ts);
+    fatx_unlock(fs);
+
+    return status;
+}
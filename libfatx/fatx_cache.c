@@ -0,0 +1,463 @@
+/*
+ * FATX Filesystem Library
+ *
+ * Copyright (C) 2015  Matt Borgerson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A write-back cache of fixed size blocks of the device.
+ *
+ * Blocks are identified by their index, where block N lives at byte offset
+ * (cache->offset + N * cache->block_size) on the device. Resident blocks are
+ * found through a hash table, and when the cache is full the least recently
+ * used block is evicted (and written back first, if it is dirty).
+ *
+ * Holders of the shared lock must not write to the device, so they only ever
+ * evict clean blocks. If every block is dirty, the block they asked for is
+ * read into a bounce buffer instead of the cache.
+ */
+
+#include "fatx_internal.h"
+
+static size_t fatx_cache_hash(struct fatx_cache *cache, size_t block)
+{
+    return block & (cache->num_buckets - 1);
+}
+
+static void fatx_cache_lru_remove(struct fatx_cache *cache, struct fatx_cache_page *page)
+{
+    if (page->lru_prev) page->lru_prev->lru_next = page->lru_next;
+    else                cache->lru_head = page->lru_next;
+
+    if (page->lru_next) page->lru_next->lru_prev = page->lru_prev;
+    else                cache->lru_tail = page->lru_prev;
+
+    page->lru_prev = page->lru_next = NULL;
+}
+
+static void fatx_cache_lru_push_head(struct fatx_cache *cache, struct fatx_cache_page *page)
+{
+    page->lru_prev = NULL;
+    page->lru_next = cache->lru_head;
+
+    if (cache->lru_head) cache->lru_head->lru_prev = page;
+    else                 cache->lru_tail = page;
+
+    cache->lru_head = page;
+}
+
+static void fatx_cache_lru_push_tail(struct fatx_cache *cache, struct fatx_cache_page *page)
+{
+    page->lru_next = NULL;
+    page->lru_prev = cache->lru_tail;
+
+    if (cache->lru_tail) cache->lru_tail->lru_next = page;
+    else                 cache->lru_head = page;
+
+    cache->lru_tail = page;
+}
+
+static void fatx_cache_hash_remove(struct fatx_cache *cache, struct fatx_cache_page *page)
+{
+    struct fatx_cache_page **link;
+
+    link = &cache->buckets[fatx_cache_hash(cache, page->block)];
+    while (*link)
+    {
+        if (*link == page)
+        {
+            *link = page->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+
+    page->hash_next = NULL;
+    page->valid = false;
+}
+
+static struct fatx_cache_page *fatx_cache_lookup(struct fatx_cache *cache, size_t block)
+{
+    struct fatx_cache_page *page;
+
+    for (page = cache->buckets[fatx_cache_hash(cache, block)]; page; page = page->hash_next)
+    {
+        if (page->block == block)
+        {
+            return page;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Write a single cached block back to the device.
+ */
+static int fatx_cache_write_back(struct fatx_fs *fs, struct fatx_cache *cache, struct fatx_cache_page *page)
+{
+    uint64_t offset = cache->offset + (uint64_t)page->block * cache->block_size;
+
+    fatx_debug(fs, "fatx_cache_write_back(block=%zd)\n", page->block);
+
+    if (fatx_dev_write_at(fs, page->data, cache->block_size, offset))
+    {
+        fatx_error(fs, "failed to write cached block %zd\n", page->block);
+        return FATX_STATUS_ERROR;
+    }
+
+    page->dirty = false;
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Initialize a cache holding up to num_blocks blocks of block_size bytes.
+ */
+int fatx_cache_init(struct fatx_fs *fs, struct fatx_cache *cache, uint64_t offset, size_t block_size, size_t num_blocks)
+{
+    size_t i;
+
+    memset(cache, 0, sizeof(*cache));
+
+    if (num_blocks == 0)
+    {
+        num_blocks = 1;
+    }
+
+    cache->offset      = offset;
+    cache->block_size  = block_size;
+    cache->num_blocks  = num_blocks;
+    cache->num_buckets = 1;
+    while (cache->num_buckets < num_blocks)
+    {
+        cache->num_buckets <<= 1;
+    }
+
+    cache->pages   = calloc(num_blocks, sizeof(struct fatx_cache_page));
+    cache->buckets = calloc(cache->num_buckets, sizeof(struct fatx_cache_page *));
+    cache->data    = malloc(num_blocks * block_size);
+    cache->bounce  = malloc(block_size);
+
+    if (!cache->pages || !cache->buckets || !cache->data || !cache->bounce)
+    {
+        fatx_error(fs, "failed to allocate memory for %zd byte cache\n", num_blocks * block_size);
+        fatx_cache_free(cache);
+        return FATX_STATUS_ERROR;
+    }
+
+    for (i = 0; i < num_blocks; i++)
+    {
+        cache->pages[i].data = cache->data + i * block_size;
+        fatx_cache_lru_push_head(cache, &cache->pages[i]);
+    }
+
+    fatx_debug(fs, "initialized cache: [blocks: %zd, block_size: %zd]\n", num_blocks, block_size);
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Release the memory held by a cache. Dirty blocks are discarded.
+ */
+void fatx_cache_free(struct fatx_cache *cache)
+{
+    free(cache->pages);
+    free(cache->buckets);
+    free(cache->data);
+    free(cache->bounce);
+    memset(cache, 0, sizeof(*cache));
+}
+
+/*
+ * Drop every block from the cache without writing anything back.
+ */
+void fatx_cache_reset(struct fatx_cache *cache)
+{
+    size_t i;
+
+    if (!cache->pages)
+    {
+        return;
+    }
+
+    memset(cache->buckets, 0, cache->num_buckets * sizeof(struct fatx_cache_page *));
+    for (i = 0; i < cache->num_blocks; i++)
+    {
+        cache->pages[i].valid     = false;
+        cache->pages[i].dirty     = false;
+        cache->pages[i].hash_next = NULL;
+    }
+}
+
+/*
+ * Get a pointer to the cached copy of a block, reading it in if necessary.
+ *
+ * If write is true, the block is marked dirty and the caller is expected to
+ * modify the returned data before making any other call into the cache.
+ * Writes are only allowed to threads that may write to the device.
+ */
+int fatx_cache_get(struct fatx_fs *fs, struct fatx_cache *cache, size_t block, bool write, void **data)
+{
+    struct fatx_cache_page *page;
+    uint64_t offset;
+
+    page = fatx_cache_lookup(cache, block);
+
+    if (!page)
+    {
+        fatx_debug(fs, "cache miss for block %zd\n", block);
+
+        offset = cache->offset + (uint64_t)block * cache->block_size;
+
+        /* Evict the least recently used block, skipping dirty ones if it may not be written back. */
+        page = cache->lru_tail;
+        if (!write && !fatx_lock_writable(fs))
+        {
+            while (page && page->valid && page->dirty)
+            {
+                page = page->lru_prev;
+            }
+
+            if (!page)
+            {
+                if (fatx_dev_read_at(fs, cache->bounce, cache->block_size, offset))
+                {
+                    fatx_error(fs, "failed to read block %zd around cache\n", block);
+                    return FATX_STATUS_ERROR;
+                }
+
+                *data = cache->bounce;
+                return FATX_STATUS_SUCCESS;
+            }
+        }
+
+        if (page->valid)
+        {
+            if (page->dirty && fatx_cache_write_back(fs, cache, page))
+            {
+                return FATX_STATUS_ERROR;
+            }
+            fatx_cache_hash_remove(cache, page);
+        }
+
+        if (fatx_dev_read_at(fs, page->data, cache->block_size, offset))
+        {
+            fatx_error(fs, "failed to read block %zd into cache\n", block);
+            return FATX_STATUS_ERROR;
+        }
+
+        page->block     = block;
+        page->valid     = true;
+        page->dirty     = false;
+        page->hash_next = cache->buckets[fatx_cache_hash(cache, block)];
+        cache->buckets[fatx_cache_hash(cache, block)] = page;
+    }
+
+    if (cache->lru_head != page)
+    {
+        fatx_cache_lru_remove(cache, page);
+        fatx_cache_lru_push_head(cache, page);
+    }
+
+    if (write)
+    {
+        page->dirty = true;
+    }
+
+    *data = page->data;
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Check whether a block is in the cache, without reading it in.
+ */
+bool fatx_cache_contains(struct fatx_cache *cache, size_t block)
+{
+    return cache->pages && fatx_cache_lookup(cache, block) != NULL;
+}
+
+/*
+ * Drop a block from the cache without writing it back, for when the data it
+ * holds is no longer wanted. The page is reused before any other.
+ */
+void fatx_cache_invalidate(struct fatx_cache *cache, size_t block)
+{
+    struct fatx_cache_page *page;
+
+    if (!cache->pages)
+    {
+        return;
+    }
+
+    page = fatx_cache_lookup(cache, block);
+    if (!page)
+    {
+        return;
+    }
+
+    fatx_cache_hash_remove(cache, page);
+    page->dirty = false;
+
+    fatx_cache_lru_remove(cache, page);
+    fatx_cache_lru_push_tail(cache, page);
+}
+
+/*
+ * Read a number of blocks into the cache with a single batch of device I/O,
+ * skipping those that are already cached. At most half of the cache is
+ * filled this way, so that a read-ahead cannot evict everything else.
+ */
+int fatx_cache_prefetch(struct fatx_fs *fs, struct fatx_cache *cache, size_t const *blocks, size_t count)
+{
+    struct fatx_cache_page *pages[FATX_DEV_BATCH_SIZE];
+    struct fatx_cache_page *page;
+    struct fatx_dev_batch batch;
+    size_t i, num_pages;
+    int status = FATX_STATUS_SUCCESS;
+
+    count = MIN(count, cache->num_blocks / 2);
+    count = MIN(count, FATX_DEV_BATCH_SIZE);
+
+    fatx_dev_batch_init(&batch);
+    num_pages = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        if (fatx_cache_lookup(cache, blocks[i]))
+        {
+            continue;
+        }
+
+        /* Evict the least recently used block. */
+        page = cache->lru_tail;
+        if (page->valid)
+        {
+            if (page->dirty && fatx_cache_write_back(fs, cache, page))
+            {
+                status = FATX_STATUS_ERROR;
+                break;
+            }
+            fatx_cache_hash_remove(cache, page);
+        }
+
+        /* Claim the page now, so that a repeated block is only read once. */
+        page->block     = blocks[i];
+        page->valid     = true;
+        page->dirty     = false;
+        page->hash_next = cache->buckets[fatx_cache_hash(cache, blocks[i])];
+        cache->buckets[fatx_cache_hash(cache, blocks[i])] = page;
+
+        fatx_cache_lru_remove(cache, page);
+        fatx_cache_lru_push_head(cache, page);
+
+        pages[num_pages++] = page;
+        fatx_dev_batch_add(fs, &batch, false, page->data, cache->block_size,
+                           cache->offset + (uint64_t)blocks[i] * cache->block_size);
+    }
+
+    if (fatx_dev_batch_submit(fs, &batch))
+    {
+        status = FATX_STATUS_ERROR;
+    }
+
+    if (status)
+    {
+        fatx_error(fs, "failed to prefetch blocks into cache\n");
+        for (i = 0; i < num_pages; i++)
+        {
+            fatx_cache_hash_remove(cache, pages[i]);
+        }
+    }
+
+    return status;
+}
+
+static int fatx_cache_page_compare(const void *a, const void *b)
+{
+    size_t block_a = (*(struct fatx_cache_page * const *)a)->block;
+    size_t block_b = (*(struct fatx_cache_page * const *)b)->block;
+
+    return (block_a > block_b) - (block_a < block_b);
+}
+
+/*
+ * Write every dirty block back to the device, in ascending block order.
+ */
+int fatx_cache_flush(struct fatx_fs *fs, struct fatx_cache *cache)
+{
+    struct fatx_dev_batch batch;
+    struct fatx_cache_page **dirty;
+    size_t i, num_dirty;
+    int status = FATX_STATUS_SUCCESS;
+
+    if (!cache->pages)
+    {
+        return FATX_STATUS_SUCCESS;
+    }
+
+    num_dirty = 0;
+    for (i = 0; i < cache->num_blocks; i++)
+    {
+        if (cache->pages[i].valid && cache->pages[i].dirty) num_dirty++;
+    }
+
+    if (num_dirty == 0)
+    {
+        return FATX_STATUS_SUCCESS;
+    }
+
+    dirty = malloc(num_dirty * sizeof(struct fatx_cache_page *));
+    if (!dirty)
+    {
+        fatx_error(fs, "failed to allocate memory for cache flush\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    num_dirty = 0;
+    for (i = 0; i < cache->num_blocks; i++)
+    {
+        if (cache->pages[i].valid && cache->pages[i].dirty) dirty[num_dirty++] = &cache->pages[i];
+    }
+
+    qsort(dirty, num_dirty, sizeof(struct fatx_cache_page *), fatx_cache_page_compare);
+
+    /* Submit the write backs together, so that they can be overlapped. */
+    fatx_dev_batch_init(&batch);
+    for (i = 0; i < num_dirty && !status; i++)
+    {
+        status = fatx_dev_batch_add(fs, &batch, true, dirty[i]->data, cache->block_size,
+                                    cache->offset + (uint64_t)dirty[i]->block * cache->block_size);
+    }
+
+    if (!status)
+    {
+        status = fatx_dev_batch_submit(fs, &batch);
+    }
+
+    if (status)
+    {
+        fatx_error(fs, "failed to write back cached blocks\n");
+    }
+    else
+    {
+        for (i = 0; i < num_dirty; i++)
+        {
+            dirty[i]->dirty = false;
+        }
+    }
+
+    free(dirty);
+    return status;
+}
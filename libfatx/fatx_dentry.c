@@ -0,0 +1,392 @@
+/*
+ * FATX Filesystem Library
+ *
+ * Copyright (C) 2015  Matt Borgerson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A cache of path lookups.
+ *
+ * Each dentry remembers where the directory entry for a name was found, as
+ * the (cluster, entry) location of the entry. Dentries are keyed either by
+ * the first cluster of the parent directory and the name of the entry, or
+ * by the normalized full path of a directory (with FATX_DENTRY_PATH as the
+ * parent), so that a whole path resolves with a single lookup.
+ *
+ * Only locations are cached. Attributes are always read from the directory
+ * entry itself, and a dentry whose entry no longer holds the expected name is
+ * dropped when it is looked up, so the cache never has to track changes to
+ * the attributes of an entry. Operations that remove or rename an entry
+ * still forget the affected dentries, as that is the only way to find out
+ * that the paths beneath a renamed directory are gone.
+ */
+
+#include "fatx_internal.h"
+
+static void fatx_dentry_lru_remove(struct fatx_dentry_cache *cache, struct fatx_dentry *dentry)
+{
+    if (dentry->lru_prev) dentry->lru_prev->lru_next = dentry->lru_next;
+    else                  cache->lru_head = dentry->lru_next;
+
+    if (dentry->lru_next) dentry->lru_next->lru_prev = dentry->lru_prev;
+    else                  cache->lru_tail = dentry->lru_prev;
+
+    dentry->lru_prev = dentry->lru_next = NULL;
+}
+
+static void fatx_dentry_lru_push_head(struct fatx_dentry_cache *cache, struct fatx_dentry *dentry)
+{
+    dentry->lru_prev = NULL;
+    dentry->lru_next = cache->lru_head;
+
+    if (cache->lru_head) cache->lru_head->lru_prev = dentry;
+    else                 cache->lru_tail = dentry;
+
+    cache->lru_head = dentry;
+}
+
+static void fatx_dentry_lru_push_tail(struct fatx_dentry_cache *cache, struct fatx_dentry *dentry)
+{
+    dentry->lru_next = NULL;
+    dentry->lru_prev = cache->lru_tail;
+
+    if (cache->lru_tail) cache->lru_tail->lru_next = dentry;
+    else                 cache->lru_head = dentry;
+
+    cache->lru_tail = dentry;
+}
+
+/*
+ * Take a dentry out of the hash table and free its name. The dentry is moved
+ * to the LRU tail, so that it is the next one to be reused.
+ */
+static void fatx_dentry_remove(struct fatx_dentry_cache *cache, struct fatx_dentry *dentry)
+{
+    struct fatx_dentry **link;
+
+    link = &cache->buckets[dentry->hash & (cache->num_buckets - 1)];
+    while (*link)
+    {
+        if (*link == dentry)
+        {
+            *link = dentry->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+
+    free(dentry->name);
+    dentry->name      = NULL;
+    dentry->hash_next = NULL;
+
+    fatx_dentry_lru_remove(cache, dentry);
+    fatx_dentry_lru_push_tail(cache, dentry);
+}
+
+static struct fatx_dentry *fatx_dentry_find(struct fatx_fs *fs, size_t parent, char const *name, size_t hash)
+{
+    struct fatx_dentry_cache *cache = &fs->dentry_cache;
+    struct fatx_dentry *dentry;
+
+    if (!cache->dentries)
+    {
+        return NULL;
+    }
+
+    for (dentry = cache->buckets[hash & (cache->num_buckets - 1)]; dentry; dentry = dentry->hash_next)
+    {
+        if (dentry->hash == hash && dentry->parent == parent && fatx_name_match(fs, dentry->name, name, SIZE_MAX))
+        {
+            return dentry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Allocate the dentry cache.
+ */
+int fatx_dentry_cache_init(struct fatx_fs *fs)
+{
+    struct fatx_dentry_cache *cache = &fs->dentry_cache;
+    size_t i;
+
+    memset(cache, 0, sizeof(*cache));
+
+    cache->num_dentries = FATX_DENTRY_CACHE_SIZE;
+    cache->num_buckets  = 1;
+    while (cache->num_buckets < cache->num_dentries)
+    {
+        cache->num_buckets <<= 1;
+    }
+
+    cache->dentries = calloc(cache->num_dentries, sizeof(struct fatx_dentry));
+    cache->buckets  = calloc(cache->num_buckets, sizeof(struct fatx_dentry *));
+
+    if (!cache->dentries || !cache->buckets)
+    {
+        fatx_error(fs, "failed to allocate memory for dentry cache\n");
+        fatx_dentry_cache_free(fs);
+        return FATX_STATUS_ERROR;
+    }
+
+    for (i = 0; i < cache->num_dentries; i++)
+    {
+        fatx_dentry_lru_push_tail(cache, &cache->dentries[i]);
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Drop every dentry.
+ */
+void fatx_dentry_cache_reset(struct fatx_fs *fs)
+{
+    struct fatx_dentry_cache *cache = &fs->dentry_cache;
+    size_t i;
+
+    if (!cache->dentries)
+    {
+        return;
+    }
+
+    for (i = 0; i < cache->num_dentries; i++)
+    {
+        free(cache->dentries[i].name);
+        cache->dentries[i].name      = NULL;
+        cache->dentries[i].hash_next = NULL;
+    }
+
+    memset(cache->buckets, 0, cache->num_buckets * sizeof(struct fatx_dentry *));
+}
+
+/*
+ * Release the memory held by the dentry cache.
+ */
+void fatx_dentry_cache_free(struct fatx_fs *fs)
+{
+    fatx_dentry_cache_reset(fs);
+    free(fs->dentry_cache.dentries);
+    free(fs->dentry_cache.buckets);
+    memset(&fs->dentry_cache, 0, sizeof(fs->dentry_cache));
+}
+
+/*
+ * Join a directory path and a name (which may be NULL) into a normalized
+ * path, without repeated or trailing path separators. The result must be
+ * freed by the caller.
+ */
+char *fatx_dentry_path(char const *dirname, char const *basename)
+{
+    char const *parts[2] = { dirname, basename };
+    char *path;
+    size_t i, len;
+    char const *p;
+
+    path = malloc(strlen(dirname) + (basename ? strlen(basename) : 0) + 3);
+    if (!path)
+    {
+        return NULL;
+    }
+
+    len = 0;
+    for (i = 0; i < 2 && parts[i]; i++)
+    {
+        if (len == 0 || path[len-1] != FATX_PATH_SEPERATOR)
+        {
+            path[len++] = FATX_PATH_SEPERATOR;
+        }
+
+        for (p = parts[i]; *p; p++)
+        {
+            if (*p == FATX_PATH_SEPERATOR && path[len-1] == FATX_PATH_SEPERATOR)
+            {
+                continue;
+            }
+            path[len++] = *p;
+        }
+
+        if (len > 1 && path[len-1] == FATX_PATH_SEPERATOR)
+        {
+            len--;
+        }
+    }
+
+    path[len] = '\0';
+    return path;
+}
+
+/*
+ * Look up the directory entry for a name, where filename is the name the
+ * entry is expected to hold (the last component of name, for a full path).
+ *
+ * On success, dir is positioned at the entry and dirent and attr are read
+ * from it. FATX_STATUS_FILE_NOT_FOUND is returned when the name is not
+ * cached, in which case the caller should fall back to scanning.
+ */
+int fatx_dentry_lookup(struct fatx_fs *fs, size_t parent, char const *name, char const *filename, struct fatx_dir *dir, struct fatx_dirent *dirent, struct fatx_attr *attr)
+{
+    struct fatx_dentry_cache *cache = &fs->dentry_cache;
+    struct fatx_dentry *dentry;
+    struct fatx_dirent *result;
+    struct fatx_dir location;
+
+    dentry = fatx_dentry_find(fs, parent, name, fatx_name_hash(fs, parent, name));
+    if (!dentry)
+    {
+        return FATX_STATUS_FILE_NOT_FOUND;
+    }
+
+    location.cluster = dentry->cluster;
+    location.entry   = dentry->entry;
+
+    if (fatx_read_dir(fs, &location, dirent, attr, &result) != FATX_STATUS_SUCCESS ||
+        !fatx_name_match(fs, dirent->filename, filename, SIZE_MAX))
+    {
+        fatx_debug(fs, "dropping stale dentry for %s\n", name);
+        fatx_dentry_remove(cache, dentry);
+        return FATX_STATUS_FILE_NOT_FOUND;
+    }
+
+    fatx_dentry_lru_remove(cache, dentry);
+    fatx_dentry_lru_push_head(cache, dentry);
+
+    *dir = location;
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Remember that the directory entry for a name is at the location of dir.
+ */
+void fatx_dentry_insert(struct fatx_fs *fs, size_t parent, char const *name, struct fatx_dir const *dir)
+{
+    struct fatx_dentry_cache *cache = &fs->dentry_cache;
+    struct fatx_dentry *dentry;
+    size_t hash;
+    char *copy;
+
+    if (!cache->dentries)
+    {
+        return;
+    }
+
+    hash   = fatx_name_hash(fs, parent, name);
+    dentry = fatx_dentry_find(fs, parent, name, hash);
+
+    if (!dentry)
+    {
+        copy = strdup(name);
+        if (!copy)
+        {
+            /* Not being able to cache the name is not an error. */
+            return;
+        }
+
+        /* Reuse the least recently used dentry. */
+        dentry = cache->lru_tail;
+        if (dentry->name)
+        {
+            fatx_dentry_remove(cache, dentry);
+        }
+
+        dentry->parent    = parent;
+        dentry->name      = copy;
+        dentry->hash      = hash;
+        dentry->hash_next = cache->buckets[hash & (cache->num_buckets - 1)];
+        cache->buckets[hash & (cache->num_buckets - 1)] = dentry;
+    }
+
+    dentry->cluster = dir->cluster;
+    dentry->entry   = dir->entry;
+
+    fatx_dentry_lru_remove(cache, dentry);
+    fatx_dentry_lru_push_head(cache, dentry);
+}
+
+/*
+ * Forget the entry for a name in the directory starting at parent.
+ */
+void fatx_dentry_forget_name(struct fatx_fs *fs, size_t parent, char const *name)
+{
+    struct fatx_dentry_cache *cache = &fs->dentry_cache;
+    struct fatx_dentry *dentry;
+
+    dentry = fatx_dentry_find(fs, parent, name, fatx_name_hash(fs, parent, name));
+    if (dentry)
+    {
+        fatx_dentry_remove(cache, dentry);
+    }
+}
+
+/*
+ * Forget the full path dentries of an entry and of everything beneath it.
+ */
+void fatx_dentry_forget_path(struct fatx_fs *fs, char const *dirname, char const *basename)
+{
+    struct fatx_dentry_cache *cache = &fs->dentry_cache;
+    struct fatx_dentry *dentry;
+    size_t i, len;
+    char *path;
+
+    if (!cache->dentries)
+    {
+        return;
+    }
+
+    path = fatx_dentry_path(dirname, basename);
+    if (!path)
+    {
+        /* Without the path, the only safe thing left is to forget it all. */
+        fatx_dentry_cache_reset(fs);
+        return;
+    }
+
+    len = strlen(path);
+
+    for (i = 0; i < cache->num_dentries; i++)
+    {
+        dentry = &cache->dentries[i];
+
+        if (dentry->name && dentry->parent == FATX_DENTRY_PATH &&
+            fatx_name_match(fs, dentry->name, path, len) &&
+            (dentry->name[len] == '\0' || dentry->name[len] == FATX_PATH_SEPERATOR || len == 1))
+        {
+            fatx_dentry_remove(cache, dentry);
+        }
+    }
+
+    free(path);
+}
+
+/*
+ * Forget the entries of the directory starting at parent, when that
+ * directory is removed and its clusters may be reused.
+ */
+void fatx_dentry_forget_parent(struct fatx_fs *fs, size_t parent)
+{
+    struct fatx_dentry_cache *cache = &fs->dentry_cache;
+    size_t i;
+
+    for (i = 0; i < cache->num_dentries; i++)
+    {
+        if (cache->dentries[i].name && cache->dentries[i].parent == parent)
+        {
+            fatx_dentry_remove(cache, &cache->dentries[i]);
+        }
+    }
+}
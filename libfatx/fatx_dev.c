@@ -17,61 +17,1371 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include "fatx_internal.h"
 
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef __linux__
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#endif
+
+#ifdef FATX_HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+/* Zeros, shared by everything that has to write them out. */
+static const uint8_t fatx_dev_zero_page[FATX_DEV_ZERO_PAGE_SIZE];
+
+#ifdef _WIN32
+
 /*
- * Seek to a byte offset in the device.
+ * The stdio backend, used by default on Windows.
  */
-int fatx_dev_seek(struct fatx_fs *fs, uint64_t offset)
+struct fatx_dev_stdio {
+    FILE *file;
+};
+
+static int fatx_dev_stdio_read_at(void *ctx, void *buf, size_t size, uint64_t offset)
+{
+    struct fatx_dev_stdio *dev = ctx;
+
+    if (_fseeki64(dev->file, offset, SEEK_SET) || fread(buf, 1, size, dev->file) != size)
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+static int fatx_dev_stdio_write_at(void *ctx, const void *buf, size_t size, uint64_t offset)
+{
+    struct fatx_dev_stdio *dev = ctx;
+
+    if (_fseeki64(dev->file, offset, SEEK_SET) || fwrite(buf, 1, size, dev->file) != size)
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+static int fatx_dev_stdio_flush(void *ctx)
+{
+    struct fatx_dev_stdio *dev = ctx;
+
+    return fflush(dev->file) ? FATX_STATUS_ERROR : FATX_STATUS_SUCCESS;
+}
+
+static int fatx_dev_stdio_size(void *ctx, uint64_t *size)
+{
+    struct fatx_dev_stdio *dev = ctx;
+
+    if (_fseeki64(dev->file, 0, SEEK_END))
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    *size = _ftelli64(dev->file);
+    return FATX_STATUS_SUCCESS;
+}
+
+static int fatx_dev_stdio_close(void *ctx)
 {
+    struct fatx_dev_stdio *dev = ctx;
     int status;
 
-#ifdef _WIN32
-    status = _fseeki64(fs->device, offset, SEEK_SET);
+    status = fclose(dev->file) ? FATX_STATUS_ERROR : FATX_STATUS_SUCCESS;
+    free(dev);
+    return status;
+}
+
+static const struct fatx_dev_ops fatx_dev_stdio_ops = {
+    .read_at    = fatx_dev_stdio_read_at,
+    .write_at   = fatx_dev_stdio_write_at,
+    .flush      = fatx_dev_stdio_flush,
+    .size       = fatx_dev_stdio_size,
+    .discard    = NULL,
+    .close      = fatx_dev_stdio_close,
+};
+
+static int fatx_dev_open_default(struct fatx_fs *fs)
+{
+    struct fatx_dev_stdio *dev;
+
+    dev = malloc(sizeof(*dev));
+    if (!dev)
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    dev->file = fopen(fs->device_path, (fs->open_flags & FATX_OPEN_READ_ONLY) ? "rb" : "r+b");
+    if (!dev->file)
+    {
+        free(dev);
+        return FATX_STATUS_ERROR;
+    }
+
+    fs->dev_ops = &fatx_dev_stdio_ops;
+    fs->dev_ctx = dev;
+    return FATX_STATUS_SUCCESS;
+}
+
+static int fatx_dev_uring_attach(struct fatx_fs *fs)
+{
+    fatx_debug(fs, "io_uring is not supported on this platform\n");
+    return FATX_STATUS_ERROR;
+}
+
+int fatx_dev_map(struct fatx_fs *fs)
+{
+    fatx_error(fs, "memory mapped devices are not supported on this platform\n");
+    return FATX_STATUS_ERROR;
+}
+
+const void *fatx_dev_map_ptr(struct fatx_fs *fs, uint64_t offset, size_t size)
+{
+    (void)fs;
+    (void)offset;
+    (void)size;
+
+    return NULL;
+}
+
+int fatx_dev_wipe(struct fatx_fs *fs, uint64_t offset, uint64_t size)
+{
+    return fatx_dev_zero(fs, offset, size);
+}
+
+int fatx_dev_fd(struct fatx_fs *fs)
+{
+    (void)fs;
+
+    return -1;
+}
+
 #else
-    status = fseeko(fs->device, offset, SEEK_SET);
-#endif
-    if (status)
+
+/*
+ * The file descriptor backend, used by default on POSIX systems. What the
+ * descriptor refers to is looked up once when it is opened.
+ */
+struct fatx_dev_fd {
+    int      fd;
+    bool     is_block;
+    bool     is_file;
+    uint64_t file_size;
+};
+
+static int fatx_dev_fd_read_at(void *ctx, void *buf, size_t size, uint64_t offset)
+{
+    struct fatx_dev_fd *dev = ctx;
+    ssize_t bytes_read;
+
+    while (size > 0)
+    {
+        bytes_read = pread(dev->fd, buf, size, offset);
+        if (bytes_read < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytes_read <= 0)
+        {
+            return FATX_STATUS_ERROR;
+        }
+
+        buf     = (uint8_t *)buf + bytes_read;
+        size   -= bytes_read;
+        offset += bytes_read;
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+static int fatx_dev_fd_write_at(void *ctx, const void *buf, size_t size, uint64_t offset)
+{
+    struct fatx_dev_fd *dev = ctx;
+    ssize_t bytes_written;
+
+    while (size > 0)
+    {
+        bytes_written = pwrite(dev->fd, buf, size, offset);
+        if (bytes_written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytes_written <= 0)
+        {
+            return FATX_STATUS_ERROR;
+        }
+
+        buf     = (const uint8_t *)buf + bytes_written;
+        size   -= bytes_written;
+        offset += bytes_written;
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+static int fatx_dev_fd_flush(void *ctx)
+{
+    struct fatx_dev_fd *dev = ctx;
+
+    return fsync(dev->fd) ? FATX_STATUS_ERROR : FATX_STATUS_SUCCESS;
+}
+
+static int fatx_dev_fd_size(void *ctx, uint64_t *size)
+{
+    struct fatx_dev_fd *dev = ctx;
+    off_t end;
+
+    end = lseek(dev->fd, 0, SEEK_END);
+    if (end < 0)
     {
-        fatx_error(fs, "failed to seek\n");
         return FATX_STATUS_ERROR;
     }
 
+    *size = end;
     return FATX_STATUS_SUCCESS;
 }
 
+static int fatx_dev_fd_discard(void *ctx, uint64_t offset, uint64_t size)
+{
+#ifdef __linux__
+    struct fatx_dev_fd *dev = ctx;
+    uint64_t range[2] = { offset, size };
+
+    if (dev->is_block)
+    {
+        return ioctl(dev->fd, BLKDISCARD, &range) ? FATX_STATUS_ERROR : FATX_STATUS_SUCCESS;
+    }
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+    if (dev->is_file)
+    {
+        return fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) ? FATX_STATUS_ERROR : FATX_STATUS_SUCCESS;
+    }
+#endif
+#else
+    (void)ctx;
+    (void)offset;
+    (void)size;
+#endif
+
+    return FATX_STATUS_ERROR;
+}
+
+/*
+ * Punch a hole in an image file, which reads back as zeros and gives the
+ * space back to the host filesystem. Fails on anything but a regular file.
+ */
+static int fatx_dev_fd_punch_hole(struct fatx_dev_fd *dev, uint64_t offset, uint64_t size)
+{
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (dev->is_file && offset + size <= dev->file_size &&
+        fallocate(dev->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0)
+    {
+        return FATX_STATUS_SUCCESS;
+    }
+#else
+    (void)dev;
+    (void)offset;
+    (void)size;
+#endif
+
+    return FATX_STATUS_ERROR;
+}
+
 /*
- * Seek to a cluster + byte offset in the device.
+ * Fill a range with zeros. The range stays allocated, so that later writes
+ * to it cannot run out of space on the host.
  */
-int fatx_dev_seek_cluster(struct fatx_fs *fs, size_t cluster, off_t offset)
+static int fatx_dev_fd_zero_range(void *ctx, uint64_t offset, uint64_t size)
+{
+    struct fatx_dev_fd *dev = ctx;
+    struct iovec iov[FATX_DEV_ZERO_IOVECS];
+    ssize_t bytes_written;
+    size_t n, chunk;
+#ifdef __linux__
+    uint64_t range[2] = { offset, size };
+
+    /* Let the storage zero the range, if it can. */
+    if (dev->is_block && offset % 512 == 0 && size % 512 == 0 && ioctl(dev->fd, BLKZEROOUT, &range) == 0)
+    {
+        return FATX_STATUS_SUCCESS;
+    }
+
+#ifdef FALLOC_FL_ZERO_RANGE
+    if (dev->is_file && fallocate(dev->fd, FALLOC_FL_ZERO_RANGE, offset, size) == 0)
+    {
+        return FATX_STATUS_SUCCESS;
+    }
+#endif
+#endif
+
+    /* Otherwise write the zero page out, several times per system call. */
+    while (size > 0)
+    {
+        for (n = 0, chunk = 0; n < FATX_DEV_ZERO_IOVECS && chunk < size; n++)
+        {
+            iov[n].iov_base = (void *)fatx_dev_zero_page;
+            iov[n].iov_len  = MIN(sizeof(fatx_dev_zero_page), size - chunk);
+            chunk += iov[n].iov_len;
+        }
+
+        bytes_written = pwritev(dev->fd, iov, n, offset);
+        if (bytes_written < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (bytes_written <= 0)
+        {
+            return FATX_STATUS_ERROR;
+        }
+
+        size   -= bytes_written;
+        offset += bytes_written;
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+static int fatx_dev_fd_close(void *ctx)
 {
+    struct fatx_dev_fd *dev = ctx;
     int status;
-    uint64_t pos;
 
-    fatx_debug(fs, "fatx_dev_seek_cluster(cluster=%zd, offset=0x%zx)\n", cluster, offset);
+    status = close(dev->fd) ? FATX_STATUS_ERROR : FATX_STATUS_SUCCESS;
+    free(dev);
+    return status;
+}
+
+static const struct fatx_dev_ops fatx_dev_fd_ops = {
+    .read_at    = fatx_dev_fd_read_at,
+    .write_at   = fatx_dev_fd_write_at,
+    .flush      = fatx_dev_fd_flush,
+    .size       = fatx_dev_fd_size,
+    .discard    = fatx_dev_fd_discard,
+    .close      = fatx_dev_fd_close,
+    .zero_range = fatx_dev_fd_zero_range,
+};
 
-    status = fatx_cluster_number_to_byte_offset(fs, cluster, &pos);
-    if (status) return status;
+static int fatx_dev_open_default(struct fatx_fs *fs)
+{
+    struct fatx_dev_fd *dev;
+    struct stat st;
+
+    dev = malloc(sizeof(*dev));
+    if (!dev)
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    dev->fd = open(fs->device_path, (fs->open_flags & FATX_OPEN_READ_ONLY) ? O_RDONLY : O_RDWR);
+    if (dev->fd < 0)
+    {
+        free(dev);
+        return FATX_STATUS_ERROR;
+    }
+
+    if (fstat(dev->fd, &st))
+    {
+        close(dev->fd);
+        free(dev);
+        return FATX_STATUS_ERROR;
+    }
+
+    dev->is_block  = S_ISBLK(st.st_mode);
+    dev->is_file   = S_ISREG(st.st_mode);
+    dev->file_size = st.st_size;
+
+    fs->dev_ops = &fatx_dev_fd_ops;
+    fs->dev_ctx = dev;
+    return FATX_STATUS_SUCCESS;
+}
+
+#ifdef FATX_HAVE_IO_URING
+
+/* Number of submission queue entries requested for each ring. */
+#define FATX_DEV_URING_ENTRIES 64
+
+/* Number of rings, and so of batches that can be on a ring at once. */
+#define FATX_DEV_URING_RINGS   4
+
+/*
+ * A single io_uring. It runs one batch at a time.
+ */
+struct fatx_dev_uring_ring {
+    int                  ring_fd;
+    bool                 failed;
+    void                *sq_ptr;
+    size_t               sq_size;
+    void                *cq_ptr;
+    size_t               cq_size;
+    struct io_uring_sqe *sqes;
+    size_t               sqes_size;
+    unsigned            *sq_tail;
+    unsigned            *sq_mask;
+    unsigned            *sq_array;
+    unsigned             sq_entries;
+    unsigned            *cq_head;
+    unsigned            *cq_tail;
+    unsigned            *cq_mask;
+    struct io_uring_cqe *cqes;
+};
+
+/*
+ * The io_uring backend. Batches are queued on a ring and submitted with a
+ * single system call; single reads and writes, and anything a ring fails to
+ * complete, go through the file descriptor directly.
+ *
+ * A batch has a ring to itself while it runs, so batches from different
+ * threads don't wait for each other's I/O. Rings are set up as they are
+ * needed, up to FATX_DEV_URING_RINGS of them, and a batch that finds them
+ * all busy goes through the file descriptor. The lock only guards the list
+ * of idle rings.
+ */
+struct fatx_dev_uring {
+    struct fatx_dev_fd          dev;
+    pthread_mutex_t             lock;
+    bool                        failed;
+    size_t                      num_rings;
+    size_t                      max_rings;
+    size_t                      num_idle;
+    struct fatx_dev_uring_ring *idle[FATX_DEV_URING_RINGS];
+};
+
+static void fatx_dev_uring_unmap(struct fatx_dev_uring_ring *ring)
+{
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ptr && ring->cq_ptr != ring->sq_ptr) munmap(ring->cq_ptr, ring->cq_size);
+    if (ring->sq_ptr) munmap(ring->sq_ptr, ring->sq_size);
+    close(ring->ring_fd);
+}
+
+/*
+ * Set up a ring and map its queues.
+ */
+static int fatx_dev_uring_setup(struct fatx_dev_uring_ring *ring)
+{
+    struct io_uring_params params;
+    uint8_t *sq_ptr, *cq_ptr;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+
+    ring->ring_fd = syscall(__NR_io_uring_setup, FATX_DEV_URING_ENTRIES, &params);
+    if (ring->ring_fd < 0)
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    ring->sq_size   = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_size   = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    /* Newer kernels map both rings with a single mapping. */
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->sq_size = ring->cq_size = MAX(ring->sq_size, ring->cq_size);
+    }
+
+    sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+    {
+        goto error;
+    }
+    ring->sq_ptr = sq_ptr;
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        cq_ptr = sq_ptr;
+    }
+    else
+    {
+        cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+        {
+            goto error;
+        }
+    }
+    ring->cq_ptr = cq_ptr;
+
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        ring->sqes = NULL;
+        goto error;
+    }
+
+    ring->sq_tail    = (unsigned *)(sq_ptr + params.sq_off.tail);
+    ring->sq_mask    = (unsigned *)(sq_ptr + params.sq_off.ring_mask);
+    ring->sq_array   = (unsigned *)(sq_ptr + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->cq_head    = (unsigned *)(cq_ptr + params.cq_off.head);
+    ring->cq_tail    = (unsigned *)(cq_ptr + params.cq_off.tail);
+    ring->cq_mask    = (unsigned *)(cq_ptr + params.cq_off.ring_mask);
+    ring->cqes       = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+
+    return FATX_STATUS_SUCCESS;
+
+error:
+    fatx_dev_uring_unmap(ring);
+    return FATX_STATUS_ERROR;
+}
+
+/*
+ * Take an idle ring for a batch, setting up another one if they are all
+ * busy. Returns NULL if there is no ring to be had.
+ */
+static struct fatx_dev_uring_ring *fatx_dev_uring_get(struct fatx_dev_uring *uring)
+{
+    struct fatx_dev_uring_ring *ring = NULL;
+    bool setup = false;
+
+    pthread_mutex_lock(&uring->lock);
+    if (!uring->failed)
+    {
+        if (uring->num_idle)
+        {
+            ring = uring->idle[--uring->num_idle];
+        }
+        else if (uring->num_rings < uring->max_rings)
+        {
+            uring->num_rings++;
+            setup = true;
+        }
+    }
+    pthread_mutex_unlock(&uring->lock);
+
+    if (!setup)
+    {
+        return ring;
+    }
 
-    pos += offset;
+    ring = malloc(sizeof(*ring));
+    if (!ring || fatx_dev_uring_setup(ring))
+    {
+        /* The kernel may have no more rings to give; make do with these. */
+        free(ring);
+        pthread_mutex_lock(&uring->lock);
+        uring->num_rings--;
+        uring->max_rings = uring->num_rings;
+        pthread_mutex_unlock(&uring->lock);
+        return NULL;
+    }
+
+    return ring;
+}
+
+/*
+ * Give a ring back once its batch is done. Once any ring stops working, no
+ * more batches are run on rings.
+ */
+static void fatx_dev_uring_put(struct fatx_dev_uring *uring, struct fatx_dev_uring_ring *ring)
+{
+    pthread_mutex_lock(&uring->lock);
+    uring->idle[uring->num_idle++] = ring;
+    uring->failed |= ring->failed;
+    pthread_mutex_unlock(&uring->lock);
+}
+
+/*
+ * Finish an I/O with the file descriptor, from the given number of bytes in.
+ */
+static int fatx_dev_uring_complete(struct fatx_dev_uring *uring, struct fatx_dev_io *io, size_t done)
+{
+    if (io->write)
+    {
+        return fatx_dev_fd_write_at(&uring->dev, (uint8_t *)io->buf + done, io->size - done, io->offset + done);
+    }
 
-    return fatx_dev_seek(fs, pos);
+    return fatx_dev_fd_read_at(&uring->dev, (uint8_t *)io->buf + done, io->size - done, io->offset + done);
 }
 
 /*
- * Read from the device.
+ * Do a batch with the file descriptor, one I/O at a time.
  */
-size_t fatx_dev_read(struct fatx_fs *fs, void *buf, size_t size, size_t items)
+static int fatx_dev_uring_run_fd(struct fatx_dev_uring *uring, struct fatx_dev_io *ios, size_t count)
 {
-    fatx_debug(fs, "fatx_dev_read(buf=0x%p, size=0x%zx, items=0x%zx)\n", buf, size, items);
-    return fread(buf, size, items, fs->device);
+    size_t i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (fatx_dev_uring_complete(uring, &ios[i], 0))
+        {
+            return FATX_STATUS_ERROR;
+        }
+    }
+
+    return FATX_STATUS_SUCCESS;
 }
 
 /*
- * Write to the device.
+ * Queue up to sq_entries I/Os on the ring, submit them and wait for all of
+ * them to complete.
+ *
+ * If the ring stops working, the I/Os that were already submitted are still
+ * waited for, as they point at the callers' buffers. The rest are done with
+ * the file descriptor.
  */
-size_t fatx_dev_write(struct fatx_fs *fs, const void *buf, size_t size, size_t items)
+static int fatx_dev_uring_run(struct fatx_dev_uring *uring, struct fatx_dev_uring_ring *ring, struct fatx_dev_io *ios, size_t count)
 {
-    fatx_debug(fs, "fatx_dev_write(buf=0x%p, size=0x%zx, items=0x%zx)\n", buf, size, items);
-    return fwrite(buf, size, items, fs->device);
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    unsigned tail, head, index;
+    size_t i, to_submit, submitted, completed;
+    int status = FATX_STATUS_SUCCESS;
+    int ret;
+
+    tail = *ring->sq_tail;
+    for (i = 0; i < count; i++)
+    {
+        index = tail & *ring->sq_mask;
+        sqe   = &ring->sqes[index];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode    = ios[i].write ? IORING_OP_WRITE : IORING_OP_READ;
+        sqe->fd        = uring->dev.fd;
+        sqe->addr      = (uint64_t)(uintptr_t)ios[i].buf;
+        sqe->len       = ios[i].size;
+        sqe->off       = ios[i].offset;
+        sqe->user_data = i;
+
+        ring->sq_array[index] = index;
+        tail++;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    to_submit = count;
+    submitted = completed = 0;
+
+    while (completed < submitted + to_submit)
+    {
+        if (ring->failed)
+        {
+            /* Completions are still posted without entering the ring. */
+            sched_yield();
+        }
+        else
+        {
+            ret = syscall(__NR_io_uring_enter, ring->ring_fd, to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret >= 0)
+            {
+                submitted += ret;
+                to_submit -= ret;
+            }
+            else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            {
+                /* The ring is in an unknown state; stop using it. */
+                ring->failed = true;
+                to_submit = 0;
+            }
+        }
+
+        head = *ring->cq_head;
+        while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE))
+        {
+            cqe = &ring->cqes[head & *ring->cq_mask];
+
+            /* Retry failed and short transfers synchronously. */
+            if (cqe->res < 0 || (size_t)cqe->res < ios[cqe->user_data].size)
+            {
+                if (fatx_dev_uring_complete(uring, &ios[cqe->user_data], cqe->res < 0 ? 0 : cqe->res))
+                {
+                    status = FATX_STATUS_ERROR;
+                }
+            }
+
+            head++;
+            completed++;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    /* I/Os are taken from the queue in order, so these were never submitted. */
+    if (fatx_dev_uring_run_fd(uring, ios + submitted, count - submitted))
+    {
+        status = FATX_STATUS_ERROR;
+    }
+
+    return status;
+}
+
+static int fatx_dev_uring_submit(void *ctx, struct fatx_dev_io *ios, size_t count)
+{
+    struct fatx_dev_uring *uring = ctx;
+    struct fatx_dev_uring_ring *ring = NULL;
+    int status = FATX_STATUS_SUCCESS;
+    size_t i, n;
+
+    /* A single I/O gains nothing from going through a ring. */
+    if (count > 1)
+    {
+        ring = fatx_dev_uring_get(uring);
+    }
+
+    if (!ring)
+    {
+        return fatx_dev_uring_run_fd(uring, ios, count);
+    }
+
+    for (i = 0; i < count && status == FATX_STATUS_SUCCESS; i += n)
+    {
+        n = MIN(count - i, ring->sq_entries);
+
+        if (ring->failed)
+        {
+            status = fatx_dev_uring_run_fd(uring, ios + i, n);
+        }
+        else
+        {
+            status = fatx_dev_uring_run(uring, ring, ios + i, n);
+        }
+    }
+
+    fatx_dev_uring_put(uring, ring);
+    return status;
+}
+
+static int fatx_dev_uring_read_at(void *ctx, void *buf, size_t size, uint64_t offset)
+{
+    struct fatx_dev_uring *uring = ctx;
+
+    return fatx_dev_fd_read_at(&uring->dev, buf, size, offset);
+}
+
+static int fatx_dev_uring_write_at(void *ctx, const void *buf, size_t size, uint64_t offset)
+{
+    struct fatx_dev_uring *uring = ctx;
+
+    return fatx_dev_fd_write_at(&uring->dev, buf, size, offset);
+}
+
+static int fatx_dev_uring_flush(void *ctx)
+{
+    struct fatx_dev_uring *uring = ctx;
+
+    return fatx_dev_fd_flush(&uring->dev);
+}
+
+static int fatx_dev_uring_size(void *ctx, uint64_t *size)
+{
+    struct fatx_dev_uring *uring = ctx;
+
+    return fatx_dev_fd_size(&uring->dev, size);
+}
+
+static int fatx_dev_uring_discard(void *ctx, uint64_t offset, uint64_t size)
+{
+    struct fatx_dev_uring *uring = ctx;
+
+    return fatx_dev_fd_discard(&uring->dev, offset, size);
+}
+
+static int fatx_dev_uring_zero_range(void *ctx, uint64_t offset, uint64_t size)
+{
+    struct fatx_dev_uring *uring = ctx;
+
+    return fatx_dev_fd_zero_range(&uring->dev, offset, size);
+}
+
+static int fatx_dev_uring_close(void *ctx)
+{
+    struct fatx_dev_uring *uring = ctx;
+    int status = FATX_STATUS_SUCCESS;
+    size_t i;
+
+    /* Nothing else runs while the device is closed, so every ring is idle. */
+    for (i = 0; i < uring->num_idle; i++)
+    {
+        fatx_dev_uring_unmap(uring->idle[i]);
+        free(uring->idle[i]);
+    }
+
+    pthread_mutex_destroy(&uring->lock);
+
+    if (close(uring->dev.fd))
+    {
+        status = FATX_STATUS_ERROR;
+    }
+
+    free(uring);
+    return status;
+}
+
+static const struct fatx_dev_ops fatx_dev_uring_ops = {
+    .read_at    = fatx_dev_uring_read_at,
+    .write_at   = fatx_dev_uring_write_at,
+    .flush      = fatx_dev_uring_flush,
+    .size       = fatx_dev_uring_size,
+    .discard    = fatx_dev_uring_discard,
+    .close      = fatx_dev_uring_close,
+    .submit     = fatx_dev_uring_submit,
+    .zero_range = fatx_dev_uring_zero_range,
+};
+
+/*
+ * Set up an io_uring for the default backend's file descriptor, and switch
+ * the backend over to it.
+ */
+static int fatx_dev_uring_attach(struct fatx_fs *fs)
+{
+    struct fatx_dev_fd *dev = fs->dev_ctx;
+    struct fatx_dev_uring *uring;
+    struct fatx_dev_uring_ring *ring;
+
+    if (fs->dev_ops != &fatx_dev_fd_ops)
+    {
+        fatx_debug(fs, "io_uring requires the default device backend\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    uring = calloc(1, sizeof(*uring));
+    ring  = malloc(sizeof(*ring));
+    if (!uring || !ring)
+    {
+        free(uring);
+        free(ring);
+        return FATX_STATUS_ERROR;
+    }
+
+    /* Make sure that the kernel gives out rings at all before switching. */
+    if (fatx_dev_uring_setup(ring))
+    {
+        fatx_debug(fs, "failed to set up io_uring\n");
+        free(uring);
+        free(ring);
+        return FATX_STATUS_ERROR;
+    }
+
+    if (pthread_mutex_init(&uring->lock, NULL))
+    {
+        fatx_dev_uring_unmap(ring);
+        free(uring);
+        free(ring);
+        return FATX_STATUS_ERROR;
+    }
+
+    uring->dev       = *dev;
+    uring->idle[0]   = ring;
+    uring->num_idle  = 1;
+    uring->num_rings = 1;
+    uring->max_rings = FATX_DEV_URING_RINGS;
+    free(dev);
+
+    fs->dev_ops = &fatx_dev_uring_ops;
+    fs->dev_ctx = uring;
+
+    fatx_debug(fs, "using io_uring with %u entries\n", ring->sq_entries);
+    return FATX_STATUS_SUCCESS;
+}
+
+#else
+
+static int fatx_dev_uring_attach(struct fatx_fs *fs)
+{
+    fatx_debug(fs, "libfatx was built without io_uring support\n");
+    return FATX_STATUS_ERROR;
+}
+
+#endif
+
+/*
+ * The memory mapped backend. The partition is mapped read-only, and reads
+ * that fall outside of it go to the file descriptor.
+ */
+struct fatx_dev_mmap {
+    struct fatx_dev_fd dev;
+    const uint8_t     *base;
+    uint64_t           start;
+    size_t             length;
+};
+
+static int fatx_dev_mmap_read_at(void *ctx, void *buf, size_t size, uint64_t offset)
+{
+    struct fatx_dev_mmap *map = ctx;
+
+    if (offset < map->start || offset - map->start > map->length || size > map->length - (offset - map->start))
+    {
+        return fatx_dev_fd_read_at(&map->dev, buf, size, offset);
+    }
+
+    memcpy(buf, map->base + (offset - map->start), size);
+    return FATX_STATUS_SUCCESS;
+}
+
+static int fatx_dev_mmap_write_at(void *ctx, const void *buf, size_t size, uint64_t offset)
+{
+    (void)ctx;
+    (void)buf;
+    (void)size;
+    (void)offset;
+
+    return FATX_STATUS_ERROR;
+}
+
+static int fatx_dev_mmap_flush(void *ctx)
+{
+    (void)ctx;
+
+    return FATX_STATUS_SUCCESS;
+}
+
+static int fatx_dev_mmap_size(void *ctx, uint64_t *size)
+{
+    struct fatx_dev_mmap *map = ctx;
+
+    return fatx_dev_fd_size(&map->dev, size);
+}
+
+static int fatx_dev_mmap_close(void *ctx)
+{
+    struct fatx_dev_mmap *map = ctx;
+    int status = FATX_STATUS_SUCCESS;
+
+    if (munmap((void *)map->base, map->length))
+    {
+        status = FATX_STATUS_ERROR;
+    }
+
+    if (close(map->dev.fd))
+    {
+        status = FATX_STATUS_ERROR;
+    }
+
+    free(map);
+    return status;
+}
+
+static const struct fatx_dev_ops fatx_dev_mmap_ops = {
+    .read_at    = fatx_dev_mmap_read_at,
+    .write_at   = fatx_dev_mmap_write_at,
+    .flush      = fatx_dev_mmap_flush,
+    .size       = fatx_dev_mmap_size,
+    .discard    = NULL,
+    .close      = fatx_dev_mmap_close,
+};
+
+/*
+ * Map the partition into memory, and switch the default backend over to
+ * serving reads from the mapping.
+ */
+int fatx_dev_map(struct fatx_fs *fs)
+{
+    struct fatx_dev_fd *dev = fs->dev_ctx;
+    struct fatx_dev_mmap *map;
+    uint64_t page_size, start;
+    void *base;
+
+    if (fs->dev_ops != &fatx_dev_fd_ops)
+    {
+        fatx_error(fs, "memory mapping requires the default device backend\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    if (fs->partition_size > SIZE_MAX)
+    {
+        fatx_error(fs, "partition is too large to map into memory\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    map = malloc(sizeof(*map));
+    if (!map)
+    {
+        fatx_error(fs, "failed to allocate memory for device mapping\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    /* The mapping has to start on a page boundary. */
+    page_size = sysconf(_SC_PAGESIZE);
+    start     = fs->partition_offset - fs->partition_offset % page_size;
+
+    map->dev    = *dev;
+    map->start  = start;
+    map->length = fs->partition_offset - start + fs->partition_size;
+
+    base = mmap(NULL, map->length, PROT_READ, MAP_SHARED, dev->fd, start);
+    if (base == MAP_FAILED)
+    {
+        fatx_error(fs, "failed to map %s into memory\n", fs->device_path);
+        free(map);
+        return FATX_STATUS_ERROR;
+    }
+
+    map->base = base;
+    free(dev);
+
+    fs->dev_ops = &fatx_dev_mmap_ops;
+    fs->dev_ctx = map;
+
+    fatx_debug(fs, "mapped 0x%zx bytes at offset 0x%llx\n", map->length, start);
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Get a pointer to size bytes at a byte offset in the device, if the device
+ * is memory mapped and the range lies within the mapping. Returns NULL
+ * otherwise, in which case the caller should read the range instead.
+ */
+const void *fatx_dev_map_ptr(struct fatx_fs *fs, uint64_t offset, size_t size)
+{
+    struct fatx_dev_mmap *map = fs->dev_ctx;
+
+    if (fs->dev_ops != &fatx_dev_mmap_ops)
+    {
+        return NULL;
+    }
+
+    if (offset < map->start || offset - map->start > map->length || size > map->length - (offset - map->start))
+    {
+        return NULL;
+    }
+
+    return map->base + (offset - map->start);
+}
+
+/*
+ * Get the file descriptor backend underneath one of the built-in backends.
+ * Returns NULL for custom backends.
+ */
+static struct fatx_dev_fd *fatx_dev_fd_ctx(struct fatx_fs *fs)
+{
+    if (fs->dev_ops == &fatx_dev_fd_ops ||
+#ifdef FATX_HAVE_IO_URING
+        fs->dev_ops == &fatx_dev_uring_ops ||
+#endif
+        fs->dev_ops == &fatx_dev_mmap_ops)
+    {
+        /* Every built-in backend starts with the file descriptor backend. */
+        return fs->dev_ctx;
+    }
+
+    return NULL;
+}
+
+/*
+ * Fill a range that nothing will be written to soon with zeros, such as the
+ * FAT of a freshly formatted partition. In an image file a hole is punched,
+ * which keeps the image sparse; everything else is zeroed as usual.
+ */
+int fatx_dev_wipe(struct fatx_fs *fs, uint64_t offset, uint64_t size)
+{
+    struct fatx_dev_fd *dev = fatx_dev_fd_ctx(fs);
+
+    fatx_debug(fs, "fatx_dev_wipe(offset=0x%llx, size=0x%llx)\n", offset, size);
+
+    if (dev && fatx_dev_fd_punch_hole(dev, offset, size) == FATX_STATUS_SUCCESS)
+    {
+        return FATX_STATUS_SUCCESS;
+    }
+
+    return fatx_dev_zero(fs, offset, size);
+}
+
+/*
+ * Get the file descriptor of the device, if it is opened by one of the
+ * built-in backends. Returns -1 for custom backends.
+ */
+int fatx_dev_fd(struct fatx_fs *fs)
+{
+    struct fatx_dev_fd *dev = fatx_dev_fd_ctx(fs);
+
+    return dev ? dev->fd : -1;
+}
+
+#endif
+
+/*
+ * Open the device backend. If the options name a backend, it is used as is;
+ * otherwise the device at fs->device_path is opened for reading, and also for
+ * writing unless the filesystem is read-only.
+ */
+int fatx_dev_open(struct fatx_fs *fs, struct fatx_open_options const *options)
+{
+    if (options && options->dev_ops)
+    {
+        if (!options->dev_ops->read_at || !options->dev_ops->write_at ||
+            !options->dev_ops->flush || !options->dev_ops->size)
+        {
+            fatx_error(fs, "device backend is missing required operations\n");
+            return FATX_STATUS_ERROR;
+        }
+
+        fs->dev_ops = options->dev_ops;
+        fs->dev_ctx = options->dev_ctx;
+        return FATX_STATUS_SUCCESS;
+    }
+
+    if (fatx_dev_open_default(fs))
+    {
+        fatx_error(fs, "failed to open %s for %s\n", fs->device_path,
+                   (fs->open_flags & FATX_OPEN_READ_ONLY) ? "reading" : "reading and writing");
+        return FATX_STATUS_ERROR;
+    }
+
+    if ((fs->open_flags & FATX_OPEN_IO_URING) && !(fs->open_flags & FATX_OPEN_MMAP) && fatx_dev_uring_attach(fs))
+    {
+        fatx_info(fs, "io_uring is unavailable, falling back to the default device backend\n");
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Close the device backend.
+ */
+int fatx_dev_close(struct fatx_fs *fs)
+{
+    if (fs->dev_ops->close && fs->dev_ops->close(fs->dev_ctx))
+    {
+        fatx_error(fs, "failed to close device\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Read size bytes from a byte offset in the device.
+ *
+ * Success means that all of the bytes were read.
+ */
+int fatx_dev_read_at(struct fatx_fs *fs, void *buf, size_t size, uint64_t offset)
+{
+    fatx_debug(fs, "fatx_dev_read_at(buf=0x%p, size=0x%zx, offset=0x%llx)\n", buf, size, offset);
+
+    if (fs->dev_ops->read_at(fs->dev_ctx, buf, size, offset))
+    {
+        fatx_error(fs, "failed to read 0x%zx bytes at offset 0x%llx\n", size, offset);
+        return FATX_STATUS_ERROR;
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Write size bytes to a byte offset in the device.
+ *
+ * Success means that all of the bytes were written.
+ */
+int fatx_dev_write_at(struct fatx_fs *fs, const void *buf, size_t size, uint64_t offset)
+{
+    fatx_debug(fs, "fatx_dev_write_at(buf=0x%p, size=0x%zx, offset=0x%llx)\n", buf, size, offset);
+
+    if (fs->dev_ops->write_at(fs->dev_ctx, buf, size, offset))
+    {
+        fatx_error(fs, "failed to write 0x%zx bytes at offset 0x%llx\n", size, offset);
+        return FATX_STATUS_ERROR;
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Perform a batch of independent reads and writes, letting the backend
+ * overlap them if it can.
+ *
+ * Success means that all of the bytes of every I/O were transferred.
+ */
+int fatx_dev_submit(struct fatx_fs *fs, struct fatx_dev_io *ios, size_t count)
+{
+    size_t i;
+
+    fatx_debug(fs, "fatx_dev_submit(count=%zd)\n", count);
+
+    if (count == 0)
+    {
+        return FATX_STATUS_SUCCESS;
+    }
+
+    if (fs->dev_ops->submit)
+    {
+        if (fs->dev_ops->submit(fs->dev_ctx, ios, count))
+        {
+            fatx_error(fs, "failed to complete a batch of %zd device I/Os\n", count);
+            return FATX_STATUS_ERROR;
+        }
+
+        return FATX_STATUS_SUCCESS;
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if (ios[i].write ? fatx_dev_write_at(fs, ios[i].buf, ios[i].size, ios[i].offset)
+                         : fatx_dev_read_at(fs, ios[i].buf, ios[i].size, ios[i].offset))
+        {
+            return FATX_STATUS_ERROR;
+        }
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Start an empty batch.
+ */
+void fatx_dev_batch_init(struct fatx_dev_batch *batch)
+{
+    batch->count = 0;
+}
+
+/*
+ * Queue an I/O on a batch, submitting the batch first if it is full.
+ */
+int fatx_dev_batch_add(struct fatx_fs *fs, struct fatx_dev_batch *batch, bool write, void *buf, size_t size, uint64_t offset)
+{
+    struct fatx_dev_io *io;
+
+    if (batch->count == FATX_DEV_BATCH_SIZE && fatx_dev_batch_submit(fs, batch))
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    io = &batch->ios[batch->count++];
+    io->write  = write;
+    io->buf    = buf;
+    io->size   = size;
+    io->offset = offset;
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Submit the I/Os queued on a batch, and empty it.
+ */
+int fatx_dev_batch_submit(struct fatx_fs *fs, struct fatx_dev_batch *batch)
+{
+    size_t count = batch->count;
+
+    batch->count = 0;
+    return fatx_dev_submit(fs, batch->ios, count);
+}
+
+/*
+ * Flush device writes to stable storage.
+ */
+int fatx_dev_flush(struct fatx_fs *fs)
+{
+    fatx_debug(fs, "fatx_dev_flush()\n");
+
+    if (fs->dev_ops->flush(fs->dev_ctx))
+    {
+        fatx_error(fs, "failed to flush device\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Get the size (in bytes) of the device.
+ */
+int fatx_dev_size(struct fatx_fs *fs, uint64_t *size)
+{
+    if (fs->dev_ops->size(fs->dev_ctx, size))
+    {
+        fatx_error(fs, "failed to get device size\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Tell the device that a byte range no longer holds useful data. This is only
+ * a hint; it fails if the backend cannot discard, and the range must not be
+ * assumed to read back as zeros afterwards.
+ */
+int fatx_dev_discard(struct fatx_fs *fs, uint64_t offset, uint64_t size)
+{
+    fatx_debug(fs, "fatx_dev_discard(offset=0x%llx, size=0x%llx)\n", offset, size);
+
+    if (!fs->dev_ops->discard)
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    return fs->dev_ops->discard(fs->dev_ctx, offset, size);
+}
+
+/*
+ * Fill a byte range of the device with zeros. The backend zeroes the range
+ * in place where the storage supports it; otherwise the shared zero page is
+ * written over the range in batches.
+ */
+int fatx_dev_zero(struct fatx_fs *fs, uint64_t offset, uint64_t size)
+{
+    struct fatx_dev_batch batch;
+    size_t chunk;
+
+    fatx_debug(fs, "fatx_dev_zero(offset=0x%llx, size=0x%llx)\n", offset, size);
+
+    if (fs->dev_ops->zero_range && fs->dev_ops->zero_range(fs->dev_ctx, offset, size) == FATX_STATUS_SUCCESS)
+    {
+        return FATX_STATUS_SUCCESS;
+    }
+
+    fatx_dev_batch_init(&batch);
+
+    while (size > 0)
+    {
+        chunk = MIN(sizeof(fatx_dev_zero_page), size);
+
+        if (fatx_dev_batch_add(fs, &batch, true, (void *)fatx_dev_zero_page, chunk, offset))
+        {
+            fatx_error(fs, "failed to zero 0x%llx bytes at offset 0x%llx\n", size, offset);
+            return FATX_STATUS_ERROR;
+        }
+
+        offset += chunk;
+        size   -= chunk;
+    }
+
+    return fatx_dev_batch_submit(fs, &batch);
+}
+
+/*
+ * Read from a cluster + byte offset in the device.
+ */
+int fatx_dev_read_cluster(struct fatx_fs *fs, void *buf, size_t size, size_t cluster, size_t offset)
+{
+    uint64_t pos;
+    int status;
+
+    status = fatx_cluster_number_to_byte_offset(fs, cluster, &pos);
+    if (status) return status;
+
+    return fatx_dev_read_at(fs, buf, size, pos + offset);
+}
+
+/*
+ * Write to a cluster + byte offset in the device.
+ */
+int fatx_dev_write_cluster(struct fatx_fs *fs, const void *buf, size_t size, size_t cluster, size_t offset)
+{
+    uint64_t pos;
+    int status;
+
+    status = fatx_cluster_number_to_byte_offset(fs, cluster, &pos);
+    if (status) return status;
+
+    return fatx_dev_write_at(fs, buf, size, pos + offset);
 }
@@ -21,15 +21,142 @@
 #include <time.h>
 #include <stdlib.h>
 
+/*
+ * Set up the cache of directory clusters. A memory mapped device is read in
+ * place and needs no cache.
+ */
+int fatx_init_dir_cache(struct fatx_fs *fs, struct fatx_open_options const *options)
+{
+    size_t cache_size;
+
+    memset(&fs->dir_cache, 0, sizeof(fs->dir_cache));
+
+    if (fatx_dev_map_ptr(fs, fs->cluster_offset, fs->bytes_per_cluster))
+    {
+        return FATX_STATUS_SUCCESS;
+    }
+
+    cache_size = FATX_DIR_CACHE_DEFAULT_SIZE;
+    if (options && options->dir_cache_size)
+    {
+        cache_size = options->dir_cache_size;
+    }
+
+    /* Block N of the cache is the first cluster after the reserved ones. */
+    return fatx_cache_init(fs, &fs->dir_cache, fs->cluster_offset, fs->bytes_per_cluster,
+                           cache_size / fs->bytes_per_cluster);
+}
+
+/*
+ * Release the memory held by the directory cache.
+ */
+void fatx_free_dir_cache(struct fatx_fs *fs)
+{
+    fatx_cache_free(&fs->dir_cache);
+}
+
+/*
+ * Write the modified directory clusters back to the device.
+ */
+int fatx_flush_dir_cache(struct fatx_fs *fs)
+{
+    fatx_debug(fs, "fatx_flush_dir_cache()\n");
+
+    return fatx_cache_flush(fs, &fs->dir_cache);
+}
+
+/*
+ * Drop a cluster from the directory cache, discarding any changes to it. This
+ * is done whenever a cluster is freed, so that a stale copy of it can never
+ * be written back over whatever the cluster is reused for.
+ */
+void fatx_dir_cache_invalidate(struct fatx_fs *fs, size_t cluster)
+{
+    if (cluster >= FATX_FAT_RESERVED_ENTRIES_COUNT)
+    {
+        fatx_cache_invalidate(&fs->dir_cache, cluster - FATX_FAT_RESERVED_ENTRIES_COUNT);
+    }
+}
+
+/*
+ * Read a directory cluster, and up to FATX_DIR_PREFETCH_CLUSTERS of the
+ * clusters that follow it in its chain, into the directory cache with a
+ * single batch of device I/O.
+ */
+static void fatx_dir_prefetch(struct fatx_fs *fs, size_t cluster)
+{
+    size_t blocks[FATX_DIR_PREFETCH_CLUSTERS];
+    size_t count;
+
+    count = 0;
+    do
+    {
+        blocks[count++] = cluster - FATX_FAT_RESERVED_ENTRIES_COUNT;
+    } while (count < FATX_DIR_PREFETCH_CLUSTERS && fatx_get_next_cluster(fs, &cluster) == FATX_STATUS_SUCCESS);
+
+    /* This is only a hint; a failed read is retried when the cluster is used. */
+    fatx_cache_prefetch(fs, &fs->dir_cache, blocks, count);
+}
+
+/*
+ * Get a pointer to the contents of a directory cluster. If write is true,
+ * the cluster is marked dirty and the caller is expected to modify it before
+ * making any other call into the directory cache.
+ */
+static int fatx_dir_cluster_get(struct fatx_fs *fs, size_t cluster, bool write, uint8_t **data)
+{
+    uint64_t pos;
+    void *ptr;
+
+    if (fatx_cluster_number_to_byte_offset(fs, cluster, &pos))
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    /* Without a cache, the device is memory mapped and read-only. */
+    if (!fs->dir_cache.pages)
+    {
+        *data = (uint8_t *)fatx_dev_map_ptr(fs, pos, fs->bytes_per_cluster);
+        if (write || !*data)
+        {
+            fatx_error(fs, "directory cluster %zd is not writable\n", cluster);
+            return FATX_STATUS_ERROR;
+        }
+        return FATX_STATUS_SUCCESS;
+    }
+
+    if (!fatx_cache_contains(&fs->dir_cache, cluster - FATX_FAT_RESERVED_ENTRIES_COUNT))
+    {
+        fatx_dir_prefetch(fs, cluster);
+    }
+
+    if (fatx_cache_get(fs, &fs->dir_cache, cluster - FATX_FAT_RESERVED_ENTRIES_COUNT, write, &ptr))
+    {
+        fatx_error(fs, "failed to load directory cluster %zd\n", cluster);
+        return FATX_STATUS_ERROR;
+    }
+
+    *data = ptr;
+    return FATX_STATUS_SUCCESS;
+}
+
 /*
  * Open a directory.
+ *
+ * The directory is found through the dentry cache when possible: first by
+ * its full path, then one component at a time by name. Components that are
+ * not cached are found by scanning their parent directory, and are then
+ * added to the cache.
  */
-int fatx_open_dir(struct fatx_fs *fs, char const *path, struct fatx_dir *dir)
+static int fatx_open_dir_locked(struct fatx_fs *fs, char const *path, struct fatx_dir *dir)
 {
-    struct fatx_dirent dirent, *nextdirent;
+    struct fatx_dirent dirent;
     struct fatx_attr attr;
-    size_t component, len;
+    struct fatx_dir location;
+    size_t component, len, prefix_len;
+    char name[FATX_MAX_FILENAME_LEN+1];
     char const *start;
+    char *prefix;
     int status;
 
     fatx_debug(fs, "fatx_open_dir(path=\"%s\")\n", path);
@@ -45,6 +172,26 @@ int fatx_open_dir(struct fatx_fs *fs, char const *path, struct fatx_dir *dir)
     dir->cluster = fs->root_cluster;
     dir->entry   = 0;
 
+    prefix = fatx_dentry_path(path, NULL);
+    if (!prefix)
+    {
+        fatx_error(fs, "failed to allocate memory for path\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    /* Try to resolve the whole path at once. */
+    if (strcmp(prefix, "/") != 0 &&
+        fatx_dentry_lookup(fs, FATX_DENTRY_PATH, prefix, strrchr(prefix, FATX_PATH_SEPERATOR) + 1,
+                           &location, &dirent, &attr) == FATX_STATUS_SUCCESS &&
+        (attr.attributes & FATX_ATTR_DIRECTORY))
+    {
+        dir->cluster = attr.first_cluster;
+        status = FATX_STATUS_SUCCESS;
+        goto cleanup;
+    }
+
+    prefix_len = 0;
+
     for (component=1; 1; component++)
     {
         fatx_spew(fs, "checking component %zd in path %s\n", component, path);
@@ -54,7 +201,8 @@ int fatx_open_dir(struct fatx_fs *fs, char const *path, struct fatx_dir *dir)
         if (status)
         {
             fatx_error(fs, "invalid path\n");
-            return -1;
+            status = FATX_STATUS_ERROR;
+            goto cleanup;
         }
 
         if (start == NULL)
@@ -65,73 +213,68 @@ int fatx_open_dir(struct fatx_fs *fs, char const *path, struct fatx_dir *dir)
             break;
         }
 
-        /* Iterate over the directory entries in this directory, looking for the
-         * path component.
-         */
-        while (1)
+        /* Trim trailing slash, if present. */
+        if (start[len-1] == FATX_PATH_SEPERATOR)
         {
-            /* Get the next entry in this directory. */
-            status = fatx_read_dir(fs, dir, &dirent, &attr, &nextdirent);
+            len -= 1;
+        }
 
-            if (status == FATX_STATUS_SUCCESS)
-            {
-                /* Fantastic. See below. */
-            }
-            else if (status == FATX_STATUS_FILE_DELETED)
-            {
-                /* File deleted. Skip over it. */
-                goto continue_to_next_entry;
-            }
-            else if (status == FATX_STATUS_END_OF_DIR)
-            {
-                fatx_error(fs, "path not found\n");
-                return FATX_STATUS_FILE_NOT_FOUND;
-            }
-            else
-            {
-                /* Error occured. */
-                return FATX_STATUS_ERROR;
-            }
+        if (len == 0)
+        {
+            /* Repeated path separator. */
+            continue;
+        }
 
-            fatx_debug(fs, "fatx_read_dir found %s\n", dirent.filename);
+        if (len > FATX_MAX_FILENAME_LEN)
+        {
+            fatx_error(fs, "path not found\n");
+            status = FATX_STATUS_FILE_NOT_FOUND;
+            goto cleanup;
+        }
 
-            /* Check the attributes to see if this is a directory. */
-            if ((attr.attributes & FATX_ATTR_DIRECTORY) == 0)
-            {
-                /* Not a directory. */
-                goto continue_to_next_entry;
-            }
+        memcpy(name, start, len);
+        name[len] = '\0';
 
-            /* Trim trailing slash, if present. */
-            if (start[len-1] == FATX_PATH_SEPERATOR)
-            {
-                len -= 1;
-            }
+        /* Find the entry for this component in the current directory. */
+        location = *dir;
+        status = fatx_get_attr_dir(fs, name, &location, &dirent, &attr);
+        if (status == FATX_STATUS_FILE_NOT_FOUND || (!status && !(attr.attributes & FATX_ATTR_DIRECTORY)))
+        {
+            fatx_error(fs, "path not found\n");
+            status = FATX_STATUS_FILE_NOT_FOUND;
+            goto cleanup;
+        }
+        else if (status)
+        {
+            /* Error occured. */
+            status = FATX_STATUS_ERROR;
+            goto cleanup;
+        }
 
-            /* Compare the path component to this directory entry. */
-            if (memcmp(dirent.filename, start, len) == 0)
-            {
-                /* Path found. */
-                dir->cluster = attr.first_cluster;
-                dir->entry = 0;
-                break;
-            }
+        fatx_debug(fs, "fatx_open_dir found %s\n", dirent.filename);
 
-            continue_to_next_entry:
+        /* Remember the path up to here. */
+        prefix[prefix_len++] = FATX_PATH_SEPERATOR;
+        memcpy(prefix + prefix_len, name, len);
+        prefix_len += len;
+        prefix[prefix_len] = '\0';
+        fatx_dentry_insert(fs, FATX_DENTRY_PATH, prefix, &location);
 
-            /* Get the next directory entry. */
-            status = fatx_next_dir_entry(fs, dir);
-            if (status != FATX_STATUS_SUCCESS) break;
-        }
+        dir->cluster = attr.first_cluster;
+        dir->entry   = 0;
     }
 
-    return FATX_STATUS_SUCCESS;
+    status = FATX_STATUS_SUCCESS;
+
+cleanup:
+    free(prefix);
+    return status;
 }
 
 /*
  * Move to the next directory entry.
  */
-int fatx_next_dir_entry(struct fatx_fs *fs, struct fatx_dir *dir)
+static int fatx_next_dir_entry_locked(struct fatx_fs *fs, struct fatx_dir *dir)
 {
     fatx_fat_entry fat_entry;
     int status;
@@ -178,33 +321,25 @@ int fatx_next_dir_entry(struct fatx_fs *fs, struct fatx_dir *dir)
  * attr should be a pointer to an allocation of struct fatx_attr.
  * result should be a pointer to a pointer that contains the result of read_dir.
  */
-int fatx_read_dir(struct fatx_fs *fs, struct fatx_dir *dir, struct fatx_dirent *entry, struct fatx_attr *attr, struct fatx_dirent **result)
+static int fatx_read_dir_locked(struct fatx_fs *fs, struct fatx_dir *dir, struct fatx_dirent *entry, struct fatx_attr *attr, struct fatx_dirent **result)
 {
-    struct fatx_raw_directory_entry directory_entry;
-    size_t items, offset;
+    const struct fatx_raw_directory_entry *directory_entry;
+    uint8_t *data;
     int status;
 
     fatx_debug(fs, "fatx_read_dir(cluster=%zd, entry=%zd)\n", dir->cluster, dir->entry);
 
-    /* Seek to the current cluster. */
-    offset = dir->entry * sizeof(struct fatx_raw_directory_entry);
-    status = fatx_dev_seek_cluster(fs, dir->cluster, offset);
+    /* Look at the raw directory entry in the cached (or mapped) cluster. */
+    status = fatx_dir_cluster_get(fs, dir->cluster, false, &data);
     if (status)
-    {
-        fatx_error(fs, "failed to seek to directory entry\n");
-        return FATX_STATUS_ERROR;
-    }
-
-    /* Read in the raw directory entry. */
-    items = fatx_dev_read(fs, &directory_entry, sizeof(struct fatx_raw_directory_entry), 1);
-    if (items != 1)
     {
         fatx_error(fs, "failed to read directory entry\n");
         return FATX_STATUS_ERROR;
     }
+    directory_entry = (const struct fatx_raw_directory_entry *)data + dir->entry;
 
     /* Was this the last directory entry? */
-    if (directory_entry.filename_len == FATX_END_OF_DIR_MARKER || directory_entry.filename_len == FATX_END_OF_DIR_MARKER2)
+    if (directory_entry->filename_len == FATX_END_OF_DIR_MARKER || directory_entry->filename_len == FATX_END_OF_DIR_MARKER2)
     {
         /* End of directory. */
         fatx_debug(fs, "reached the end of the directory\n");
@@ -213,28 +348,29 @@ int fatx_read_dir(struct fatx_fs *fs, struct fatx_dir *dir, struct fatx_dirent *
     }
 
     /* Was this file deleted? */
-    if (directory_entry.filename_len == FATX_DELETED_FILE_MARKER)
+    if (directory_entry->filename_len == FATX_DELETED_FILE_MARKER)
     {
         /* This directory entry is no longer in use. */
         fatx_debug(fs, "dirent %zd of cluster %zd is a deleted file\n", dir->entry, dir->cluster);
         return FATX_STATUS_FILE_DELETED;
     }
 
-    fatx_debug(fs, "dirent %zd of cluster %zd data starts at %08x\n", dir->entry, dir->cluster, directory_entry.first_cluster);
+    fatx_debug(fs, "dirent %zd of cluster %zd data starts at %08x\n", dir->entry, dir->cluster, directory_entry->first_cluster);
 
     /* Copy filename. */
-    memcpy(entry->filename, directory_entry.filename, directory_entry.filename_len);
-    entry->filename[directory_entry.filename_len] = '\0';
+    memcpy(entry->filename, directory_entry->filename, directory_entry->filename_len);
+    entry->filename[directory_entry->filename_len] = '\0';
 
     /* Populate attributes. */
     if (attr != NULL)
     {
-        status = fatx_dirent_to_attr(fs, &directory_entry, attr);
+        status = fatx_dirent_to_attr(fs, directory_entry, attr);
         if (status)
         {
             fatx_error(fs, "failed to get directory entry attributes\n");
             return status;
         }
+        fatx_file_attr_read(fs, dir, attr);
     }
 
     *result = entry;
@@ -248,22 +384,15 @@ int fatx_read_dir(struct fatx_fs *fs, struct fatx_dir *dir, struct fatx_dirent *
  * entry should be a pointer to the fatx_dirent of the entry to be written.
  * attr should be a pointer to the entry fatx_attr.
  */
-int fatx_write_dir(struct fatx_fs *fs, struct fatx_dir *dir, struct fatx_dirent *entry, struct fatx_attr *attr)
+static int fatx_write_dir_locked(struct fatx_fs *fs, struct fatx_dir *dir, struct fatx_dirent *entry, struct fatx_attr *attr)
 {
     struct fatx_raw_directory_entry directory_entry;
-    size_t items, offset;
+    uint8_t *data;
     int status;
 
     fatx_debug(fs, "fatx_write_dir(cluster=%zd, entry=%zd)\n", dir->cluster, dir->entry);
 
-    /* Seek to the current cluster. */
-    offset = dir->entry * sizeof(struct fatx_raw_directory_entry);
-    status = fatx_dev_seek_cluster(fs, dir->cluster, offset);
-    if (status)
-    {
-        fatx_error(fs, "failed to seek to directory entry\n");
-        return FATX_STATUS_ERROR;
-    }
+    if (fatx_check_writable(fs)) return FATX_STATUS_ERROR;
 
     /* Construct the raw directory entry */
     size_t filename_len = strlen(entry->filename);
@@ -290,93 +419,95 @@ int fatx_write_dir(struct fatx_fs *fs, struct fatx_dir *dir, struct fatx_dirent
     fatx_debug(fs, "\taccessed_date: \t0x%x\n", directory_entry.accessed_date);
     fatx_debug(fs, "}\n");
 
-    /* Write out the raw directory entry. */
-    items = fatx_dev_write(fs, &directory_entry, sizeof(struct fatx_raw_directory_entry), 1);
-    if (items != 1)
+    /* Write the raw directory entry into the cached cluster. */
+    status = fatx_dir_cluster_get(fs, dir->cluster, true, &data);
+    if (status)
     {
         fatx_error(fs, "failed to write directory entry\n");
         return FATX_STATUS_ERROR;
     }
+    memcpy((struct fatx_raw_directory_entry *)data + dir->entry, &directory_entry, sizeof(struct fatx_raw_directory_entry));
 
+    fatx_file_attr_written(fs, dir, attr);
     return FATX_STATUS_SUCCESS;
 }
 
 /*
  * Allocate a directory entry
  * Sets dir->entry to the new entry
+ *
+ * dir should be positioned at the start of the directory. The directory
+ * index knows of deleted entries and of the end of the directory, so the
+ * directory is only scanned when it is first indexed.
  */
-int fatx_alloc_dir_entry(struct fatx_fs *fs, struct fatx_dir *dir)
+static int fatx_alloc_dir_entry_locked(struct fatx_fs *fs, struct fatx_dir *dir)
 {
-    struct fatx_dirent entry, *result;
-    struct fatx_attr attr;
+    size_t entries_per_cluster = fs->bytes_per_cluster / sizeof(struct fatx_raw_directory_entry);
+    struct fatx_dir end;
+    fatx_fat_entry fat_entry;
+    size_t parent, tail, new_cluster;
+    bool at_end;
     int status;
-    size_t new_cluster, cur_cluster, cur_entry;
 
     fatx_debug(fs, "fatx_alloc_dir_entry()\n");
 
-    /* Scan directory entries for deleted files */
-    dir->entry = 0;
-    while (1)
+    if (fatx_check_writable(fs)) return FATX_STATUS_ERROR;
+
+    parent = dir->cluster;
+    status = fatx_dir_index_get_free(fs, parent, dir, &at_end, &tail);
+    if (status) return status;
+
+    if (!at_end)
     {
-        status = fatx_read_dir(fs, dir, &entry, &attr, &result);
-        if (status == FATX_STATUS_SUCCESS)
-        {
-            fatx_debug(fs, "occupied entry at %d, continuing\n", dir->entry);
-            status = fatx_next_dir_entry(fs, dir);
-            if(status)
-            {
-                fatx_debug(fs, "out of entries to check, expanding directory\n");
-                break;
-            }
-        }
-        else if (status == FATX_STATUS_FILE_DELETED)
-        {
-            fatx_debug(fs, "found deleted file at %d, suitable entry for allocation\n", dir->entry);
-            return FATX_STATUS_SUCCESS;
-        }
-        else if (status == FATX_STATUS_END_OF_DIR)
-        {
-            fatx_debug(fs, "end of dir, expanding directory\n");
-            break;
-        }
-        else
-        {
-            fatx_error(fs, "unable to read directory entry\n");
-            return FATX_STATUS_ERROR;
-        }
+        fatx_debug(fs, "found deleted file at %zd of cluster %zd, suitable entry for allocation\n", dir->entry, dir->cluster);
+        return FATX_STATUS_SUCCESS;
     }
 
     /* If we have more space in the current cluster, then shift the end of file marker */
-    if (dir->entry < fs->bytes_per_cluster/sizeof(struct fatx_raw_directory_entry))
+    if (dir->entry + 1 < entries_per_cluster)
     {
-        dir->entry += 1;
-        status = fatx_mark_end_of_dir(fs, dir);
+        end.cluster = dir->cluster;
+        end.entry   = dir->entry + 1;
+    }
+    else if (dir->cluster != tail)
+    {
+        /* The directory already has another cluster to move on to. */
+        status = fatx_read_fat(fs, dir->cluster, &fat_entry);
         if (status) return status;
 
-        /* Return to the newly freed entry */
-        dir->entry -= 1;
-        return FATX_STATUS_SUCCESS;
+        end.cluster = fat_entry;
+        end.entry   = 0;
     }
+    else
+    {
+        /* If all else fails, then allocate a new cluster */
+        fatx_debug(fs, "end of dir, expanding directory\n");
 
-    /* If all else fails, then allocate a new cluster */
-    status = fatx_alloc_cluster(fs, &new_cluster, true);
-    if (status) return status;
+        status = fatx_alloc_clusters(fs, tail, 1, true, &new_cluster, NULL);
+        if (status) return status;
 
-    status = fatx_attach_cluster(fs, dir->cluster, new_cluster);
-    if (status) return status;
+        tail = new_cluster;
 
-    /* Mark first element in new cluster as end of dir */
-    cur_cluster  = dir->cluster;
-    dir->cluster = new_cluster;
-    cur_entry    = dir->entry;
-    dir->entry   = 0;
+        if (dir->entry < entries_per_cluster)
+        {
+            /* We have one entry left in the old cluster, so use it */
+            end.cluster = new_cluster;
+            end.entry   = 0;
+        }
+        else
+        {
+            /* The old cluster is full, so start on the new one */
+            dir->cluster = new_cluster;
+            dir->entry   = 0;
+            end.cluster  = new_cluster;
+            end.entry    = 1;
+        }
+    }
 
-    status = fatx_mark_end_of_dir(fs, dir);
+    status = fatx_mark_end_of_dir(fs, &end);
     if (status) return status;
 
-    /* We should have one entry in the old cluster, so use it */
-    dir->cluster = cur_cluster;
-    dir->entry   = cur_entry;
+    fatx_dir_index_set_end(fs, parent, &end, tail);
     return FATX_STATUS_SUCCESS;
 }
 
@@ -391,50 +522,180 @@ int fatx_close_dir(struct fatx_fs *fs, struct fatx_dir *dir)
 }
 
 /*
- * Mark a directory entry as the specified marker (file deleted or end of directory).
+ * Open a directory for iteration.
  */
-int fatx_mark_dir_entry(struct fatx_fs *fs, struct fatx_dir *dir, size_t marker)
+static int fatx_dir_iter_open_locked(struct fatx_fs *fs, char const *path, struct fatx_dir_iter *iter)
 {
-    struct fatx_raw_directory_entry raw_dirent;
-    size_t offset, items;
     int status;
 
-    fatx_debug(fs, "fatx_mark_dir_entry(cluster=%zd, entry=%zd)\n", dir->cluster, dir->entry);
+    fatx_debug(fs, "fatx_dir_iter_open(path=\"%s\")\n", path);
 
-    /* Seek to the directory entry. */
-    offset = dir->entry * sizeof(struct fatx_raw_directory_entry);
-    status = fatx_dev_seek_cluster(fs, dir->cluster, offset);
-    if (status)
+    status = fatx_open_dir(fs, path, &iter->dir);
+    if (status) return status;
+
+    return fatx_dir_iter_init(fs, iter->dir.cluster, iter);
+}
+
+/*
+ * Set up an iterator over the directory starting at cluster.
+ */
+int fatx_dir_iter_init(struct fatx_fs *fs, size_t cluster, struct fatx_dir_iter *iter)
+{
+    iter->dir.cluster  = cluster;
+    iter->dir.entry    = 0;
+    iter->data_cluster = 0;
+    iter->data = malloc(fs->bytes_per_cluster);
+    if (!iter->data)
     {
-        fatx_error(fs, "failed to seek to directory entry\n");
-        return status;
+        fatx_error(fs, "failed to allocate memory for directory cluster\n");
+        return FATX_STATUS_ERROR;
     }
 
-    /* Read in the raw directory entry. */
-    items = fatx_dev_read(fs, &raw_dirent, sizeof(struct fatx_raw_directory_entry), 1);
-    if (items != 1)
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Move an iterator to a position previously taken from iter->dir, so that the
+ * entry there (or the first one after it) is returned next.
+ *
+ * Directory entries never move, so a position stays valid for as long as the
+ * directory exists.
+ */
+int fatx_dir_iter_seek(struct fatx_fs *fs, struct fatx_dir_iter *iter, struct fatx_dir const *dir)
+{
+    if (dir->entry > fs->bytes_per_cluster / sizeof(struct fatx_raw_directory_entry))
     {
-        fatx_error(fs, "failed to read directory entry\n");
         return FATX_STATUS_ERROR;
     }
 
-    /* Read advanced the pointer. Seek back. */
-    status = fatx_dev_seek_cluster(fs, dir->cluster, offset);
-    if (status != FATX_STATUS_SUCCESS)
+    iter->dir = *dir;
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Get the next entry of a directory, skipping over deleted files.
+ *
+ * Each cluster of the directory is read once, and its entries are parsed out
+ * of the iterator's copy of it. The FAT is only consulted to move on to the
+ * next cluster.
+ *
+ * Returns FATX_STATUS_SUCCESS with attr filled in, FATX_STATUS_END_OF_DIR
+ * after the last entry, or FATX_STATUS_ERROR.
+ */
+static int fatx_dir_iter_next_locked(struct fatx_fs *fs, struct fatx_dir_iter *iter, struct fatx_attr *attr)
+{
+    size_t entries_per_cluster = fs->bytes_per_cluster / sizeof(struct fatx_raw_directory_entry);
+    const struct fatx_raw_directory_entry *raw;
+    struct fatx_dir location;
+    fatx_fat_entry fat_entry;
+    uint8_t *data;
+    int status;
+
+    while (1)
     {
-        fatx_error(fs, "failed to seek to directory entry\n");
-        return status;
+        if (iter->dir.entry >= entries_per_cluster)
+        {
+            /* Move on to the next cluster of the directory. */
+            status = fatx_read_fat(fs, iter->dir.cluster, &fat_entry);
+            if (status) return FATX_STATUS_ERROR;
+
+            switch (fatx_get_fat_entry_type(fs, fat_entry))
+            {
+            case FATX_CLUSTER_DATA:
+                iter->dir.cluster = fat_entry;
+                iter->dir.entry   = 0;
+                break;
+
+            case FATX_CLUSTER_END:
+                /* A full directory ends with its last cluster. */
+                return FATX_STATUS_END_OF_DIR;
+
+            default:
+                fatx_error(fs, "expected another cluster with additional directory entries\n");
+                return FATX_STATUS_ERROR;
+            }
+        }
+
+        if (iter->data_cluster != iter->dir.cluster)
+        {
+            status = fatx_dir_cluster_get(fs, iter->dir.cluster, false, &data);
+            if (status)
+            {
+                fatx_error(fs, "failed to read directory cluster %zd\n", iter->dir.cluster);
+                return FATX_STATUS_ERROR;
+            }
+
+            memcpy(iter->data, data, fs->bytes_per_cluster);
+            iter->data_cluster = iter->dir.cluster;
+        }
+
+        location = iter->dir;
+        raw = (const struct fatx_raw_directory_entry *)iter->data + iter->dir.entry;
+
+        if (raw->filename_len == FATX_END_OF_DIR_MARKER || raw->filename_len == FATX_END_OF_DIR_MARKER2)
+        {
+            return FATX_STATUS_END_OF_DIR;
+        }
+
+        iter->dir.entry++;
+
+        if (raw->filename_len == FATX_DELETED_FILE_MARKER)
+        {
+            continue;
+        }
+
+        if (raw->filename_len > FATX_MAX_FILENAME_LEN)
+        {
+            fatx_error(fs, "dirent %zd of cluster %zd has an invalid filename length\n", location.entry, location.cluster);
+            return FATX_STATUS_ERROR;
+        }
+
+        status = fatx_dirent_to_attr(fs, raw, attr);
+        if (status) return status;
+
+        fatx_file_attr_read(fs, &location, attr);
+        return FATX_STATUS_SUCCESS;
     }
+}
 
-    /* Finally, mark the file as deleted. */
-    raw_dirent.filename_len = marker;
-    items = fatx_dev_write(fs, &raw_dirent, sizeof(struct fatx_raw_directory_entry), 1);
-    if (items != 1)
+/*
+ * Close a directory iterator.
+ */
+int fatx_dir_iter_close(struct fatx_fs *fs, struct fatx_dir_iter *iter)
+{
+    fatx_debug(fs, "fatx_dir_iter_close()\n");
+
+    free(iter->data);
+    iter->data = NULL;
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Mark a directory entry as the specified marker (file deleted or end of directory).
+ */
+int fatx_mark_dir_entry(struct fatx_fs *fs, struct fatx_dir *dir, size_t marker)
+{
+    struct fatx_raw_directory_entry *raw_dirent;
+    uint8_t *data;
+    int status;
+
+    fatx_debug(fs, "fatx_mark_dir_entry(cluster=%zd, entry=%zd)\n", dir->cluster, dir->entry);
+
+    if (fatx_check_writable(fs)) return FATX_STATUS_ERROR;
+
+    /* Get the cached cluster holding the raw directory entry. */
+    status = fatx_dir_cluster_get(fs, dir->cluster, true, &data);
+    if (status)
     {
-        fatx_error(fs, "failed to write directory entry\n");
+        fatx_error(fs, "failed to read directory entry\n");
         return FATX_STATUS_ERROR;
     }
 
+    /* Finally, mark the file as deleted. */
+    raw_dirent = (struct fatx_raw_directory_entry *)data + dir->entry;
+    raw_dirent->filename_len = marker;
+
+    fatx_file_entry_removed(fs, dir);
     return FATX_STATUS_SUCCESS;
 }
 
@@ -459,15 +720,17 @@ int fatx_mark_end_of_dir(struct fatx_fs *fs, struct fatx_dir *dir)
  * Creates a directory entry (node)
  * Supply path, directory, and attributes
  */
-int fatx_create_dirent(struct fatx_fs *fs, char const *path, struct fatx_dir *dir, uint8_t attributes)
+static int fatx_create_dirent_locked(struct fatx_fs *fs, char const *path, struct fatx_dir *dir, uint8_t attributes)
 {
     struct fatx_dirent entry;
     struct fatx_attr attr;
     char *path_basename;
     int status;
-    size_t cluster;
+    size_t cluster, parent;
     time_t curtime;
 
+    if (fatx_check_writable(fs)) return FATX_STATUS_ERROR;
+
     /* Check basename is not too long */
     path_basename = fatx_basename(path);
     if (strlen(path_basename) >= FATX_MAX_FILENAME_LEN)
@@ -482,11 +745,18 @@ int fatx_create_dirent(struct fatx_fs *fs, char const *path, struct fatx_dir *di
     strcpy(attr.filename, path_basename);
     free(path_basename);
 
-    /* Allocate space for the file */
-    status = fatx_alloc_cluster(fs, &cluster, true);
-    if (status) return status;
+    /* Allocate space for a directory. Files get their first cluster when
+     * they are first written to.
+     */
+    cluster = 0;
+    if (attributes & FATX_ATTR_DIRECTORY)
+    {
+        status = fatx_alloc_cluster(fs, &cluster, true);
+        if (status) return status;
+    }
 
     /* Allocate directory entry for file */
+    parent = dir->cluster;
     status = fatx_alloc_dir_entry(fs, dir);
     if (status)
     {
@@ -510,6 +780,8 @@ int fatx_create_dirent(struct fatx_fs *fs, char const *path, struct fatx_dir *di
         return status;
     }
 
+    fatx_dir_index_add(fs, parent, attr.filename, dir);
+
     fatx_debug(fs, "created file successfully!\n");
     return FATX_STATUS_SUCCESS;
 }
@@ -517,67 +789,56 @@ int fatx_create_dirent(struct fatx_fs *fs, char const *path, struct fatx_dir *di
 /*
  * Remove a directory entry.
  */
-int fatx_unlink(struct fatx_fs *fs, char const *path)
+static int fatx_unlink_locked(struct fatx_fs *fs, char const *path)
 {
-    struct fatx_dirent entry, *result;
+    struct fatx_dirent entry;
     struct fatx_attr attr;
     struct fatx_dir dir;
+    size_t parent;
     char *path_dirname, *path_basename;
     int status;
 
     fatx_debug(fs, "fatx_unlink(path=\"%s\")\n", path);
 
+    if (fatx_check_writable(fs)) return FATX_STATUS_ERROR;
+
     /* Open the directory that contains this file. */
     path_dirname = fatx_dirname(path);
     status = fatx_open_dir(fs, path_dirname, &dir);
     free(path_dirname);
     if (status != FATX_STATUS_SUCCESS) return status;
 
+    parent = dir.cluster;
     path_basename = fatx_basename(path);
 
-    while (1)
-    {
-        status = fatx_read_dir(fs, &dir, &entry, &attr, &result);
-
-        if (status == FATX_STATUS_SUCCESS)
-        {
-            /* Is this the file we're looking for? */
-            if (strcmp(attr.filename, path_basename) == 0) break;
-        }
-        else if (status == FATX_STATUS_END_OF_DIR)
-        {
-            fatx_debug(fs, "reached end of dir\n");
-            status = FATX_STATUS_FILE_NOT_FOUND;
-            break;
-        }
-        else if (status == FATX_STATUS_FILE_DELETED)
-        {
-            /* Skip over the deleted file. */
-            fatx_debug(fs, "skipping over deleted file\n");
-        }
-        else
-        {
-            /* Error */
-            fatx_debug(fs, "error!\n");
-            break;
-        }
-
-        /* Seek to the directory entry. */
-        status = fatx_next_dir_entry(fs, &dir);
-        if (status != FATX_STATUS_SUCCESS) break;
-    }
-
+    status = fatx_get_attr_dir(fs, path_basename, &dir, &entry, &attr);
     if (status != FATX_STATUS_SUCCESS) goto cleanup;
 
     fatx_debug(fs, "found file!\n");
 
-    /* Traverse the cluster chain, marking each cluster as available. */
-    status = fatx_free_cluster_chain(fs, attr.first_cluster);
-    if (status != FATX_STATUS_SUCCESS) goto cleanup;
+    /*
+     * Traverse the cluster chain, marking each cluster as available, unless
+     * the file is open. Its handles then free the chain when they are done.
+     */
+    if (!fatx_file_is_open(fs, &dir))
+    {
+        status = fatx_free_cluster_chain(fs, attr.first_cluster);
+        if (status != FATX_STATUS_SUCCESS) goto cleanup;
+    }
 
     status = fatx_mark_dir_entry_deleted(fs, &dir);
     if (status != FATX_STATUS_SUCCESS) goto cleanup;
 
+    fatx_dir_index_remove(fs, parent, attr.filename, &dir);
+    fatx_dir_index_add_free(fs, parent, &dir);
+    fatx_dentry_forget_name(fs, parent, path_basename);
+    fatx_dentry_forget_path(fs, path, NULL);
+    if (attr.attributes & FATX_ATTR_DIRECTORY)
+    {
+        fatx_dir_index_invalidate(fs, attr.first_cluster);
+        fatx_dentry_forget_parent(fs, attr.first_cluster);
+    }
+
 cleanup:
     free(path_basename);
     fatx_close_dir(fs, &dir);
@@ -587,7 +848,7 @@ cleanup:
 /*
  * Create a directory.
  */
-int fatx_mkdir(struct fatx_fs *fs, char const *path)
+static int fatx_mkdir_locked(struct fatx_fs *fs, char const *path)
 {
     struct fatx_attr attr;
     struct fatx_dir dir;
@@ -596,6 +857,8 @@ int fatx_mkdir(struct fatx_fs *fs, char const *path)
 
     fatx_debug(fs, "fatx_mkdir(path=\"%s\")\n", path);
 
+    if (fatx_check_writable(fs)) return FATX_STATUS_ERROR;
+
     /* Check for existence */
     status = fatx_get_attr(fs, path, &attr);
     if (!status)
@@ -629,7 +892,7 @@ int fatx_mkdir(struct fatx_fs *fs, char const *path)
 /*
  * Remove a directory
  */
-int fatx_rmdir(struct fatx_fs *fs, char const *path)
+static int fatx_rmdir_locked(struct fatx_fs *fs, char const *path)
 {
     struct fatx_dir dir;
     struct fatx_dirent dirent, *result;
@@ -638,6 +901,8 @@ int fatx_rmdir(struct fatx_fs *fs, char const *path)
 
     fatx_debug(fs, "fatx_rmdir(path=\"%s\")\n", path);
 
+    if (fatx_check_writable(fs)) return FATX_STATUS_ERROR;
+
     /* First, check that the directory is empty */
     status = fatx_open_dir(fs, path, &dir);
     if (status) return status;
@@ -680,3 +945,127 @@ int fatx_rmdir(struct fatx_fs *fs, char const *path)
     /* Remove the entry from the parent dir */
     return fatx_unlink(fs, path);
 }
+
+/*
+ * Entry points, which hold the filesystem lock around the functions above.
+ */
+int fatx_open_dir(struct fatx_fs *fs, char const *path, struct fatx_dir *dir)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_open_dir_locked(fs, path, dir);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_next_dir_entry(struct fatx_fs *fs, struct fatx_dir *dir)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_next_dir_entry_locked(fs, dir);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_read_dir(struct fatx_fs *fs, struct fatx_dir *dir, struct fatx_dirent *entry, struct fatx_attr *attr, struct fatx_dirent **result)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_read_dir_locked(fs, dir, entry, attr, result);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_write_dir(struct fatx_fs *fs, struct fatx_dir *dir, struct fatx_dirent *entry, struct fatx_attr *attr)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_write_dir_locked(fs, dir, entry, attr);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_alloc_dir_entry(struct fatx_fs *fs, struct fatx_dir *dir)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_alloc_dir_entry_locked(fs, dir);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_dir_iter_open(struct fatx_fs *fs, char const *path, struct fatx_dir_iter *iter)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_dir_iter_open_locked(fs, path, iter);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_dir_iter_next(struct fatx_fs *fs, struct fatx_dir_iter *iter, struct fatx_attr *attr)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_dir_iter_next_locked(fs, iter, attr);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_create_dirent(struct fatx_fs *fs, char const *path, struct fatx_dir *dir, uint8_t attributes)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_create_dirent_locked(fs, path, dir, attributes);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_unlink(struct fatx_fs *fs, char const *path)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_unlink_locked(fs, path);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_mkdir(struct fatx_fs *fs, char const *path)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_mkdir_locked(fs, path);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_rmdir(struct fatx_fs *fs, char const *path)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_rmdir_locked(fs, path);
+    fatx_unlock(fs);
+
+    return status;
+}
@@ -0,0 +1,571 @@
+/*
+ * FATX Filesystem Library
+ *
+ * Copyright (C) 2015  Matt Borgerson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A cache of directory name indexes.
+ *
+ * The index of a directory is a hash table of the (cluster, entry) locations
+ * of all of its entries, keyed by the hash of their names, so that a name can
+ * be found (or found to be missing) without scanning the directory. Indexes
+ * are keyed by the first cluster of the directory, built with a single pass
+ * over the directory the first time a name is looked up in it, and kept up to
+ * date as entries are created, removed and renamed.
+ *
+ * Only name hashes are kept, so each candidate entry is read back to compare
+ * its name. Deleted slots of the hash table are left as tombstones until the
+ * table is rebuilt.
+ *
+ * The index also tracks where new entries can go: the deleted entries of the
+ * directory, the position of its end of directory marker and its last
+ * cluster, so that creating an entry doesn't have to scan the directory.
+ */
+
+#include "fatx_internal.h"
+
+/* Slot markers, in place of a cluster number. */
+#define FATX_DIR_INDEX_EMPTY     0
+#define FATX_DIR_INDEX_TOMBSTONE UINT32_MAX
+
+/* Smallest hash table built for a directory. */
+#define FATX_DIR_INDEX_MIN_SLOTS 64
+
+/*
+ * Allocate the slots of the directory index cache.
+ */
+int fatx_dir_index_init(struct fatx_fs *fs)
+{
+    struct fatx_dir_index_cache *cache = &fs->dir_index_cache;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->indexes = calloc(FATX_DIR_INDEX_CACHE_SIZE, sizeof(struct fatx_dir_index));
+    if (!cache->indexes)
+    {
+        fatx_error(fs, "failed to allocate memory for directory index cache\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    cache->num_indexes = FATX_DIR_INDEX_CACHE_SIZE;
+    return FATX_STATUS_SUCCESS;
+}
+
+static void fatx_dir_index_clear(struct fatx_dir_index *index)
+{
+    free(index->slots);
+    free(index->free);
+    memset(index, 0, sizeof(*index));
+}
+
+/*
+ * Drop every directory index.
+ */
+void fatx_dir_index_reset(struct fatx_fs *fs)
+{
+    struct fatx_dir_index_cache *cache = &fs->dir_index_cache;
+    size_t i;
+
+    for (i = 0; i < cache->num_indexes; i++)
+    {
+        fatx_dir_index_clear(&cache->indexes[i]);
+    }
+}
+
+/*
+ * Release the memory held by the directory index cache.
+ */
+void fatx_dir_index_free(struct fatx_fs *fs)
+{
+    fatx_dir_index_reset(fs);
+    free(fs->dir_index_cache.indexes);
+    memset(&fs->dir_index_cache, 0, sizeof(fs->dir_index_cache));
+}
+
+static uint32_t fatx_dir_index_hash(struct fatx_fs *fs, char const *name)
+{
+    return (uint32_t)fatx_name_hash(fs, 0, name);
+}
+
+/*
+ * Put a location into a hash table which is known to have a free slot.
+ */
+static void fatx_dir_index_put(struct fatx_dir_index_slot *slots, size_t num_slots, uint32_t hash, uint32_t cluster, uint32_t entry)
+{
+    size_t i = hash & (num_slots - 1);
+
+    while (slots[i].cluster != FATX_DIR_INDEX_EMPTY && slots[i].cluster != FATX_DIR_INDEX_TOMBSTONE)
+    {
+        i = (i + 1) & (num_slots - 1);
+    }
+
+    slots[i].hash    = hash;
+    slots[i].cluster = cluster;
+    slots[i].entry   = entry;
+}
+
+/*
+ * Make room for one more location, growing the hash table (and dropping its
+ * tombstones) when it is three quarters full.
+ */
+static int fatx_dir_index_reserve(struct fatx_dir_index *index)
+{
+    struct fatx_dir_index_slot *slots;
+    size_t num_slots, num_live, i;
+
+    if ((index->num_used + 1) * 4 < index->num_slots * 3)
+    {
+        return FATX_STATUS_SUCCESS;
+    }
+
+    num_live = 0;
+    for (i = 0; i < index->num_slots; i++)
+    {
+        if (index->slots[i].cluster != FATX_DIR_INDEX_EMPTY && index->slots[i].cluster != FATX_DIR_INDEX_TOMBSTONE)
+        {
+            num_live++;
+        }
+    }
+
+    num_slots = FATX_DIR_INDEX_MIN_SLOTS;
+    while ((num_live + 1) * 2 > num_slots)
+    {
+        num_slots *= 2;
+    }
+
+    slots = calloc(num_slots, sizeof(struct fatx_dir_index_slot));
+    if (!slots)
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    for (i = 0; i < index->num_slots; i++)
+    {
+        if (index->slots[i].cluster != FATX_DIR_INDEX_EMPTY && index->slots[i].cluster != FATX_DIR_INDEX_TOMBSTONE)
+        {
+            fatx_dir_index_put(slots, num_slots, index->slots[i].hash, index->slots[i].cluster, index->slots[i].entry);
+        }
+    }
+
+    free(index->slots);
+    index->slots     = slots;
+    index->num_slots = num_slots;
+    index->num_used  = num_live;
+
+    return FATX_STATUS_SUCCESS;
+}
+
+static int fatx_dir_index_insert(struct fatx_fs *fs, struct fatx_dir_index *index, char const *name, struct fatx_dir const *dir)
+{
+    if (fatx_dir_index_reserve(index))
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    fatx_dir_index_put(index->slots, index->num_slots, fatx_dir_index_hash(fs, name), dir->cluster, dir->entry);
+    index->num_used++;
+
+    return FATX_STATUS_SUCCESS;
+}
+
+static int fatx_dir_index_push_free(struct fatx_dir_index *index, struct fatx_dir const *dir)
+{
+    struct fatx_dir *slots;
+    size_t max_free;
+
+    if (index->num_free == index->max_free)
+    {
+        max_free = index->max_free ? index->max_free * 2 : 16;
+        slots = realloc(index->free, max_free * sizeof(struct fatx_dir));
+        if (!slots)
+        {
+            return FATX_STATUS_ERROR;
+        }
+
+        index->free     = slots;
+        index->max_free = max_free;
+    }
+
+    index->free[index->num_free++] = *dir;
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Record the deleted entries found between the position just after the
+ * previous entry (prev) and the entry at next.
+ */
+static int fatx_dir_index_find_deleted(struct fatx_fs *fs, struct fatx_dir_index *index, struct fatx_dir *prev, struct fatx_dir const *next)
+{
+    size_t entries_per_cluster = fs->bytes_per_cluster / sizeof(struct fatx_raw_directory_entry);
+    fatx_fat_entry fat_entry;
+    int status;
+
+    while (prev->cluster != next->cluster || prev->entry != next->entry)
+    {
+        if (prev->entry >= entries_per_cluster)
+        {
+            status = fatx_read_fat(fs, prev->cluster, &fat_entry);
+            if (status) return status;
+
+            if (fatx_get_fat_entry_type(fs, fat_entry) != FATX_CLUSTER_DATA)
+            {
+                /* A full last cluster, so there is nothing in between. */
+                break;
+            }
+
+            prev->cluster = fat_entry;
+            prev->entry   = 0;
+            continue;
+        }
+
+        status = fatx_dir_index_push_free(index, prev);
+        if (status) return status;
+
+        prev->entry++;
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Index every entry of the directory starting at first_cluster.
+ */
+static int fatx_dir_index_build(struct fatx_fs *fs, struct fatx_dir_index *index, size_t first_cluster)
+{
+    struct fatx_dir_iter iter;
+    struct fatx_attr attr;
+    struct fatx_dir location, prev, tmp;
+    fatx_fat_entry fat_entry;
+    size_t i;
+    int status;
+
+    fatx_debug(fs, "fatx_dir_index_build(first_cluster=%zd)\n", first_cluster);
+
+    index->first_cluster = first_cluster;
+
+    status = fatx_dir_iter_init(fs, first_cluster, &iter);
+    if (status) return status;
+
+    prev = iter.dir;
+
+    while (1)
+    {
+        status = fatx_dir_iter_next(fs, &iter, &attr);
+        if (status == FATX_STATUS_END_OF_DIR)
+        {
+            break;
+        }
+        else if (status)
+        {
+            goto cleanup;
+        }
+
+        /* The iterator has moved past the entry it returned. */
+        location.cluster = iter.dir.cluster;
+        location.entry   = iter.dir.entry - 1;
+
+        status = fatx_dir_index_find_deleted(fs, index, &prev, &location);
+        if (status) goto cleanup;
+        prev = iter.dir;
+
+        status = fatx_dir_index_insert(fs, index, attr.filename, &location);
+        if (status) goto cleanup;
+    }
+
+    /* The iterator stops at the end of directory marker, or just past the
+     * last entry of a full last cluster.
+     */
+    status = fatx_dir_index_find_deleted(fs, index, &prev, &iter.dir);
+    if (status) goto cleanup;
+
+    index->end_cluster  = iter.dir.cluster;
+    index->end_entry    = iter.dir.entry;
+    index->tail_cluster = iter.dir.cluster;
+
+    /* Clusters past the end of directory marker are still part of the chain. */
+    while (1)
+    {
+        status = fatx_read_fat(fs, index->tail_cluster, &fat_entry);
+        if (status) goto cleanup;
+
+        if (fatx_get_fat_entry_type(fs, fat_entry) == FATX_CLUSTER_END)
+        {
+            break;
+        }
+        else if (fatx_get_fat_entry_type(fs, fat_entry) != FATX_CLUSTER_DATA)
+        {
+            fatx_error(fs, "expected another cluster of directory %zd\n", first_cluster);
+            status = FATX_STATUS_ERROR;
+            goto cleanup;
+        }
+
+        index->tail_cluster = fat_entry;
+    }
+
+    /* Reuse deleted entries front to back. */
+    for (i = 0; i < index->num_free / 2; i++)
+    {
+        tmp = index->free[i];
+        index->free[i] = index->free[index->num_free - 1 - i];
+        index->free[index->num_free - 1 - i] = tmp;
+    }
+
+cleanup:
+    fatx_dir_iter_close(fs, &iter);
+    return status;
+}
+
+static struct fatx_dir_index *fatx_dir_index_find(struct fatx_fs *fs, size_t first_cluster)
+{
+    struct fatx_dir_index_cache *cache = &fs->dir_index_cache;
+    size_t i;
+
+    for (i = 0; i < cache->num_indexes; i++)
+    {
+        if (cache->indexes[i].first_cluster == first_cluster)
+        {
+            cache->indexes[i].last_used = ++cache->clock;
+            return &cache->indexes[i];
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Get the index of the directory starting at first_cluster, building it if
+ * it is not cached yet.
+ */
+static struct fatx_dir_index *fatx_dir_index_get(struct fatx_fs *fs, size_t first_cluster)
+{
+    struct fatx_dir_index_cache *cache = &fs->dir_index_cache;
+    struct fatx_dir_index *index, *victim;
+    size_t i;
+
+    index = fatx_dir_index_find(fs, first_cluster);
+    if (index || !cache->num_indexes)
+    {
+        return index;
+    }
+
+    /* Replace the least recently used index. */
+    victim = &cache->indexes[0];
+    for (i = 1; i < cache->num_indexes; i++)
+    {
+        if (cache->indexes[i].last_used < victim->last_used)
+        {
+            victim = &cache->indexes[i];
+        }
+    }
+
+    fatx_dir_index_clear(victim);
+
+    if (fatx_dir_index_build(fs, victim, first_cluster))
+    {
+        fatx_dir_index_clear(victim);
+        return NULL;
+    }
+
+    victim->last_used = ++cache->clock;
+    return victim;
+}
+
+/*
+ * Look up a name in the directory starting at first_cluster.
+ *
+ * Returns FATX_STATUS_SUCCESS with dir positioned at the entry and dirent
+ * and attr read from it, or FATX_STATUS_FILE_NOT_FOUND if the directory has
+ * no such entry. FATX_STATUS_ERROR means that the directory could not be
+ * indexed, and the caller should scan it instead.
+ */
+int fatx_dir_index_lookup(struct fatx_fs *fs, size_t first_cluster, char const *name, struct fatx_dir *dir, struct fatx_dirent *dirent, struct fatx_attr *attr)
+{
+    struct fatx_dir_index *index;
+    struct fatx_dirent *result;
+    struct fatx_dir location;
+    uint32_t hash;
+    size_t i;
+
+    index = fatx_dir_index_get(fs, first_cluster);
+    if (!index)
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    if (!index->num_slots)
+    {
+        /* Empty directory. */
+        return FATX_STATUS_FILE_NOT_FOUND;
+    }
+
+    hash = fatx_dir_index_hash(fs, name);
+
+    for (i = hash & (index->num_slots - 1); index->slots[i].cluster != FATX_DIR_INDEX_EMPTY; i = (i + 1) & (index->num_slots - 1))
+    {
+        if (index->slots[i].cluster == FATX_DIR_INDEX_TOMBSTONE || index->slots[i].hash != hash)
+        {
+            continue;
+        }
+
+        location.cluster = index->slots[i].cluster;
+        location.entry   = index->slots[i].entry;
+
+        if (fatx_read_dir(fs, &location, dirent, attr, &result) == FATX_STATUS_SUCCESS &&
+            fatx_name_match(fs, dirent->filename, name, SIZE_MAX))
+        {
+            *dir = location;
+            return FATX_STATUS_SUCCESS;
+        }
+    }
+
+    return FATX_STATUS_FILE_NOT_FOUND;
+}
+
+/*
+ * Record that an entry was created in the directory starting at
+ * first_cluster, at the location of dir.
+ */
+void fatx_dir_index_add(struct fatx_fs *fs, size_t first_cluster, char const *name, struct fatx_dir const *dir)
+{
+    struct fatx_dir_index *index;
+
+    index = fatx_dir_index_find(fs, first_cluster);
+    if (index && fatx_dir_index_insert(fs, index, name, dir))
+    {
+        /* The index can no longer be trusted. */
+        fatx_dir_index_clear(index);
+    }
+}
+
+/*
+ * Record that the entry at the location of dir, in the directory starting at
+ * first_cluster, no longer goes by name.
+ */
+void fatx_dir_index_remove(struct fatx_fs *fs, size_t first_cluster, char const *name, struct fatx_dir const *dir)
+{
+    struct fatx_dir_index *index;
+    uint32_t hash;
+    size_t i;
+
+    index = fatx_dir_index_find(fs, first_cluster);
+    if (!index || !index->num_slots)
+    {
+        return;
+    }
+
+    hash = fatx_dir_index_hash(fs, name);
+
+    for (i = hash & (index->num_slots - 1); index->slots[i].cluster != FATX_DIR_INDEX_EMPTY; i = (i + 1) & (index->num_slots - 1))
+    {
+        if (index->slots[i].hash == hash &&
+            index->slots[i].cluster == dir->cluster &&
+            index->slots[i].entry == dir->entry)
+        {
+            index->slots[i].cluster = FATX_DIR_INDEX_TOMBSTONE;
+            return;
+        }
+    }
+}
+
+/*
+ * Forget the index of the directory starting at first_cluster, when the
+ * directory is removed.
+ */
+void fatx_dir_index_invalidate(struct fatx_fs *fs, size_t first_cluster)
+{
+    struct fatx_dir_index_cache *cache = &fs->dir_index_cache;
+    size_t i;
+
+    for (i = 0; i < cache->num_indexes; i++)
+    {
+        if (cache->indexes[i].first_cluster == first_cluster)
+        {
+            fatx_dir_index_clear(&cache->indexes[i]);
+            return;
+        }
+    }
+}
+
+/*
+ * Find room for a new entry in the directory starting at first_cluster.
+ *
+ * A deleted entry is handed out first, with at_end set to false. Otherwise
+ * dir is the position of the end of directory marker (which may be one past
+ * the last entry of a full last cluster), at_end is set, and tail_cluster is
+ * the last cluster of the directory. The caller moves the end along and
+ * reports the new one with fatx_dir_index_set_end().
+ */
+int fatx_dir_index_get_free(struct fatx_fs *fs, size_t first_cluster, struct fatx_dir *dir, bool *at_end, size_t *tail_cluster)
+{
+    struct fatx_dir_index *index;
+    struct fatx_dirent dirent, *result;
+    struct fatx_attr attr;
+
+    index = fatx_dir_index_get(fs, first_cluster);
+    if (!index)
+    {
+        fatx_error(fs, "failed to index directory %zd\n", first_cluster);
+        return FATX_STATUS_ERROR;
+    }
+
+    while (index->num_free)
+    {
+        *dir = index->free[--index->num_free];
+
+        if (fatx_read_dir(fs, dir, &dirent, &attr, &result) == FATX_STATUS_FILE_DELETED)
+        {
+            *at_end = false;
+            return FATX_STATUS_SUCCESS;
+        }
+    }
+
+    dir->cluster  = index->end_cluster;
+    dir->entry    = index->end_entry;
+    *at_end       = true;
+    *tail_cluster = index->tail_cluster;
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Record that the entry at the location of dir, in the directory starting at
+ * first_cluster, was deleted and can be reused.
+ */
+void fatx_dir_index_add_free(struct fatx_fs *fs, size_t first_cluster, struct fatx_dir const *dir)
+{
+    struct fatx_dir_index *index;
+
+    index = fatx_dir_index_find(fs, first_cluster);
+    if (index && fatx_dir_index_push_free(index, dir))
+    {
+        fatx_dir_index_clear(index);
+    }
+}
+
+/*
+ * Record the new end of the directory starting at first_cluster.
+ */
+void fatx_dir_index_set_end(struct fatx_fs *fs, size_t first_cluster, struct fatx_dir const *end, size_t tail_cluster)
+{
+    struct fatx_dir_index *index;
+
+    index = fatx_dir_index_find(fs, first_cluster);
+    if (index)
+    {
+        index->end_cluster  = end->cluster;
+        index->end_entry    = end->entry;
+        index->tail_cluster = tail_cluster;
+    }
+}
@@ -19,6 +19,10 @@
 
 #include "fatx_internal.h"
 
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
 struct fatx_partition_map_entry const fatx_partition_map[] = {
 
     /* Retail partitions */
@@ -111,13 +115,132 @@ int fatx_disk_size_remaining(char const *path, uint64_t offset, uint64_t *remain
     return FATX_STATUS_SUCCESS;
 }
 
+/*
+ * A partition being formatted. Each job formats through its own filesystem
+ * handle, so that the partitions of a disk can be formatted concurrently.
+ */
+struct fatx_format_job {
+    struct fatx_fs                   *fs;
+    struct fatx_format_options const *options;
+    char const                       *path;
+    uint64_t                          offset;
+    uint64_t                          size;
+    size_t                            sector_size;
+    size_t                            sectors_per_cluster;
+    size_t                            partition;
+    uint64_t                          total;
+    int                               status;
+};
+
+#ifndef _WIN32
+static pthread_mutex_t fatx_format_progress_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+/*
+ * Report how many bytes of a partition have been formatted.
+ */
+static void fatx_format_report(struct fatx_format_job *job, uint64_t done)
+{
+    if (!job->options || !job->options->progress)
+    {
+        return;
+    }
+
+#ifndef _WIN32
+    pthread_mutex_lock(&fatx_format_progress_lock);
+#endif
+    job->options->progress(job->options->progress_ctx, job->partition, done, job->total);
+#ifndef _WIN32
+    pthread_mutex_unlock(&fatx_format_progress_lock);
+#endif
+}
+
+static void fatx_format_fat_progress(void *ctx, uint64_t done)
+{
+    fatx_format_report(ctx, FATX_SUPERBLOCK_SIZE + done);
+}
+
+/*
+ * Format the partition described by a job.
+ */
+static int fatx_format_partition(struct fatx_format_job *job)
+{
+    struct fatx_fs *fs = job->fs;
+    struct fatx_open_options options;
+    int retval;
+
+    memset(&options, 0, sizeof(options));
+    options.flags = FATX_OPEN_FORMAT;
+
+    if (fatx_open_device_ex(fs, job->path, job->offset, job->size, job->sector_size, job->sectors_per_cluster, &options))
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    job->total = FATX_SUPERBLOCK_SIZE + fs->fat_size + fs->bytes_per_cluster;
+    fatx_format_report(job, 0);
+
+    if (fatx_write_superblock(fs))
+    {
+        retval = FATX_STATUS_ERROR;
+        goto cleanup;
+    }
+
+    fatx_format_report(job, FATX_SUPERBLOCK_SIZE);
+
+    if (fatx_init_fat(fs, fatx_format_fat_progress, job))
+    {
+        retval = FATX_STATUS_ERROR;
+        goto cleanup;
+    }
+
+    if (fatx_init_root(fs))
+    {
+        retval = FATX_STATUS_ERROR;
+        goto cleanup;
+    }
+
+    fatx_format_report(job, job->total);
+    retval = FATX_STATUS_SUCCESS;
+
+cleanup:
+    fatx_close_device(fs);
+    return retval;
+}
+
+static void *fatx_format_thread(void *arg)
+{
+    struct fatx_format_job *job = arg;
+
+    job->status = fatx_format_partition(job);
+    return NULL;
+}
+
 /*
  * Reformat a disk as FATX.
  */
 int fatx_disk_format(struct fatx_fs *fs, char const *path, size_t sector_size, enum fatx_format format_type, size_t sectors_per_cluster)
+{
+    return fatx_disk_format_ex(fs, path, sector_size, format_type, sectors_per_cluster, NULL);
+}
+
+/*
+ * Reformat a disk as FATX, with additional options.
+ *
+ * options may be NULL, in which case the defaults are used.
+ */
+int fatx_disk_format_ex(struct fatx_fs *fs, char const *path, size_t sector_size, enum fatx_format format_type, size_t sectors_per_cluster, struct fatx_format_options const *options)
 {
     struct fatx_partition_map_entry const *pi;
-    uint64_t f_offset, f_size;
+    struct fatx_format_job jobs[ARRAY_SIZE(fatx_partition_map)];
+    struct fatx_fs *filesystems;
+    size_t i, num_jobs;
+    bool sequential;
+    int retval;
+#ifndef _WIN32
+    pthread_t threads[ARRAY_SIZE(fatx_partition_map)];
+    bool started[ARRAY_SIZE(fatx_partition_map)];
+#endif
 
     if (format_type == FATX_FORMAT_INVALID)
     {
@@ -130,12 +253,36 @@ int fatx_disk_format(struct fatx_fs *fs, char const *path, size_t sector_size, e
         return FATX_STATUS_ERROR;
     }
 
-    for (int i = 0; i < FATX_RETAIL_PARTITION_COUNT; i++)
+    num_jobs = FATX_RETAIL_PARTITION_COUNT;
+    if (format_type == FATX_FORMAT_F_TAKES_ALL)
+    {
+        num_jobs++;
+    }
+
+    filesystems = calloc(num_jobs, sizeof(struct fatx_fs));
+    if (!filesystems)
+    {
+        fatx_error(fs, "failed to allocate memory for format\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    for (i = 0; i < num_jobs; i++)
     {
         pi = &fatx_partition_map[i];
 
         fatx_info(fs, "-------------------------------------------\n");
-        fatx_info(fs, "Formatting partition %d (%c drive) ...\n", i, pi->letter);
+        fatx_info(fs, "Formatting partition %zu (%c drive) ...\n", i, pi->letter);
+        fatx_log_init(&filesystems[i], fs->log_handle, fs->log_level);
+
+        jobs[i].fs                  = &filesystems[i];
+        jobs[i].options             = options;
+        jobs[i].path                = path;
+        jobs[i].offset              = pi->offset;
+        jobs[i].size                = pi->size;
+        jobs[i].sector_size         = sector_size;
+        jobs[i].partition           = i;
+        jobs[i].total               = 0;
+        jobs[i].status              = FATX_STATUS_ERROR;
 
         /*
          * Xapi initialization validates that the cluster size of retail
@@ -145,32 +292,58 @@ int fatx_disk_format(struct fatx_fs *fs, char const *path, size_t sector_size, e
          * configure the cluster size on retail partitions or many games
          * will not load. Adjusting sector sizes, however, is okay.
          */
-        if (fatx_disk_format_partition(fs, path, pi->offset, pi->size, sector_size, FATX_RETAIL_CLUSTER_SIZE / sector_size))
+        if (i < FATX_RETAIL_PARTITION_COUNT)
         {
-            fatx_error(fs, " - failed to format partition %d\n", i);
-            return FATX_STATUS_ERROR;
+            jobs[i].sectors_per_cluster = FATX_RETAIL_CLUSTER_SIZE / sector_size;
+        }
+        else
+        {
+            jobs[i].sectors_per_cluster = sectors_per_cluster;
         }
     }
 
-    if (format_type == FATX_FORMAT_RETAIL)
+#ifdef _WIN32
+    sequential = true;
+#else
+    sequential = options && (options->flags & FATX_FORMAT_SEQUENTIAL);
+#endif
+
+    /* The partitions don't overlap, so each can be formatted on its own thread. */
+    for (i = 0; i < num_jobs; i++)
     {
-        return FATX_STATUS_SUCCESS;
+#ifndef _WIN32
+        started[i] = !sequential && pthread_create(&threads[i], NULL, fatx_format_thread, &jobs[i]) == 0;
+        if (started[i])
+        {
+            continue;
+        }
+#endif
+        fatx_format_thread(&jobs[i]);
     }
-    else if (format_type == FATX_FORMAT_F_TAKES_ALL)
+
+#ifndef _WIN32
+    for (i = 0; i < num_jobs; i++)
     {
-        fatx_drive_to_offset_size('f', &f_offset, &f_size);
+        if (started[i])
+        {
+            pthread_join(threads[i], NULL);
+        }
+    }
+#endif
 
-        fatx_info(fs, "-------------------------------------------\n");
-        fatx_info(fs, "Formatting partition %d (%c drive) ...\n", 5, 'f');
+    retval = FATX_STATUS_SUCCESS;
 
-        if (fatx_disk_format_partition(fs, path, f_offset, f_size, sector_size, sectors_per_cluster))
+    for (i = 0; i < num_jobs; i++)
+    {
+        if (jobs[i].status)
         {
-            fatx_error(fs, " - failed to format partition %d (f-takes-all)\n", 5);
-            return FATX_STATUS_ERROR;
+            fatx_error(fs, " - failed to format partition %zu (%c drive)\n", i, fatx_partition_map[i].letter);
+            retval = FATX_STATUS_ERROR;
         }
     }
 
-    return FATX_STATUS_SUCCESS;
+    free(filesystems);
+    return retval;
 }
 
 /*
@@ -178,36 +351,29 @@ int fatx_disk_format(struct fatx_fs *fs, char const *path, size_t sector_size, e
  */
 int fatx_disk_format_partition(struct fatx_fs *fs, char const *path, uint64_t offset, uint64_t size, size_t sector_size, size_t sectors_per_cluster)
 {
-    int retval;
-
-    if (fatx_open_device(fs, path, offset, size, sector_size, sectors_per_cluster))
-    {
-        return FATX_STATUS_ERROR;
-    }
-
-    if (fatx_write_superblock(fs))
-    {
-        retval = FATX_STATUS_ERROR;
-        goto cleanup;
-    }
-
-    if (fatx_init_fat(fs))
-    {
-        retval = FATX_STATUS_ERROR;
-        goto cleanup;
-    }
-
-    if (fatx_init_root(fs))
-    {
-        retval = FATX_STATUS_ERROR;
-        goto cleanup;
-    }
-
-    retval = FATX_STATUS_SUCCESS;
+    return fatx_disk_format_partition_ex(fs, path, offset, size, sector_size, sectors_per_cluster, NULL);
+}
 
-cleanup:
-    fatx_close_device(fs);
-    return retval;
+/*
+ * Format partition, with additional options.
+ *
+ * options may be NULL, in which case the defaults are used.
+ */
+int fatx_disk_format_partition_ex(struct fatx_fs *fs, char const *path, uint64_t offset, uint64_t size, size_t sector_size, size_t sectors_per_cluster, struct fatx_format_options const *options)
+{
+    struct fatx_format_job job;
+
+    job.fs                  = fs;
+    job.options             = options;
+    job.path                = path;
+    job.offset              = offset;
+    job.size                = size;
+    job.sector_size         = sector_size;
+    job.sectors_per_cluster = sectors_per_cluster;
+    job.partition           = 0;
+    job.total               = 0;
+
+    return fatx_format_partition(&job);
 }
 
 /*
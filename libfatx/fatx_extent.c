@@ -0,0 +1,367 @@
+/*
+ * FATX Filesystem Library
+ *
+ * Copyright (C) 2015  Matt Borgerson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A cache of file extent maps.
+ *
+ * An extent map describes a whole cluster chain as a sorted list of runs of
+ * contiguous clusters, so that the cluster holding a given file offset can be
+ * found with a binary search instead of by walking the chain. Maps are keyed
+ * by the first cluster of the chain, built on first use, and kept up to date
+ * as chains are extended, truncated and freed.
+ */
+
+#include "fatx_internal.h"
+
+/*
+ * Allocate the slots of the extent cache.
+ */
+int fatx_extent_cache_init(struct fatx_fs *fs)
+{
+    struct fatx_extent_cache *cache = &fs->extent_cache;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->maps = calloc(FATX_EXTENT_CACHE_SIZE, sizeof(struct fatx_extent_map));
+    if (!cache->maps)
+    {
+        fatx_error(fs, "failed to allocate memory for extent cache\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    cache->num_maps = FATX_EXTENT_CACHE_SIZE;
+    return FATX_STATUS_SUCCESS;
+}
+
+static void fatx_extent_map_clear(struct fatx_extent_map *map)
+{
+    free(map->extents);
+    memset(map, 0, sizeof(*map));
+}
+
+/*
+ * Drop every extent map.
+ */
+void fatx_extent_cache_reset(struct fatx_fs *fs)
+{
+    struct fatx_extent_cache *cache = &fs->extent_cache;
+    size_t i;
+
+    for (i = 0; i < cache->num_maps; i++)
+    {
+        fatx_extent_map_clear(&cache->maps[i]);
+    }
+}
+
+/*
+ * Release the memory held by the extent cache.
+ */
+void fatx_extent_cache_free(struct fatx_fs *fs)
+{
+    fatx_extent_cache_reset(fs);
+    free(fs->extent_cache.maps);
+    memset(&fs->extent_cache, 0, sizeof(fs->extent_cache));
+}
+
+/*
+ * Add a run of clusters to the end of a map, merging it into the last extent
+ * when it continues that extent on disk.
+ */
+static int fatx_extent_map_push(struct fatx_fs *fs, struct fatx_extent_map *map, size_t cluster, size_t count)
+{
+    struct fatx_extent *extent, *extents;
+    size_t capacity;
+
+    if (map->num_extents > 0)
+    {
+        extent = &map->extents[map->num_extents - 1];
+        if (extent->cluster + extent->count == cluster)
+        {
+            extent->count     += count;
+            map->num_clusters += count;
+            return FATX_STATUS_SUCCESS;
+        }
+    }
+
+    if (map->num_extents == map->capacity)
+    {
+        capacity = map->capacity ? map->capacity * 2 : 8;
+        extents  = realloc(map->extents, capacity * sizeof(struct fatx_extent));
+        if (!extents)
+        {
+            fatx_error(fs, "failed to allocate memory for extent map\n");
+            return FATX_STATUS_ERROR;
+        }
+        map->extents  = extents;
+        map->capacity = capacity;
+    }
+
+    extent = &map->extents[map->num_extents++];
+    extent->file_cluster = map->num_clusters;
+    extent->cluster      = cluster;
+    extent->count        = count;
+    map->num_clusters   += count;
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Walk a cluster chain and record it in a map.
+ */
+static int fatx_extent_map_build(struct fatx_fs *fs, struct fatx_extent_map *map, size_t first_cluster)
+{
+    size_t cluster, next_cluster, run_start, run_count;
+
+    fatx_debug(fs, "fatx_extent_map_build(first_cluster=%zd)\n", first_cluster);
+
+    map->first_cluster = first_cluster;
+
+    run_start = cluster = first_cluster;
+    run_count = 1;
+
+    while (1)
+    {
+        next_cluster = cluster;
+        if (fatx_get_next_cluster(fs, &next_cluster))
+        {
+            /* Reached the end of the cluster chain. */
+            break;
+        }
+
+        if (map->num_clusters + run_count >= fs->num_clusters)
+        {
+            fatx_error(fs, "cluster chain starting at %zd is too long\n", first_cluster);
+            return FATX_STATUS_ERROR;
+        }
+
+        if (next_cluster == cluster + 1)
+        {
+            run_count++;
+        }
+        else
+        {
+            if (fatx_extent_map_push(fs, map, run_start, run_count))
+            {
+                return FATX_STATUS_ERROR;
+            }
+            run_start = next_cluster;
+            run_count = 1;
+        }
+
+        cluster = next_cluster;
+    }
+
+    return fatx_extent_map_push(fs, map, run_start, run_count);
+}
+
+/*
+ * Get the extent map of the chain starting at first_cluster, building it if
+ * it is not cached yet.
+ */
+int fatx_extent_map_get(struct fatx_fs *fs, size_t first_cluster, struct fatx_extent_map **result)
+{
+    struct fatx_extent_cache *cache = &fs->extent_cache;
+    struct fatx_extent_map *map, *victim;
+    size_t i;
+
+    if (first_cluster == 0)
+    {
+        fatx_error(fs, "chain has no clusters\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    victim = NULL;
+
+    for (i = 0; i < cache->num_maps; i++)
+    {
+        map = &cache->maps[i];
+
+        if (map->first_cluster == first_cluster)
+        {
+            map->last_used = ++cache->clock;
+            *result = map;
+            return FATX_STATUS_SUCCESS;
+        }
+
+        /* Remember the least recently used slot, in case this is a miss. */
+        if (!victim || map->last_used < victim->last_used)
+        {
+            victim = map;
+        }
+    }
+
+    if (!victim)
+    {
+        fatx_error(fs, "extent cache is not initialized\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    fatx_extent_map_clear(victim);
+
+    if (fatx_extent_map_build(fs, victim, first_cluster))
+    {
+        fatx_extent_map_clear(victim);
+        return FATX_STATUS_ERROR;
+    }
+
+    victim->last_used = ++cache->clock;
+    *result = victim;
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Find the cluster holding the file_cluster'th cluster of a chain. The number
+ * of contiguous clusters from there to the end of its extent is returned in
+ * contiguous, which may be NULL.
+ */
+int fatx_extent_map_lookup(struct fatx_extent_map *map, size_t file_cluster, size_t *cluster, size_t *contiguous)
+{
+    struct fatx_extent *extent;
+    size_t low, high, mid;
+
+    if (file_cluster >= map->num_clusters)
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    /* Find the last extent that starts at or before file_cluster. */
+    low  = 0;
+    high = map->num_extents;
+    while (high - low > 1)
+    {
+        mid = low + (high - low) / 2;
+        if (map->extents[mid].file_cluster <= file_cluster)
+        {
+            low = mid;
+        }
+        else
+        {
+            high = mid;
+        }
+    }
+
+    extent   = &map->extents[low];
+    *cluster = extent->cluster + (file_cluster - extent->file_cluster);
+
+    if (contiguous)
+    {
+        *contiguous = extent->count - (file_cluster - extent->file_cluster);
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Get the last cluster of the chain described by a map.
+ */
+size_t fatx_extent_map_last_cluster(struct fatx_extent_map *map)
+{
+    struct fatx_extent *extent = &map->extents[map->num_extents - 1];
+
+    return extent->cluster + extent->count - 1;
+}
+
+/*
+ * Record that a run of clusters was attached after tail, the last cluster of
+ * a chain.
+ */
+void fatx_extent_cache_append(struct fatx_fs *fs, size_t tail, size_t cluster, size_t count)
+{
+    struct fatx_extent_cache *cache = &fs->extent_cache;
+    struct fatx_extent_map *map;
+    size_t i;
+
+    for (i = 0; i < cache->num_maps; i++)
+    {
+        map = &cache->maps[i];
+
+        if (map->first_cluster && fatx_extent_map_last_cluster(map) == tail)
+        {
+            if (fatx_extent_map_push(fs, map, cluster, count))
+            {
+                /* The map can no longer be trusted. */
+                fatx_extent_map_clear(map);
+            }
+            return;
+        }
+    }
+}
+
+/*
+ * Record that the chain starting at first_cluster was cut down to its first
+ * num_clusters clusters.
+ */
+void fatx_extent_cache_truncate(struct fatx_fs *fs, size_t first_cluster, size_t num_clusters)
+{
+    struct fatx_extent_cache *cache = &fs->extent_cache;
+    struct fatx_extent_map *map;
+    struct fatx_extent *extent;
+    size_t i;
+
+    for (i = 0; i < cache->num_maps; i++)
+    {
+        map = &cache->maps[i];
+
+        if (map->first_cluster != first_cluster)
+        {
+            continue;
+        }
+
+        while (map->num_clusters > num_clusters)
+        {
+            extent = &map->extents[map->num_extents - 1];
+
+            if (map->num_clusters - extent->count >= num_clusters)
+            {
+                /* Drop the whole extent. */
+                map->num_clusters -= extent->count;
+                map->num_extents--;
+            }
+            else
+            {
+                extent->count    -= map->num_clusters - num_clusters;
+                map->num_clusters = num_clusters;
+            }
+        }
+
+        if (map->num_extents == 0)
+        {
+            fatx_extent_map_clear(map);
+        }
+
+        return;
+    }
+}
+
+/*
+ * Forget the map of the chain starting at first_cluster.
+ */
+void fatx_extent_cache_invalidate(struct fatx_fs *fs, size_t first_cluster)
+{
+    struct fatx_extent_cache *cache = &fs->extent_cache;
+    size_t i;
+
+    for (i = 0; i < cache->num_maps; i++)
+    {
+        if (cache->maps[i].first_cluster == first_cluster)
+        {
+            fatx_extent_map_clear(&cache->maps[i]);
+            return;
+        }
+    }
+}
@@ -29,48 +29,45 @@ static bool fatx_cluster_valid(struct fatx_fs *fs, size_t cluster)
 /*
  * Initialize a blank FAT.
  */
-int fatx_init_fat(struct fatx_fs *fs)
+int fatx_init_fat(struct fatx_fs *fs, void (*progress)(void *ctx, uint64_t done), void *progress_ctx)
 {
-    int64_t bytes_remaining;
-    uint8_t *chunk;
-    size_t chunk_size;
     int retval = FATX_STATUS_SUCCESS;
-
-    if (fatx_dev_seek(fs, fs->fat_offset))
-    {
-        fatx_error(fs, "failed to seek to FAT start (offset 0x%zx)\n", fs->fat_offset);
-        return FATX_STATUS_ERROR;
-    }
+    uint64_t done, chunk;
 
     /*
-     * A FAT could span multiple gigabytes with a very large partition (tbs)
-     * using small clusters, so we want to create a relatively large zero
-     * buffer in those cases while still capping how much memory we allocate
-     * for the chunked writes to zero out the FAT table.
+     * Clear the FAT in chunks, so that progress can be reported. The FAT is
+     * mostly left empty, so image files are allowed to stay sparse.
      */
-    chunk_size = MAX(0x4000, (fs->fat_size >> 8));
-    chunk = malloc(chunk_size);
-    if (!chunk)
+    for (done = 0; done < fs->fat_size; done += chunk)
     {
-        fatx_error(fs, "failed to initialize memory for FAT wipe\n");
-        return FATX_STATUS_ERROR;
-    }
-    memset(chunk, 0x00, chunk_size);
+        chunk = MIN(FATX_FORMAT_PROGRESS_CHUNK, fs->fat_size - done);
 
-    bytes_remaining = fs->fat_size;
-    while (bytes_remaining > 0)
-    {
-        size_t bytes_to_write = MIN(chunk_size, bytes_remaining);
-        if (fatx_dev_write(fs, chunk, bytes_to_write, 1) != 1)
+        if (fatx_dev_wipe(fs, fs->fat_offset + done, chunk))
         {
-            fatx_error(fs, "failed to clear FAT chunk (offset 0x%zx)\n", fs->fat_offset + (bytes_remaining - fs->fat_size));
+            fatx_error(fs, "failed to clear FAT\n");
             retval = FATX_STATUS_ERROR;
             break;
         }
-        bytes_remaining -= bytes_to_write;
+
+        if (progress)
+        {
+            progress(progress_ctx, done + chunk);
+        }
+    }
+
+    /* Keep the in-memory FAT consistent with the freshly wiped one. */
+    if (fs->fat_mirror.data)
+    {
+        memset(fs->fat_mirror.data, 0, fs->fat_size);
+        memset(fs->fat_mirror.dirty, 0, (fs->fat_mirror.num_pages + 7) / 8);
     }
+    fatx_cache_reset(&fs->fat_cache);
+    fatx_cache_reset(&fs->dir_cache);
+    fatx_free_map_reset(fs);
+    fatx_extent_cache_reset(fs);
+    fatx_dentry_cache_reset(fs);
+    fatx_dir_index_reset(fs);
 
-    free(chunk);
     return retval;
 }
 
@@ -79,8 +76,7 @@ int fatx_init_fat(struct fatx_fs *fs)
  */
 int fatx_init_root(struct fatx_fs *fs)
 {
-    uint8_t *chunk;
-    int retval = FATX_STATUS_SUCCESS;
+    struct fatx_dir dir;
 
     if (fatx_write_fat(fs, 0, 0xfffffff8) || fatx_mark_cluster_end(fs, fs->root_cluster))
     {
@@ -88,102 +84,215 @@ int fatx_init_root(struct fatx_fs *fs)
         return FATX_STATUS_ERROR;
     }
 
-    chunk = malloc(fs->bytes_per_cluster);
-    memset(chunk, FATX_END_OF_DIR_MARKER, fs->bytes_per_cluster);
+    /* An empty directory, like the ones made by fatx_mkdir. */
+    dir.cluster = fs->root_cluster;
+    dir.entry   = 0;
 
-    if (fatx_dev_seek(fs, fs->cluster_offset))
+    if (fatx_zero_clusters(fs, fs->root_cluster, 1) || fatx_mark_end_of_dir(fs, &dir))
     {
-        fatx_error(fs, " - failed to seek to root directory cluster\n");
-        retval = FATX_STATUS_ERROR;
-        goto cleanup;
+        fatx_error(fs, " - failed to initialize root cluster\n");
+        return FATX_STATUS_ERROR;
     }
 
-    if (fatx_dev_write(fs, chunk, fs->bytes_per_cluster, 1) != 1)
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Load the entire FAT into memory.
+ */
+static int fatx_init_fat_mirror(struct fatx_fs *fs)
+{
+    struct fatx_fat_mirror *mirror = &fs->fat_mirror;
+
+    fatx_debug(fs, "fatx_init_fat_mirror()\n");
+
+    /* The FAT size is always a multiple of the page size. */
+    mirror->num_pages = fs->fat_size / FATX_FAT_PAGE_SIZE;
+    mirror->data      = malloc(fs->fat_size);
+    mirror->dirty     = calloc((mirror->num_pages + 7) / 8, 1);
+
+    if (!mirror->data || !mirror->dirty)
     {
-        fatx_error(fs, " - failed to initialize root cluster\n");
-        retval = FATX_STATUS_ERROR;
-        goto cleanup;
+        fatx_error(fs, "failed to allocate memory for FAT mirror\n");
+        goto error;
     }
 
-cleanup:
-    free(chunk);
-    return retval;
+    if (fatx_dev_read_at(fs, mirror->data, fs->fat_size, fs->fat_offset))
+    {
+        fatx_error(fs, "failed to read FAT into memory\n");
+        goto error;
+    }
+
+    return FATX_STATUS_SUCCESS;
+
+error:
+    free(mirror->data);
+    free(mirror->dirty);
+    memset(mirror, 0, sizeof(*mirror));
+    return FATX_STATUS_ERROR;
 }
 
-int fatx_flush_fat_cache(struct fatx_fs *fs)
+/*
+ * Set up either the FAT mirror or the FAT page cache, as requested.
+ */
+int fatx_init_fat_cache(struct fatx_fs *fs, struct fatx_open_options const *options)
 {
-    struct fatx_cache *cache = &fs->fat_cache;
+    size_t cache_size;
 
-    fatx_debug(fs, "fatx_flush_fat_cache()\n");
+    memset(&fs->fat_cache, 0, sizeof(fs->fat_cache));
+    memset(&fs->fat_mirror, 0, sizeof(fs->fat_mirror));
 
-    if (!cache->data || !cache->dirty)
+    /* A memory mapped FAT is read in place, and needs neither. */
+    if (fatx_dev_map_ptr(fs, fs->fat_offset, fs->fat_size))
     {
         return FATX_STATUS_SUCCESS;
     }
 
-    if (fatx_dev_seek(fs, fs->fat_offset + cache->position * cache->entry_size))
+    if (options && (options->flags & FATX_OPEN_FAT_MIRROR))
     {
-        fatx_error(fs, "failed to seek to fat cache start index %zd (offset 0x%zx)\n",
-                   cache->position, fs->fat_offset + cache->position * cache->entry_size);
-        return FATX_STATUS_ERROR;
+        return fatx_init_fat_mirror(fs);
     }
 
-    if (fatx_dev_write(fs, cache->data, cache->entry_size, cache->entries) != cache->entries)
+    cache_size = FATX_FAT_CACHE_DEFAULT_SIZE;
+    if (options && options->fat_cache_size)
     {
-        fatx_error(fs, "failed to write fatx cache entries to disk\n");
-        return FATX_STATUS_ERROR;
+        cache_size = options->fat_cache_size;
     }
 
-    cache->dirty = false;
-    return FATX_STATUS_SUCCESS;
+    /* There is no point in caching more pages than the FAT has. */
+    cache_size = MIN(cache_size, fs->fat_size);
+
+    return fatx_cache_init(fs, &fs->fat_cache, fs->fat_offset, FATX_FAT_PAGE_SIZE,
+                           cache_size / FATX_FAT_PAGE_SIZE);
 }
 
-int fatx_populate_fat_cache(struct fatx_fs *fs, size_t index)
+static bool fatx_fat_mirror_page_dirty(struct fatx_fat_mirror *mirror, size_t page)
 {
-    int result;
-    struct fatx_cache *cache = &fs->fat_cache;
+    return mirror->dirty[page / 8] & (1 << (page % 8));
+}
 
-    fatx_debug(fs, "fatx_populate_fat_cache(index=%zd)\n", index);
+/*
+ * Write the dirty pages of the FAT mirror back to the device. Runs of
+ * adjacent dirty pages are written with one I/O each, and all of the runs
+ * are submitted together.
+ */
+static int fatx_flush_fat_mirror(struct fatx_fs *fs)
+{
+    struct fatx_fat_mirror *mirror = &fs->fat_mirror;
+    struct fatx_dev_batch batch;
+    size_t page, run;
+    uint64_t offset;
 
-    if (!fatx_cluster_valid(fs, index))
+    fatx_dev_batch_init(&batch);
+
+    page = 0;
+    while (page < mirror->num_pages)
     {
-        fatx_error(fs, "index number out of bounds\n");
-        return FATX_STATUS_ERROR;
+        if (!fatx_fat_mirror_page_dirty(mirror, page))
+        {
+            page++;
+            continue;
+        }
+
+        /* Coalesce adjacent dirty pages into a single write. */
+        run = 1;
+        while (page + run < mirror->num_pages && fatx_fat_mirror_page_dirty(mirror, page + run))
+        {
+            run++;
+        }
+
+        offset = (uint64_t)page * FATX_FAT_PAGE_SIZE;
+        fatx_debug(fs, "flushing fat pages %zd-%zd\n", page, page + run - 1);
+
+        if (fatx_dev_batch_add(fs, &batch, true, (uint8_t *)mirror->data + offset, run * FATX_FAT_PAGE_SIZE, fs->fat_offset + offset))
+        {
+            fatx_error(fs, "failed to write fat pages to disk\n");
+            return FATX_STATUS_ERROR;
+        }
+
+        page += run;
     }
 
-    if (fatx_flush_fat_cache(fs)) {
-        fatx_error(fs, "failed to flush fat cache\n");
+    if (fatx_dev_batch_submit(fs, &batch))
+    {
+        fatx_error(fs, "failed to write fat pages to disk\n");
         return FATX_STATUS_ERROR;
     }
 
-    if (cache->data)
+    memset(mirror->dirty, 0, (mirror->num_pages + 7) / 8);
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Release the memory held by the FAT cache and FAT mirror.
+ */
+void fatx_free_fat_cache(struct fatx_fs *fs)
+{
+    fatx_cache_free(&fs->fat_cache);
+
+    free(fs->fat_mirror.data);
+    free(fs->fat_mirror.dirty);
+    memset(&fs->fat_mirror, 0, sizeof(fs->fat_mirror));
+}
+
+int fatx_flush_fat_cache(struct fatx_fs *fs)
+{
+    fatx_debug(fs, "fatx_flush_fat_cache()\n");
+
+    if (fs->fat_mirror.data)
     {
-        free(cache->data);
+        return fatx_flush_fat_mirror(fs);
     }
 
-    cache->position   = index;
-    cache->entries    = MIN(FATX_FAT_CACHE_NUM_ENTRIES, fs->num_clusters + FATX_FAT_RESERVED_ENTRIES_COUNT - index);
-    cache->entry_size = fs->fat_type == FATX_FAT_TYPE_16 ? 2 : 4;
+    return fatx_cache_flush(fs, &fs->fat_cache);
+}
 
-    fatx_debug(fs, "populating fat cache: [pos: %zd, entries: %zd, entry_size: %zd]\n",
-               cache->position, cache->entries, cache->entry_size);
+/*
+ * Get a pointer to a FAT entry in memory, loading its page if necessary.
+ */
+static int fatx_fat_entry_ptr(struct fatx_fs *fs, size_t index, bool write, void **ptr)
+{
+    struct fatx_fat_mirror *mirror = &fs->fat_mirror;
+    size_t entry_size, byte_offset, page;
+    void *data;
 
-    cache->data = malloc(cache->entries * cache->entry_size);
+    entry_size  = fs->fat_type == FATX_FAT_TYPE_16 ? 2 : 4;
+    byte_offset = index * entry_size;
+    page        = byte_offset / FATX_FAT_PAGE_SIZE;
 
-    if (fatx_dev_seek(fs, fs->fat_offset + cache->position * cache->entry_size))
+    if (write && fatx_check_writable(fs))
     {
-        fatx_error(fs, "failed to seek to fat cache start index %zd (offset 0x%zx)\n",
-                   cache->position, fs->fat_offset + cache->position * cache->entry_size);
         return FATX_STATUS_ERROR;
     }
 
-    if (fatx_dev_read(fs, cache->data, cache->entry_size, cache->entries) != cache->entries)
+    if (!write)
     {
-        fatx_error(fs, "failed to populate fat cache entries\n");
+        data = (void *)fatx_dev_map_ptr(fs, fs->fat_offset + byte_offset, entry_size);
+        if (data)
+        {
+            *ptr = data;
+            return FATX_STATUS_SUCCESS;
+        }
+    }
+
+    if (mirror->data)
+    {
+        if (write)
+        {
+            mirror->dirty[page / 8] |= 1 << (page % 8);
+        }
+
+        *ptr = (uint8_t *)mirror->data + byte_offset;
+        return FATX_STATUS_SUCCESS;
+    }
+
+    if (fatx_cache_get(fs, &fs->fat_cache, page, write, &data))
+    {
+        fatx_error(fs, "failed to load fat page %zd\n", page);
         return FATX_STATUS_ERROR;
     }
 
-    cache->dirty = false;
+    *ptr = (uint8_t *)data + byte_offset % FATX_FAT_PAGE_SIZE;
     return FATX_STATUS_SUCCESS;
 }
 
@@ -192,7 +301,7 @@ int fatx_populate_fat_cache(struct fatx_fs *fs, size_t index)
  */
 int fatx_read_fat(struct fatx_fs *fs, size_t index, fatx_fat_entry *entry)
 {
-    struct fatx_cache *cache = &fs->fat_cache;
+    void *ptr;
 
     fatx_debug(fs, "fatx_read_fat(index=%zd)\n", index);
 
@@ -202,23 +311,18 @@ int fatx_read_fat(struct fatx_fs *fs, size_t index, fatx_fat_entry *entry)
         return FATX_STATUS_ERROR;
     }
 
-    if (!cache->data || index < cache->position || index >= cache->position + cache->entries)
+    if (fatx_fat_entry_ptr(fs, index, false, &ptr))
     {
-        fatx_debug(fs, "fat cache miss for index %zd\n", index);
-        if (fatx_populate_fat_cache(fs, index))
-        {
-            fatx_error(fs, "failed to populate fat cache\n");
-            return FATX_STATUS_ERROR;
-        }
+        return FATX_STATUS_ERROR;
     }
 
     if (fs->fat_type == FATX_FAT_TYPE_16)
     {
-        *entry = ((uint16_t*) cache->data)[index - cache->position];
+        *entry = *(uint16_t *)ptr;
     }
     else
     {
-        *entry = ((uint32_t*) cache->data)[index - cache->position];
+        *entry = *(uint32_t *)ptr;
     }
 
     return FATX_STATUS_SUCCESS;
@@ -229,7 +333,7 @@ int fatx_read_fat(struct fatx_fs *fs, size_t index, fatx_fat_entry *entry)
  */
 int fatx_write_fat(struct fatx_fs *fs, size_t index, fatx_fat_entry entry)
 {
-    struct fatx_cache *cache = &fs->fat_cache;
+    void *ptr;
 
     fatx_debug(fs, "fatx_write_fat(index=%zd, entry=%zx)\n", index, entry);
 
@@ -239,26 +343,30 @@ int fatx_write_fat(struct fatx_fs *fs, size_t index, fatx_fat_entry entry)
         return FATX_STATUS_ERROR;
     }
 
-    if (!cache->data || index < cache->position || index >= cache->position + cache->entries)
+    if (fatx_fat_entry_ptr(fs, index, true, &ptr))
     {
-        fatx_debug(fs, "fat cache miss for index %zd\n", index);
-        if (fatx_populate_fat_cache(fs, index))
-        {
-            fatx_error(fs, "failed to populate fat cache\n");
-            return FATX_STATUS_ERROR;
-        }
+        return FATX_STATUS_ERROR;
     }
 
     if (fs->fat_type == FATX_FAT_TYPE_16)
     {
-        ((uint16_t*) cache->data)[index - cache->position] = entry;
+        *(uint16_t *)ptr = entry;
+    }
+    else
+    {
+        *(uint32_t *)ptr = entry;
+    }
+
+    if (fatx_get_fat_entry_type(fs, entry) == FATX_CLUSTER_AVAILABLE)
+    {
+        fatx_free_map_update(fs, index, true);
+        fatx_dir_cache_invalidate(fs, index);
     }
     else
     {
-        ((uint32_t*) cache->data)[index - cache->position] = entry;
+        fatx_free_map_update(fs, index, false);
     }
 
-    cache->dirty = true;
     return FATX_STATUS_SUCCESS;
 }
 
@@ -378,16 +486,46 @@ int fatx_mark_cluster_end(struct fatx_fs *fs, size_t cluster)
 }
 
 /*
- * Free a cluster chain.
+ * Tell the device that a run of freed clusters is no longer in use, if the
+ * filesystem was opened with FATX_OPEN_DISCARD. This is only a hint, so
+ * failures are ignored.
+ */
+static void fatx_discard_clusters(struct fatx_fs *fs, size_t start, size_t count)
+{
+    uint64_t pos;
+
+    if (!count || !(fs->open_flags & FATX_OPEN_DISCARD))
+    {
+        return;
+    }
+
+    if (fatx_cluster_number_to_byte_offset(fs, start, &pos) == FATX_STATUS_SUCCESS &&
+        fatx_dev_discard(fs, pos, (uint64_t)count * fs->bytes_per_cluster) != FATX_STATUS_SUCCESS)
+    {
+        fatx_debug(fs, "failed to discard clusters %zd-%zd\n", start, start + count - 1);
+    }
+}
+
+/*
+ * Free a cluster chain. Runs of contiguous clusters are discarded together.
  */
 int fatx_free_cluster_chain(struct fatx_fs *fs, size_t first_cluster)
 {
-    size_t cluster, next_cluster;
+    size_t cluster, next_cluster, run_start, run_count;
     int status;
 
     fatx_debug(fs, "fatx_free_cluster_chain(cluster=%zd)\n", first_cluster);
 
+    if (first_cluster == 0)
+    {
+        /* An empty file, with no clusters. */
+        return FATX_STATUS_SUCCESS;
+    }
+
+    fatx_extent_cache_invalidate(fs, first_cluster);
+
     cluster = next_cluster = first_cluster;
+    run_start = run_count = 0;
 
     do
     {
@@ -403,78 +541,232 @@ int fatx_free_cluster_chain(struct fatx_fs *fs, size_t first_cluster)
         status = fatx_mark_cluster_available(fs, cluster);
         if (status != FATX_STATUS_SUCCESS) return status;
 
+        if (run_count && cluster == run_start + run_count)
+        {
+            run_count++;
+        }
+        else
+        {
+            fatx_discard_clusters(fs, run_start, run_count);
+            run_start = cluster;
+            run_count = 1;
+        }
+
         cluster = next_cluster;
     } while (cluster);
 
+    fatx_discard_clusters(fs, run_start, run_count);
+
     return FATX_STATUS_SUCCESS;
 }
 
 /*
- * Find an available cluster.
+ * Link a run of contiguous clusters into a chain, in a single pass over the
+ * FAT pages they occupy. The last cluster of the run is marked as the end of
+ * the chain.
  */
-int fatx_alloc_cluster(struct fatx_fs *fs, size_t *cluster, bool zero)
+static int fatx_write_fat_run(struct fatx_fs *fs, size_t start, size_t count)
+{
+    size_t entries_per_page, cluster, end, n, i;
+    fatx_fat_entry entry;
+    void *ptr;
+
+    fatx_debug(fs, "fatx_write_fat_run(start=%zd, count=%zd)\n", start, count);
+
+    if (!fatx_cluster_valid(fs, start) || !fatx_cluster_valid(fs, start + count - 1))
+    {
+        fatx_error(fs, "cluster run out of bounds\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    entries_per_page = FATX_FAT_PAGE_SIZE / (fs->fat_type == FATX_FAT_TYPE_16 ? 2 : 4);
+    end = start + count;
+
+    for (cluster = start; cluster < end; cluster += n)
+    {
+        if (fatx_fat_entry_ptr(fs, cluster, true, &ptr))
+        {
+            return FATX_STATUS_ERROR;
+        }
+
+        n = MIN(end - cluster, entries_per_page - cluster % entries_per_page);
+
+        for (i = 0; i < n; i++)
+        {
+            entry = (cluster + i + 1 < end) ? cluster + i + 1 : 0xffffffff;
+
+            if (fs->fat_type == FATX_FAT_TYPE_16)
+            {
+                ((uint16_t *)ptr)[i] = entry;
+            }
+            else
+            {
+                ((uint32_t *)ptr)[i] = entry;
+            }
+
+            fatx_free_map_update(fs, cluster + i, false);
+        }
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Fill a run of contiguous clusters with zeros.
+ */
+int fatx_zero_clusters(struct fatx_fs *fs, size_t start, size_t count)
 {
+    uint64_t pos;
     int status;
+
+    status = fatx_cluster_number_to_byte_offset(fs, start, &pos);
+    if (status) return status;
+
+    if (fatx_dev_zero(fs, pos, (uint64_t)count * fs->bytes_per_cluster))
+    {
+        fatx_error(fs, "failed to zero clusters\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Allocate a number of clusters and link them into a chain.
+ *
+ * The clusters are taken in runs of contiguous free clusters, as long as
+ * can be found, and each run is linked into the FAT in one pass. If tail is
+ * non-zero, it must be the last cluster of an existing chain, and the new
+ * clusters are attached to it. Otherwise a new chain is started. The first
+ * and last of the new clusters are returned in first and last, either of
+ * which may be NULL.
+ *
+ * If the allocation fails part of the way through, the clusters linked so
+ * far are freed again, tail is left as the end of its chain and first and
+ * last are not written.
+ */
+int fatx_alloc_clusters(struct fatx_fs *fs, size_t tail, size_t count, bool zero, size_t *first, size_t *last)
+{
     fatx_fat_entry fat_entry;
-    static size_t i = 2;
-    size_t start_i;
-    bool wrapped;
-    void *zero_buf;
+    size_t prev, start, run, new_first;
+    int status;
 
-    fatx_debug(fs, "fatx_alloc_cluster(zero: %s)\n", zero ? "true" : "false");
+    fatx_debug(fs, "fatx_alloc_clusters(tail=%zd, count=%zd, zero: %s)\n", tail, count, zero ? "true" : "false");
+
+    if (count == 0)
+    {
+        fatx_error(fs, "cannot allocate zero clusters\n");
+        return FATX_STATUS_ERROR;
+    }
 
-    start_i = i;
-    wrapped = false;
+    if (fs->free_map.num_free < count)
+    {
+        fatx_error(fs, "not enough clusters available to allocate %zd clusters\n", count);
+        return FATX_STATUS_ERROR;
+    }
 
-    for (; 1; i++)
+    if (tail)
     {
-        if (i >= fs->num_clusters)
+        status = fatx_read_fat(fs, tail, &fat_entry);
+        if (status) return status;
+
+        if (fatx_get_fat_entry_type(fs, fat_entry) != FATX_CLUSTER_END)
         {
-            i = 2;
-            wrapped = true;
+            fatx_error(fs, "tail was not the last cluster in the chain\n");
+            return FATX_STATUS_ERROR;
         }
+    }
+
+    prev = tail;
+    new_first = 0;
 
-        /* Check for the case that the FAT was full when mounting initially */
-        if (i == start_i && wrapped)
+    while (count > 0)
+    {
+        status = fatx_free_map_find_run(fs, count, &start, &run);
+        if (status)
         {
             fatx_error(fs, "no clusters available to allocate\n");
-            return FATX_STATUS_ERROR;
+            goto error;
         }
 
-        status = fatx_read_fat(fs, i, &fat_entry);
-        if (status != FATX_STATUS_SUCCESS)
+        fatx_debug(fs, "allocating clusters %zd-%zd\n", start, start + run - 1);
+
+        /*
+         * Until the run is linked to the chain, it is freed on its own. A run
+         * that was only partly written ends at its first unwritten entry.
+         */
+        status = fatx_write_fat_run(fs, start, run);
+        if (status)
         {
-            fatx_error(fs, "fatx_read_fat returned status=%d, fat_entry = 0x%x\n", status, fat_entry);
-            return status;
+            fatx_free_cluster_chain(fs, start);
+            goto error;
         }
 
-        status = fatx_get_fat_entry_type(fs, fat_entry);
-        if (status == FATX_CLUSTER_AVAILABLE)
+        if (prev)
         {
-            /* Found a free cluster! */
-            break;
+            status = fatx_write_fat(fs, prev, start);
+            if (status)
+            {
+                fatx_free_cluster_chain(fs, start);
+                goto error;
+            }
+
+            fatx_extent_cache_append(fs, prev, start, run);
         }
+
+        if (!new_first)
+        {
+            new_first = start;
+        }
+
+        if (zero)
+        {
+            status = fatx_zero_clusters(fs, start, run);
+            if (status) goto error;
+        }
+
+        prev = start + run - 1;
+        count -= run;
     }
 
-    status = fatx_mark_cluster_end(fs, i);
-    if (status != FATX_STATUS_SUCCESS) return status;
+    if (first)
+    {
+        *first = new_first;
+    }
+
+    if (last)
+    {
+        *last = prev;
+    }
 
-    status = fatx_dev_seek_cluster(fs, i, 0);
-    if (status != FATX_STATUS_SUCCESS) return status;
+    return FATX_STATUS_SUCCESS;
 
-    if (zero)
+error:
+    /* Give back the clusters linked so far, and end the chain at tail again. */
+    if (tail)
     {
-        zero_buf = calloc(1, fs->bytes_per_cluster);
-        if (!zero_buf) return FATX_STATUS_ERROR;
+        fatx_mark_cluster_end(fs, tail);
 
-        status = fatx_dev_write(fs, zero_buf, fs->bytes_per_cluster, 1);
-        free(zero_buf);
-        if (status != 1) return status;
+        /* A cached map of the chain may already include the freed clusters. */
+        fatx_extent_cache_reset(fs);
     }
 
-    *cluster = i;
+    if (new_first)
+    {
+        fatx_free_cluster_chain(fs, new_first);
+    }
 
-    return FATX_STATUS_SUCCESS;
+    return status;
+}
+
+/*
+ * Find an available cluster.
+ */
+int fatx_alloc_cluster(struct fatx_fs *fs, size_t *cluster, bool zero)
+{
+    fatx_debug(fs, "fatx_alloc_cluster(zero: %s)\n", zero ? "true" : "false");
+
+    return fatx_alloc_clusters(fs, 0, 1, zero, cluster, NULL);
 }
 
 /*
@@ -515,5 +807,7 @@ int fatx_attach_cluster(struct fatx_fs *fs, size_t tail, size_t cluster)
         return status;
     }
 
+    fatx_extent_cache_append(fs, tail, cluster, 1);
+
     return FATX_STATUS_SUCCESS;
 }
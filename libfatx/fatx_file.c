@@ -23,294 +23,809 @@
 #include <stdlib.h>
 
 /*
- * Determine the cluster which contains a byte offset of a file.
+ * Two handles refer to the same file when their directory entries are at the
+ * same location. A handle whose entry was removed has a directory cluster of
+ * 0 and a number given to the removed file in place of the entry, so that it
+ * only matches the other handles of that file.
  */
-int fatx_find_cluster_for_file_offset_alloc(struct fatx_fs *fs, struct fatx_attr *attr, size_t offset, size_t *result, bool alloc)
+static bool fatx_file_at(struct fatx_file const *file, struct fatx_dir const *dir)
 {
-    fatx_fat_entry fat_entry;
-    size_t cluster, alloc_cluster;
-    int status;
+    return file->dir.cluster == dir->cluster && file->dir.entry == dir->entry;
+}
+
+static void fatx_file_reset_cursor(struct fatx_file *file)
+{
+    file->cursor_file_cluster = 0;
+    file->cursor_cluster      = 0;
+    file->cursor_count        = 0;
+}
 
-    /* Sanity check the offset. */
-    if (offset > attr->file_size)
+/*
+ * Give the other handles open on the same file the attributes of this one,
+ * after they were changed through it.
+ */
+static void fatx_file_share_attr(struct fatx_fs *fs, struct fatx_file *file)
+{
+    struct fatx_file *other;
+
+    for (other = fs->open_files; other; other = other->next)
     {
-        fatx_error(fs, "offset out of range\n");
-        return FATX_STATUS_ERROR;
+        if (other != file && fatx_file_at(other, &file->dir))
+        {
+            other->attr  = file->attr;
+            other->dirty = file->dirty;
+        }
     }
+}
 
-    /* Start at the first cluster and seek through the chain. */
-    cluster = attr->first_cluster;
+/*
+ * Called when a directory entry is read, so that the attributes of a file
+ * which is open with unwritten changes are reported as they are in memory.
+ */
+void fatx_file_attr_read(struct fatx_fs *fs, struct fatx_dir const *dir, struct fatx_attr *attr)
+{
+    struct fatx_file *file;
 
-    while (offset >= fs->bytes_per_cluster)
+    for (file = fs->open_files; file; file = file->next)
     {
-        fatx_debug(fs, "seeking... cluster = %zx\n", cluster);
+        if (file->dirty && fatx_file_at(file, dir))
+        {
+            attr->attributes    = file->attr.attributes;
+            attr->first_cluster = file->attr.first_cluster;
+            attr->file_size     = file->attr.file_size;
+            attr->modified      = file->attr.modified;
+            attr->created       = file->attr.created;
+            attr->accessed      = file->attr.accessed;
+            return;
+        }
+    }
+}
 
-        /*
-         * There is at least one more cluster.
-         * Look in the FAT to find the next cluster number.
-         */
-        status = fatx_read_fat(fs, cluster, &fat_entry);
-        if (status) return status;
+/*
+ * Called when a directory entry is written. Handles open on it take the new
+ * attributes, which include any changes they had (see fatx_file_attr_read).
+ */
+void fatx_file_attr_written(struct fatx_fs *fs, struct fatx_dir const *dir, struct fatx_attr const *attr)
+{
+    struct fatx_file *file;
+
+    for (file = fs->open_files; file; file = file->next)
+    {
+        if (fatx_file_at(file, dir))
+        {
+            if (&file->attr != attr)
+            {
+                file->attr = *attr;
+            }
+            file->dirty = false;
+
+            /* The cluster chain may have been cut short. */
+            fatx_file_reset_cursor(file);
+        }
+    }
+}
+
+/*
+ * Check whether any handle is open on the file at a directory entry.
+ */
+bool fatx_file_is_open(struct fatx_fs *fs, struct fatx_dir const *dir)
+{
+    struct fatx_file *file;
 
-        status = fatx_get_fat_entry_type(fs, fat_entry);
-        if (status == FATX_CLUSTER_DATA)
+    for (file = fs->open_files; file; file = file->next)
+    {
+        if (fatx_file_at(file, dir))
         {
-            /* Great, there is another cluster. Move to it. */
-            cluster = fat_entry;
+            return true;
         }
-        else if (alloc && status == FATX_CLUSTER_END)
+    }
+
+    return false;
+}
+
+/*
+ * Called when a directory entry is removed. Handles open on it keep using the
+ * clusters of the file, which are freed when the last of them is closed.
+ */
+void fatx_file_entry_removed(struct fatx_fs *fs, struct fatx_dir const *dir)
+{
+    struct fatx_dir loc = *dir, removed;
+    struct fatx_file *file;
+
+    removed.cluster = 0;
+    removed.entry   = ++fs->removed_files;
+
+    for (file = fs->open_files; file; file = file->next)
+    {
+        if (fatx_file_at(file, &loc))
         {
-            fatx_debug(fs, "out of clusters, allocating new one\n");
+            file->dir   = removed;
+            file->dirty = false;
+        }
+    }
+}
 
-            status = fatx_alloc_cluster(fs, &alloc_cluster, true);
-            if (status) return status;
+/*
+ * Called when the contents of two directory entries are exchanged. Handles
+ * follow their file to its new entry.
+ */
+void fatx_file_entry_swapped(struct fatx_fs *fs, struct fatx_dir const *dir1, struct fatx_dir const *dir2)
+{
+    struct fatx_dir loc1 = *dir1, loc2 = *dir2;
+    struct fatx_file *file;
+
+    for (file = fs->open_files; file; file = file->next)
+    {
+        if (fatx_file_at(file, &loc1))
+        {
+            file->dir = loc2;
+        }
+        else if (fatx_file_at(file, &loc2))
+        {
+            file->dir = loc1;
+        }
+    }
+}
+
+/*
+ * Write the attributes of a handle to its directory entry, if they changed
+ * and the file still has one.
+ */
+static int fatx_file_write_attr(struct fatx_fs *fs, struct fatx_file *file)
+{
+    struct fatx_dirent dirent;
+    struct fatx_dir dir;
+
+    if (!file->dirty || !file->dir.cluster)
+    {
+        return FATX_STATUS_SUCCESS;
+    }
+
+    strcpy(dirent.filename, file->attr.filename);
+    dir = file->dir;
+
+    return fatx_write_dir(fs, &dir, &dirent, &file->attr);
+}
 
-            status = fatx_attach_cluster(fs, cluster, alloc_cluster);
+/*
+ * Write the unwritten attributes of every open file.
+ */
+int fatx_file_flush_all(struct fatx_fs *fs)
+{
+    struct fatx_file *file;
+    int status = FATX_STATUS_SUCCESS;
+
+    for (file = fs->open_files; file; file = file->next)
+    {
+        if (fatx_file_write_attr(fs, file))
+        {
+            status = FATX_STATUS_ERROR;
+        }
+    }
+
+    return status;
+}
+
+/*
+ * Find the cluster holding the file_cluster'th cluster of an open file, and
+ * the number of contiguous clusters from there.
+ *
+ * This is called by concurrent readers, so the cursor and the extent cache
+ * are only touched under the cache lock.
+ */
+static int fatx_file_lookup(struct fatx_fs *fs, struct fatx_file *file, size_t file_cluster, size_t *cluster, size_t *contiguous)
+{
+    struct fatx_extent_map *map;
+    int status = FATX_STATUS_SUCCESS;
+
+    fatx_lock_caches(fs);
+
+    if (file_cluster >= file->cursor_file_cluster &&
+        file_cluster - file->cursor_file_cluster < file->cursor_count)
+    {
+        *cluster    = file->cursor_cluster + (file_cluster - file->cursor_file_cluster);
+        *contiguous = file->cursor_count - (file_cluster - file->cursor_file_cluster);
+        goto cleanup;
+    }
+
+    status = fatx_extent_map_get(fs, file->attr.first_cluster, &map);
+    if (status) goto cleanup;
+
+    status = fatx_extent_map_lookup(map, file_cluster, cluster, contiguous);
+    if (status) goto cleanup;
+
+    file->cursor_file_cluster = file_cluster;
+    file->cursor_cluster      = *cluster;
+    file->cursor_count        = *contiguous;
+
+cleanup:
+    fatx_unlock_caches(fs);
+    return status;
+}
+
+/*
+ * Resize the cluster chain of a file to hold size bytes and set its size in
+ * attr. New clusters are zeroed. An empty file has no clusters at all. The
+ * directory entry is not written.
+ */
+static int fatx_resize_chain(struct fatx_fs *fs, struct fatx_attr *attr, size_t size)
+{
+    size_t enc_clusters = 1;
+    size_t cluster = attr->first_cluster;
+    size_t next_cluster;
+    int status;
+
+    if (size == 0)
+    {
+        /* Release the whole chain. */
+        status = fatx_free_cluster_chain(fs, attr->first_cluster);
+        if (status) return status;
+
+        attr->first_cluster = 0;
+        attr->file_size = 0;
+        return FATX_STATUS_SUCCESS;
+    }
+
+    if (attr->first_cluster == 0)
+    {
+        /* Start a new chain. */
+        status = fatx_alloc_clusters(fs, 0, (size + fs->bytes_per_cluster - 1) / fs->bytes_per_cluster, true, &attr->first_cluster, NULL);
+        if (status) return status;
+
+        attr->file_size = size;
+        return FATX_STATUS_SUCCESS;
+    }
+
+    while (enc_clusters * fs->bytes_per_cluster < size)
+    {
+        status = fatx_get_next_cluster(fs, &cluster);
+        if (status == FATX_STATUS_ERROR)
+        {
+            /* Out of clusters, alloc the rest at once */
+            size_t needed = (size + fs->bytes_per_cluster - 1) / fs->bytes_per_cluster - enc_clusters;
+            status = fatx_alloc_clusters(fs, cluster, needed, true, NULL, &cluster);
             if (status) return status;
 
-            cluster = alloc_cluster;
+            enc_clusters += needed;
         }
-        else
+        else if (status == FATX_STATUS_SUCCESS)
         {
-            /* Error. */
-            fatx_error(fs, "expected another cluster while seeking to file offset\n");
-            return FATX_STATUS_ERROR;
+            /* Found next cluster, continue */
+            ++enc_clusters;
         }
+        else return status;
+    }
 
-        /* Consume the bytes of the last cluster. */
-        offset -= fs->bytes_per_cluster;
+    /* If there are more clusters, then free them */
+    next_cluster = cluster;
+    status = fatx_get_next_cluster(fs, &next_cluster);
+    if(status == FATX_STATUS_SUCCESS)
+    {
+        status = fatx_free_cluster_chain(fs, next_cluster);
+        if (status) return status;
     }
 
-    *result = cluster;
+    /* Mark new end of cluster */
+    status = fatx_mark_cluster_end(fs, cluster);
+    if (status) return status;
+
+    fatx_extent_cache_truncate(fs, attr->first_cluster, enc_clusters);
+
+    attr->file_size = size;
     return FATX_STATUS_SUCCESS;
 }
 
-int fatx_find_cluster_for_file_offset(struct fatx_fs *fs, struct fatx_attr *attr, size_t offset, size_t *result)
+/*
+ * Start tracking a newly opened handle. Its attr already has the unwritten
+ * changes of any other handle on the file.
+ */
+static void fatx_file_track(struct fatx_fs *fs, struct fatx_file *file)
 {
-    return fatx_find_cluster_for_file_offset_alloc(fs, attr, offset, result, false);
+    file->dirty = false;
+    fatx_file_reset_cursor(file);
+
+    file->next     = fs->open_files;
+    fs->open_files = file;
 }
 
 /*
- * Read from a file
+ * Open a file.
  *
- * Returns the number of bytes read.
- * Returns 0 on EOF.
+ * The handle must be closed with fatx_file_close before the device is
+ * closed.
  */
-int fatx_read(struct fatx_fs *fs, char const *path, off_t offset, size_t size, void *buf)
+static int fatx_file_open_locked(struct fatx_fs *fs, char const *path, struct fatx_file *file)
 {
-    size_t total_bytes_read;
-    size_t bytes_remaining_in_file;
-    size_t cluster;
-    off_t cluster_offset;
-    struct fatx_attr attr;
+    struct fatx_dirent dirent;
+    char *path_dirname, *path_basename;
     int status;
 
-    fatx_debug(fs, "fatx_read(path=\"%s\", offset=0x%zx, size=0x%zx, buf=%p)\n", path, offset, size, buf);
+    fatx_debug(fs, "fatx_file_open(path=\"%s\")\n", path);
 
-    /* Get file attributes. */
-    status = fatx_get_attr(fs, path, &attr);
+    /* Find the directory entry of the file. */
+    path_dirname = fatx_dirname(path);
+    status = fatx_open_dir(fs, path_dirname, &file->dir);
+    free(path_dirname);
     if (status) return status;
 
-    if (offset >= attr.file_size)
+    path_basename = fatx_basename(path);
+    status = fatx_get_attr_dir(fs, path_basename, &file->dir, &dirent, &file->attr);
+    free(path_basename);
+    if (status) return status;
+
+    fatx_file_track(fs, file);
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Open the file whose directory entry is at dir, as found by fatx_lookup or
+ * a directory iterator, without resolving a path.
+ */
+static int fatx_file_open_at_locked(struct fatx_fs *fs, struct fatx_dir const *dir, struct fatx_file *file)
+{
+    struct fatx_dirent dirent, *result;
+    int status;
+
+    fatx_debug(fs, "fatx_file_open_at(cluster=%zd, entry=%zd)\n", dir->cluster, dir->entry);
+
+    file->dir = *dir;
+    status = fatx_read_dir(fs, &file->dir, &dirent, &file->attr, &result);
+    if (status == FATX_STATUS_FILE_DELETED || status == FATX_STATUS_END_OF_DIR)
+    {
+        return FATX_STATUS_FILE_NOT_FOUND;
+    }
+    if (status) return status;
+
+    fatx_file_track(fs, file);
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Read from an open file
+ *
+ * Returns the number of bytes read.
+ * Returns 0 on EOF.
+ */
+static int fatx_file_pread_locked(struct fatx_fs *fs, struct fatx_file *file, off_t offset, size_t size, void *buf)
+{
+    size_t total_bytes_read, bytes_to_read;
+    size_t file_cluster, cluster, contiguous;
+    size_t cluster_offset;
+    struct fatx_dev_batch batch;
+    uint64_t pos;
+    int status;
+
+    fatx_debug(fs, "fatx_file_pread(file=%s, offset=0x%zx, size=0x%zx, buf=%p)\n", file->attr.filename, offset, size, buf);
+
+    if (offset >= file->attr.file_size)
     {
         fatx_error(fs, "eof\n");
         return 0;
     }
 
-    /* Find the cluster, device byte offset containing the file offset. */
-    status = fatx_find_cluster_for_file_offset(fs, &attr, offset, &cluster);
-    if (status) return 0;
+    size = MIN(size, file->attr.file_size - offset);
+
+    total_bytes_read = 0;
+    fatx_dev_batch_init(&batch);
+
+    while (total_bytes_read < size)
+    {
+        /* Find the cluster holding the current offset, and how many follow it on disk. */
+        file_cluster   = (offset + total_bytes_read) / fs->bytes_per_cluster;
+        cluster_offset = (offset + total_bytes_read) % fs->bytes_per_cluster;
+
+        status = fatx_file_lookup(fs, file, file_cluster, &cluster, &contiguous);
+        if (status)
+        {
+            fatx_error(fs, "expected another cluster\n");
+            return status;
+        }
+
+        /* Read as much as is contiguous on the device at once. */
+        bytes_to_read = MIN(contiguous * fs->bytes_per_cluster - cluster_offset, size - total_bytes_read);
+
+        status = fatx_cluster_number_to_byte_offset(fs, cluster, &pos);
+        if (status) return status;
+
+        /* Fragments are queued up and read together. */
+        status = fatx_dev_batch_add(fs, &batch, false, buf, bytes_to_read, pos + cluster_offset);
+        if (status)
+        {
+            fatx_error(fs, "failed to read from device\n");
+            return status;
+        }
+
+        total_bytes_read += bytes_to_read;
+        buf = (uint8_t *)buf + bytes_to_read;
+    }
+
+    status = fatx_dev_batch_submit(fs, &batch);
+    if (status)
+    {
+        fatx_error(fs, "failed to read from device\n");
+        return status;
+    }
 
-    /* Seek to the offset. */
-    cluster_offset = offset % fs->bytes_per_cluster;
-    status = fatx_dev_seek_cluster(fs, cluster, cluster_offset);
+    fatx_debug(fs, "bytes read: %zx\n", total_bytes_read);
+
+    return total_bytes_read;
+}
+
+/*
+ * Make sure that the clusters for size bytes at offset are allocated before
+ * they are written, extending the file with zeros if offset is past its end.
+ * The file size is not changed.
+ */
+static int fatx_file_reserve(struct fatx_fs *fs, struct fatx_file *file, off_t offset, size_t size)
+{
+    size_t clusters_needed, last_cluster;
+    struct fatx_extent_map *map;
+    int status;
+
+    /* If the file offset is past the end of the file, extend the file up to it */
+    if (offset > file->attr.file_size)
+    {
+        status = fatx_resize_chain(fs, &file->attr, offset);
+        if (status) return status;
+        file->dirty = true;
+    }
+
+    /*
+     * Allocate the clusters for the rest of the write at once. They are
+     * about to be overwritten, so only a partially written last cluster
+     * needs to be zeroed.
+     */
+    clusters_needed = (offset + size + fs->bytes_per_cluster - 1) / fs->bytes_per_cluster;
+    if (clusters_needed > (file->attr.file_size + fs->bytes_per_cluster - 1) / fs->bytes_per_cluster)
+    {
+        last_cluster = 0;
+
+        if (file->attr.first_cluster == 0)
+        {
+            /* Empty files are created without clusters, so this is the first write. */
+            fatx_debug(fs, "allocating first clusters\n");
+
+            status = fatx_alloc_clusters(fs, 0, clusters_needed, false, &file->attr.first_cluster, &last_cluster);
+            if (status) return status;
+
+            file->dirty = true;
+        }
+        else
+        {
+            status = fatx_extent_map_get(fs, file->attr.first_cluster, &map);
+            if (status)
+            {
+                fatx_error(fs, "failed to find cluster for offset\n");
+                return status;
+            }
+
+            if (clusters_needed > map->num_clusters)
+            {
+                fatx_debug(fs, "EOF, allocating new clusters\n");
+
+                status = fatx_alloc_clusters(fs, fatx_extent_map_last_cluster(map), clusters_needed - map->num_clusters, false, NULL, &last_cluster);
+                if (status) return status;
+            }
+        }
+
+        if (last_cluster && (offset + size) % fs->bytes_per_cluster)
+        {
+            status = fatx_zero_clusters(fs, last_cluster, 1);
+            if (status) return status;
+        }
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Record that size bytes were written at offset, growing the file to hold
+ * them and updating its modification time.
+ */
+static void fatx_file_wrote(struct fatx_fs *fs, struct fatx_file *file, off_t offset, size_t size)
+{
+    /* Update file size if it has increased. */
+    if (offset + size > file->attr.file_size)
+    {
+        file->attr.file_size = offset + size;
+    }
+
+    fatx_time_t_to_fatx_ts(time(NULL), &file->attr.modified);
+    file->dirty = true;
+    fatx_file_share_attr(fs, file);
+}
+
+/*
+ * Write to an open file
+ *
+ * Returns the number of bytes written. The new size and modification time
+ * are written to the directory entry when the file is synced or closed.
+ */
+static int fatx_file_pwrite_locked(struct fatx_fs *fs, struct fatx_file *file, off_t offset, size_t size, const void *buf)
+{
+    size_t total_bytes_written, bytes_to_write;
+    size_t file_cluster, cluster, contiguous;
+    size_t cluster_offset;
+    struct fatx_dev_batch batch;
+    uint64_t pos;
+    int status;
+
+    fatx_debug(fs, "fatx_file_pwrite(file=%s, offset=0x%zx, size=0x%zx, buf=%p)\n", file->attr.filename, offset, size, buf);
+
+    if (fatx_check_writable(fs)) return FATX_STATUS_ERROR;
+
+    if (size == 0)
+    {
+        return 0;
+    }
+
+    status = fatx_file_reserve(fs, file, offset, size);
     if (status) return status;
 
-    total_bytes_read = 0;
-    bytes_remaining_in_file = attr.file_size - offset;
+    total_bytes_written = 0;
+    fatx_dev_batch_init(&batch);
+
+    while (total_bytes_written < size)
+    {
+        /* Find the cluster holding the current offset, and how many follow it on disk. */
+        file_cluster   = (offset + total_bytes_written) / fs->bytes_per_cluster;
+        cluster_offset = (offset + total_bytes_written) % fs->bytes_per_cluster;
+
+        status = fatx_file_lookup(fs, file, file_cluster, &cluster, &contiguous);
+        if (status)
+        {
+            fatx_error(fs, "expected another cluster\n");
+            return status;
+        }
+
+        /* Write as much as is contiguous on the device at once. */
+        bytes_to_write = MIN(contiguous * fs->bytes_per_cluster - cluster_offset, size - total_bytes_written);
+
+        status = fatx_cluster_number_to_byte_offset(fs, cluster, &pos);
+        if (status) return status;
+
+        /* Fragments are queued up and written together. */
+        status = fatx_dev_batch_add(fs, &batch, true, (void *)buf, bytes_to_write, pos + cluster_offset);
+        if (status)
+        {
+            fatx_error(fs, "failed to write to device\n");
+            return status;
+        }
+
+        total_bytes_written += bytes_to_write;
+        buf = (const uint8_t *)buf + bytes_to_write;
+    }
+
+    status = fatx_dev_batch_submit(fs, &batch);
+    if (status)
+    {
+        fatx_error(fs, "failed to write to device\n");
+        return status;
+    }
+
+    fatx_debug(fs, "bytes written: %zx\n", total_bytes_written);
+
+    fatx_file_wrote(fs, file, offset, size);
+
+    return total_bytes_written;
+}
+
+/*
+ * Find where a range of an open file is stored on the device, so that its
+ * data can be transferred through fatx_device_fd(...) without a copy. Up to
+ * *num_spans spans are filled in, in file order, and *num_spans is set to
+ * the number used.
+ *
+ * For reading, the range is cut off at the end of the file. For writing,
+ * the clusters for the whole range are allocated first, and
+ * fatx_file_mark_written(...) must be called once the data is on the
+ * device. The spans are only valid until the file is next truncated, or
+ * until its last handle is closed once it was removed.
+ *
+ * Returns the number of bytes mapped, which is less than size at the end
+ * of the file or when the spans run out.
+ */
+static int fatx_file_map_locked(struct fatx_fs *fs, struct fatx_file *file, off_t offset, size_t size, bool write, struct fatx_file_span *spans, size_t *num_spans)
+{
+    size_t total_bytes_mapped, bytes_to_map, max_spans;
+    size_t file_cluster, cluster, contiguous;
+    size_t cluster_offset;
+    uint64_t pos;
+    int status;
 
-    while (1)
-    {
-        size_t bytes_to_read;
-        size_t bytes_read;
+    fatx_debug(fs, "fatx_file_map(file=%s, offset=0x%zx, size=0x%zx, write=%d)\n", file->attr.filename, offset, size, write);
 
-        if (bytes_remaining_in_file == 0)
-        {
-            fatx_error(fs, "eof 0\n");
-            break;
-        }
+    max_spans  = *num_spans;
+    *num_spans = 0;
 
-        bytes_to_read = MIN(fs->bytes_per_cluster - cluster_offset, size-total_bytes_read);
-        bytes_to_read = MIN(bytes_to_read, bytes_remaining_in_file);
+    if (write && fatx_check_writable(fs)) return FATX_STATUS_ERROR;
 
-        if (bytes_to_read == 0)
+    if (write)
+    {
+        if (size == 0)
         {
-            fatx_error(fs, "eof 1\n");
-            break;
+            return 0;
         }
 
-        /* Read from current cluster. */
-        bytes_read = fatx_dev_read(fs, buf, 1, bytes_to_read);
-        if (bytes_read == 0)
+        status = fatx_file_reserve(fs, file, offset, size);
+        if (status) return status;
+    }
+    else
+    {
+        if (offset >= file->attr.file_size)
         {
-            fatx_error(fs, "failed to read from device\n");
-            return FATX_STATUS_ERROR;
+            return 0;
         }
 
-        total_bytes_read += bytes_read;
-        bytes_remaining_in_file -= bytes_read;
-        buf = (uint8_t *)buf + bytes_read;
-        cluster_offset += bytes_read;
+        size = MIN(size, file->attr.file_size - offset);
+    }
+
+    total_bytes_mapped = 0;
+
+    while (total_bytes_mapped < size && *num_spans < max_spans)
+    {
+        file_cluster   = (offset + total_bytes_mapped) / fs->bytes_per_cluster;
+        cluster_offset = (offset + total_bytes_mapped) % fs->bytes_per_cluster;
 
-        if (bytes_remaining_in_file == 0)
+        status = fatx_file_lookup(fs, file, file_cluster, &cluster, &contiguous);
+        if (status)
         {
-            fatx_error(fs, "eof 2\n");
-            break;
+            fatx_error(fs, "expected another cluster\n");
+            return status;
         }
 
-        /* Move to next cluster? */
-        fatx_debug(fs, "cluster offset = %zx\n", cluster_offset);
-        if (cluster_offset >= fs->bytes_per_cluster)
-        {
-            fatx_debug(fs, "looking for next cluster...\n");
-            status = fatx_get_next_cluster(fs, &cluster);
-            if (status)
-            {
-                fatx_error(fs, "expected another cluster\n");
-                return status;
-            }
+        bytes_to_map = MIN(contiguous * fs->bytes_per_cluster - cluster_offset, size - total_bytes_mapped);
 
-            status = fatx_dev_seek_cluster(fs, cluster, 0);
-            if (status) return status;
+        status = fatx_cluster_number_to_byte_offset(fs, cluster, &pos);
+        if (status) return status;
 
-            cluster_offset = 0;
-        }
+        spans[*num_spans].offset = pos + cluster_offset;
+        spans[*num_spans].size   = bytes_to_map;
+        (*num_spans)++;
+
+        total_bytes_mapped += bytes_to_map;
     }
 
-    fatx_debug(fs, "bytes read: %zx\n", total_bytes_read);
+    return total_bytes_mapped;
+}
 
-    return total_bytes_read;
+/*
+ * Finish a write made to the spans found by fatx_file_map(...), once size
+ * bytes of data are on the device at offset.
+ */
+static int fatx_file_mark_written_locked(struct fatx_fs *fs, struct fatx_file *file, off_t offset, size_t size)
+{
+    if (size)
+    {
+        fatx_file_wrote(fs, file, offset, size);
+    }
+
+    return FATX_STATUS_SUCCESS;
 }
 
 /*
- * Write to a file
- *
- * Returns the number of bytes written.
+ * Write the changes made through an open file to the device.
  */
-int fatx_write(struct fatx_fs *fs, char const *path, off_t offset, size_t size, const void *buf)
+static int fatx_file_fsync_locked(struct fatx_fs *fs, struct fatx_file *file)
 {
-    size_t total_bytes_written;
-    size_t cluster;
-    off_t cluster_offset;
-    struct fatx_attr attr;
     int status;
 
-    fatx_debug(fs, "fatx_write(path=\"%s\", offset=0x%zx, size=0x%zx, buf=%p)\n", path, offset, size, buf);
-
-    /* Get file attributes. */
-    status = fatx_get_attr(fs, path, &attr);
-    if (status) return status;
+    fatx_debug(fs, "fatx_file_fsync(file=%s)\n", file->attr.filename);
 
-    /* If the file offset is invalid, truncate the file to the correct size */
-    if (offset > attr.file_size)
+    if (!file->dir.cluster)
     {
-        status = fatx_truncate(fs, path, offset+1);
-        if (status) return status;
-
-        /* Truncate modifies attr, so fetch it again */
-        status = fatx_get_attr(fs, path, &attr);
-        if (status) return status;
+        return FATX_STATUS_SUCCESS;
     }
 
-    /* Find the cluster, device byte offset containing the file offset. */
-    status = fatx_find_cluster_for_file_offset_alloc(fs, &attr, offset, &cluster, true);
-    if (status)
+    status = fatx_file_write_attr(fs, file);
+    if (status) return status;
+
+    if (fs->open_flags & FATX_OPEN_READ_ONLY)
     {
-        fatx_error(fs, "failed to find cluster for offset\n");
-        return 0;
+        return FATX_STATUS_SUCCESS;
     }
 
-    /* Seek to the offset. */
-    cluster_offset = offset % fs->bytes_per_cluster;
-    status = fatx_dev_seek_cluster(fs, cluster, cluster_offset);
+    status = fatx_flush_dir_cache(fs);
     if (status) return status;
 
-    total_bytes_written = 0;
+    status = fatx_flush_fat_cache(fs);
+    if (status) return status;
 
-    while (1)
-    {
-        size_t bytes_to_write;
-        size_t bytes_written;
+    return fatx_dev_flush(fs);
+}
 
-        /* Careful not to overflow */
-        bytes_to_write = MIN(fs->bytes_per_cluster - cluster_offset, size - total_bytes_written);
+/*
+ * Close an open file, writing its new size and modification time to its
+ * directory entry. Closing the last handle of a removed file frees its
+ * clusters.
+ */
+static int fatx_file_close_locked(struct fatx_fs *fs, struct fatx_file *file)
+{
+    struct fatx_file **link;
+    int status = FATX_STATUS_SUCCESS;
 
-        /* Write to the current cluster if we have space. */
-        if (bytes_to_write > 0)
-        {
-            bytes_written = fatx_dev_write(fs, buf, 1, bytes_to_write);
-            if (bytes_written == 0)
-            {
-                fatx_error(fs, "failed to write to device\n");
-                return FATX_STATUS_ERROR;
-            }
+    fatx_debug(fs, "fatx_file_close(file=%s)\n", file->attr.filename);
 
-            total_bytes_written += bytes_written;
-            buf = (uint8_t *)buf + bytes_written;
-            cluster_offset += bytes_written;
-        }
+    if (file->dir.cluster)
+    {
+        status = fatx_file_write_attr(fs, file);
+    }
 
-        if (size - total_bytes_written == 0)
+    for (link = &fs->open_files; *link; link = &(*link)->next)
+    {
+        if (*link == file)
         {
-            fatx_debug(fs, "finished writing\n");
+            *link = file->next;
             break;
         }
+    }
+
+    file->next = NULL;
 
-        /* Move to next cluster? */
-        fatx_debug(fs, "cluster offset = %zx\n", cluster_offset);
-        if (cluster_offset >= fs->bytes_per_cluster)
+    if (!file->dir.cluster && file->attr.first_cluster && !fatx_file_is_open(fs, &file->dir))
+    {
+        if (fatx_free_cluster_chain(fs, file->attr.first_cluster))
         {
-            fatx_debug(fs, "looking for next cluster...\n");
-            status = fatx_get_next_cluster(fs, &cluster);
-            if (status)
-            {
-                fatx_debug(fs, "EOF, allocating new cluster\n");
+            status = FATX_STATUS_ERROR;
+        }
+    }
 
-                /* If we're going to write to the entire cluster, there's no need to zero it */
-                size_t new_cluster;
-                status = fatx_alloc_cluster(fs, &new_cluster, size - total_bytes_written < fs->bytes_per_cluster);
-                if (status) return status;
+    return status;
+}
 
-                status = fatx_attach_cluster(fs, cluster, new_cluster);
-                if (status) return status;
+/*
+ * Read from a file
+ *
+ * Returns the number of bytes read.
+ * Returns 0 on EOF.
+ */
+static int fatx_read_locked(struct fatx_fs *fs, char const *path, off_t offset, size_t size, void *buf)
+{
+    struct fatx_file file;
+    int status, bytes_read;
 
-                cluster = new_cluster;
-            }
+    fatx_debug(fs, "fatx_read(path=\"%s\", offset=0x%zx, size=0x%zx, buf=%p)\n", path, offset, size, buf);
 
-            status = fatx_dev_seek_cluster(fs, cluster, 0);
-            if (status) return status;
+    status = fatx_file_open(fs, path, &file);
+    if (status) return status;
 
-            cluster_offset = 0;
-        }
-    }
+    bytes_read = fatx_file_pread(fs, &file, offset, size, buf);
 
-    fatx_debug(fs, "bytes written: %zx\n", total_bytes_written);
+    status = fatx_file_close(fs, &file);
+    if (status) return status;
 
-    /* Update file size if it has increased. */
-    if(offset + size > attr.file_size)
-    {
-        attr.file_size += offset + size - attr.file_size;
-        status = fatx_set_attr(fs, path, &attr);
-        if (status) return status;
-    }
+    return bytes_read;
+}
 
-    return total_bytes_written;
+/*
+ * Write to a file
+ *
+ * Returns the number of bytes written.
+ */
+static int fatx_write_locked(struct fatx_fs *fs, char const *path, off_t offset, size_t size, const void *buf)
+{
+    struct fatx_file file;
+    int status, bytes_written;
+
+    fatx_debug(fs, "fatx_write(path=\"%s\", offset=0x%zx, size=0x%zx, buf=%p)\n", path, offset, size, buf);
+
+    if (fatx_check_writable(fs)) return FATX_STATUS_ERROR;
+
+    status = fatx_file_open(fs, path, &file);
+    if (status) return status;
+
+    bytes_written = fatx_file_pwrite(fs, &file, offset, size, buf);
+
+    status = fatx_file_close(fs, &file);
+    if (status) return status;
+
+    return bytes_written;
 }
 
 /*
  * Create a file.
  */
-int fatx_mknod(struct fatx_fs *fs, char const *path)
+static int fatx_mknod_locked(struct fatx_fs *fs, char const *path)
 {
     struct fatx_attr attr;
     struct fatx_dir dir;
@@ -319,6 +834,8 @@ int fatx_mknod(struct fatx_fs *fs, char const *path)
 
     fatx_debug(fs, "fatx_mknod(path=\"%s\")\n", path);
 
+    if (fatx_check_writable(fs)) return FATX_STATUS_ERROR;
+
     /* Check for existence */
     status = fatx_get_attr(fs, path, &attr);
     if (!status)
@@ -344,10 +861,12 @@ int fatx_mknod(struct fatx_fs *fs, char const *path)
 /*
  * Truncate a file to the specified size
  */
-int fatx_truncate(struct fatx_fs *fs, char const *path, off_t offset)
+static int fatx_truncate_locked(struct fatx_fs *fs, char const *path, off_t offset)
 {
     fatx_debug(fs, "fatx_truncate(path=\"%s\", offset=0x%zx)\n", path, offset);
 
+    if (fatx_check_writable(fs)) return FATX_STATUS_ERROR;
+
     struct fatx_attr attr;
     int status;
 
@@ -355,47 +874,11 @@ int fatx_truncate(struct fatx_fs *fs, char const *path, off_t offset)
     status = fatx_get_attr(fs, path, &attr);
     if (status) return status;
 
-    size_t enc_clusters = 1;
-    size_t cluster = attr.first_cluster;
-    while (enc_clusters * fs->bytes_per_cluster < offset)
-    {
-        status = fatx_get_next_cluster(fs, &cluster);
-        if (status == FATX_STATUS_ERROR)
-        {
-            /* Out of clusters, alloc more */
-            size_t new_cluster;
-            status = fatx_alloc_cluster(fs, &new_cluster, true);
-            if (status) return status;
-
-            status = fatx_attach_cluster(fs, cluster, new_cluster);
-            if (status) return status;
-
-            cluster = new_cluster;
-            ++enc_clusters;
-        }
-        else if (status == FATX_STATUS_SUCCESS)
-        {
-            /* Found next cluster, continue */
-            ++enc_clusters;
-        }
-        else return status;
-    }
-
-    /* If there are more clusters, then free them */
-    size_t next_cluster = cluster;
-    status = fatx_get_next_cluster(fs, &next_cluster);
-    if(status == FATX_STATUS_SUCCESS)
-    {
-        status = fatx_free_cluster_chain(fs, next_cluster);
-        if (status) return status;
-    }
-
-    /* Mark new end of cluster */
-    status = fatx_mark_cluster_end(fs, cluster);
+    /* Resize the cluster chain. */
+    status = fatx_resize_chain(fs, &attr, offset);
     if (status) return status;
 
     /* Now update the file size */
-    attr.file_size = offset;
     status = fatx_set_attr(fs, path, &attr);
     if (status) return status;
 
@@ -405,10 +888,12 @@ int fatx_truncate(struct fatx_fs *fs, char const *path, off_t offset)
 /*
  * Rename a file
  */
-int fatx_rename(struct fatx_fs *fs, char const *from, char const *to, bool exchange, bool no_replace)
+static int fatx_rename_locked(struct fatx_fs *fs, char const *from, char const *to, bool exchange, bool no_replace)
 {
     fatx_debug(fs, "fatx_rename(from=\"%s\", to=\"%s\")\n", from, to);
 
+    if (fatx_check_writable(fs)) return FATX_STATUS_ERROR;
+
     struct fatx_attr attr_from, attr_to;
     char *from_dirname = 0, *to_dirname = 0;
     char *from_basename = 0, *to_basename = 0;
@@ -473,7 +958,13 @@ int fatx_rename(struct fatx_fs *fs, char const *from, char const *to, bool excha
     }
     else if (status == FATX_STATUS_SUCCESS)
     {
-        if (no_replace)
+        if (!path_dif && fatx_name_match(fs, from_basename, to_basename, SIZE_MAX))
+        {
+            /* Both names refer to the same entry, only the case differs. */
+            strcpy(attr_from.filename, to_basename);
+            status = fatx_set_attr(fs, from, &attr_from);
+        }
+        else if (no_replace)
         {
             fatx_error(fs, "destination name already exists and no_replace was set\n");
             status = FATX_STATUS_ERROR;
@@ -509,3 +1000,158 @@ done:
     if (from_basename) free(from_basename);
     return status;
 }
+
+/*
+ * Entry points, which hold the filesystem lock around the functions above.
+ * Reads of an open file only hold it shared.
+ */
+int fatx_file_open(struct fatx_fs *fs, char const *path, struct fatx_file *file)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_file_open_locked(fs, path, file);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_file_open_at(struct fatx_fs *fs, struct fatx_dir const *dir, struct fatx_file *file)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_file_open_at_locked(fs, dir, file);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_file_pread(struct fatx_fs *fs, struct fatx_file *file, off_t offset, size_t size, void *buf)
+{
+    int status;
+
+    fatx_lock_shared(fs);
+    status = fatx_file_pread_locked(fs, file, offset, size, buf);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_file_pwrite(struct fatx_fs *fs, struct fatx_file *file, off_t offset, size_t size, const void *buf)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_file_pwrite_locked(fs, file, offset, size, buf);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_file_map(struct fatx_fs *fs, struct fatx_file *file, off_t offset, size_t size, bool write, struct fatx_file_span *spans, size_t *num_spans)
+{
+    int status;
+
+    /* Mapping for a write may allocate clusters. */
+    if (write)
+    {
+        fatx_lock(fs);
+    }
+    else
+    {
+        fatx_lock_shared(fs);
+    }
+    status = fatx_file_map_locked(fs, file, offset, size, write, spans, num_spans);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_file_mark_written(struct fatx_fs *fs, struct fatx_file *file, off_t offset, size_t size)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_file_mark_written_locked(fs, file, offset, size);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_file_fsync(struct fatx_fs *fs, struct fatx_file *file)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_file_fsync_locked(fs, file);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_file_close(struct fatx_fs *fs, struct fatx_file *file)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_file_close_locked(fs, file);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_read(struct fatx_fs *fs, char const *path, off_t offset, size_t size, void *buf)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_read_locked(fs, path, offset, size, buf);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_write(struct fatx_fs *fs, char const *path, off_t offset, size_t size, const void *buf)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_write_locked(fs, path, offset, size, buf);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_mknod(struct fatx_fs *fs, char const *path)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_mknod_locked(fs, path);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_truncate(struct fatx_fs *fs, char const *path, off_t offset)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_truncate_locked(fs, path, offset);
+    fatx_unlock(fs);
+
+    return status;
+}
+
+int fatx_rename(struct fatx_fs *fs, char const *from, char const *to, bool exchange, bool no_replace)
+{
+    int status;
+
+    fatx_lock(fs);
+    status = fatx_rename_locked(fs, from, to, exchange, no_replace);
+    fatx_unlock(fs);
+
+    return status;
+}
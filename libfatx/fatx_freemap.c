@@ -0,0 +1,481 @@
+/*
+ * FATX Filesystem Library
+ *
+ * Copyright (C) 2015  Matt Borgerson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A bitmap of the free clusters in the FAT.
+ *
+ * Bit N of the map is set when cluster N is available. A second level
+ * summary map has one bit per word of the first level, set when that word
+ * has any free cluster in it, so that finding a free cluster only has to
+ * look at one summary bit per 64 clusters no matter how full the partition
+ * is.
+ */
+
+#include "fatx_internal.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+/* Clusters below this are never handed out by the allocator. */
+#define FATX_FREE_MAP_FIRST_CLUSTER 2
+
+/* How many free runs an allocation looks at for one that is long enough. */
+#define FATX_FREE_MAP_SEARCH_RUNS 4096
+
+/* How much of the FAT is read at a time when building the map. */
+#define FATX_FREE_MAP_SCAN_SIZE (1024*1024)
+
+/*
+ * Find the index of the lowest set bit in a non-zero word.
+ */
+static unsigned int fatx_free_map_ffs(uint64_t word)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctzll(word);
+#elif defined(_MSC_VER) && defined(_WIN64)
+    unsigned long index;
+    _BitScanForward64(&index, word);
+    return index;
+#else
+    unsigned int index = 0;
+    while (!(word & 1))
+    {
+        word >>= 1;
+        index++;
+    }
+    return index;
+#endif
+}
+
+/*
+ * Count the set bits in a word.
+ */
+static unsigned int fatx_free_map_popcount(uint64_t word)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_popcountll(word);
+#else
+    unsigned int count = 0;
+    while (word)
+    {
+        word &= word - 1;
+        count++;
+    }
+    return count;
+#endif
+}
+
+static size_t fatx_free_map_summary_words(struct fatx_free_map *map)
+{
+    return (map->num_words + 63) / 64;
+}
+
+/*
+ * Mark a cluster as free or in use.
+ */
+void fatx_free_map_update(struct fatx_fs *fs, size_t cluster, bool free)
+{
+    struct fatx_free_map *map = &fs->free_map;
+    size_t word = cluster / 64;
+    uint64_t bit = (uint64_t)1 << (cluster % 64);
+
+    if (!map->bits || cluster < FATX_FREE_MAP_FIRST_CLUSTER || cluster >= fs->num_clusters)
+    {
+        return;
+    }
+
+    if (free && !(map->bits[word] & bit))
+    {
+        map->bits[word] |= bit;
+        map->summary[word / 64] |= (uint64_t)1 << (word % 64);
+        map->num_free++;
+    }
+    else if (!free && (map->bits[word] & bit))
+    {
+        map->bits[word] &= ~bit;
+        if (!map->bits[word])
+        {
+            map->summary[word / 64] &= ~((uint64_t)1 << (word % 64));
+        }
+        map->num_free--;
+    }
+}
+
+/*
+ * Fill in a whole word of an empty map at once.
+ */
+static void fatx_free_map_set_word(struct fatx_free_map *map, size_t word, uint64_t bits)
+{
+    if (!bits)
+    {
+        return;
+    }
+
+    map->bits[word] = bits;
+    map->summary[word / 64] |= (uint64_t)1 << (word % 64);
+    map->num_free += fatx_free_map_popcount(bits);
+}
+
+/*
+ * Mark every allocatable cluster as free, as in a freshly initialized FAT.
+ */
+void fatx_free_map_reset(struct fatx_fs *fs)
+{
+    struct fatx_free_map *map = &fs->free_map;
+    size_t cluster;
+
+    if (!map->bits)
+    {
+        return;
+    }
+
+    memset(map->bits, 0, map->num_words * sizeof(uint64_t));
+    memset(map->summary, 0, fatx_free_map_summary_words(map) * sizeof(uint64_t));
+    map->num_free = 0;
+    map->cursor   = FATX_FREE_MAP_FIRST_CLUSTER;
+
+    for (cluster = FATX_FREE_MAP_FIRST_CLUSTER; cluster < fs->num_clusters; cluster++)
+    {
+        fatx_free_map_update(fs, cluster, true);
+    }
+}
+
+/*
+ * Build the free cluster map by scanning the FAT.
+ *
+ * This is done when the device is opened, before anything has been written
+ * through the FAT cache, so the FAT is read directly from the device in
+ * large chunks (or straight from the mapping, if the device is mapped).
+ *
+ * A partition opened for formatting is not scanned. Its map starts out with
+ * no free clusters, and fatx_init_fat() resets it once the FAT is wiped.
+ */
+int fatx_free_map_init(struct fatx_fs *fs)
+{
+    struct fatx_free_map *map = &fs->free_map;
+    size_t entry_size, chunk_entries, num_entries, cluster, i, j, n;
+    const void *entries;
+    uint64_t bits;
+    uint64_t offset;
+    uint8_t *chunk;
+    int retval = FATX_STATUS_SUCCESS;
+
+    fatx_debug(fs, "fatx_free_map_init()\n");
+
+    memset(map, 0, sizeof(*map));
+    map->num_words = (fs->num_clusters + 63) / 64;
+    map->cursor    = FATX_FREE_MAP_FIRST_CLUSTER;
+    map->bits      = calloc(map->num_words, sizeof(uint64_t));
+    map->summary   = calloc(fatx_free_map_summary_words(map), sizeof(uint64_t));
+
+    entry_size    = fs->fat_type == FATX_FAT_TYPE_16 ? 2 : 4;
+    chunk_entries = FATX_FREE_MAP_SCAN_SIZE / entry_size;
+    chunk         = malloc(FATX_FREE_MAP_SCAN_SIZE);
+
+    if (!map->bits || !map->summary || !chunk)
+    {
+        fatx_error(fs, "failed to allocate memory for free cluster map\n");
+        retval = FATX_STATUS_ERROR;
+        goto cleanup;
+    }
+
+    if (fs->open_flags & FATX_OPEN_FORMAT)
+    {
+        goto cleanup;
+    }
+
+    for (cluster = 0; cluster < fs->num_clusters; cluster += chunk_entries)
+    {
+        num_entries = MIN(chunk_entries, fs->num_clusters - cluster);
+        offset      = fs->fat_offset + (uint64_t)cluster * entry_size;
+
+        /* Scan a memory mapped FAT in place. */
+        entries = fatx_dev_map_ptr(fs, offset, num_entries * entry_size);
+        if (!entries)
+        {
+            if (fatx_dev_read_at(fs, chunk, num_entries * entry_size, offset))
+            {
+                fatx_error(fs, "failed to read FAT at cluster %zd\n", cluster);
+                retval = FATX_STATUS_ERROR;
+                goto cleanup;
+            }
+            entries = chunk;
+        }
+
+        /*
+         * Chunks start on a word boundary, so each run of 64 entries becomes
+         * one word of the map. Available clusters are the zero entries, and
+         * the comparisons have no branches for the compiler to trip over.
+         */
+        for (i = 0; i < num_entries; i += 64)
+        {
+            n    = MIN(64, num_entries - i);
+            bits = 0;
+
+            if (fs->fat_type == FATX_FAT_TYPE_16)
+            {
+                for (j = 0; j < n; j++)
+                {
+                    bits |= (uint64_t)(((const uint16_t *)entries)[i + j] == 0) << j;
+                }
+            }
+            else
+            {
+                for (j = 0; j < n; j++)
+                {
+                    bits |= (uint64_t)(((const uint32_t *)entries)[i + j] == 0) << j;
+                }
+            }
+
+            if (cluster + i == 0)
+            {
+                bits &= ~(((uint64_t)1 << FATX_FREE_MAP_FIRST_CLUSTER) - 1);
+            }
+
+            fatx_free_map_set_word(map, (cluster + i) / 64, bits);
+        }
+    }
+
+    fatx_debug(fs, "%zd of %d clusters are free\n", map->num_free, fs->num_clusters);
+
+cleanup:
+    free(chunk);
+    if (retval)
+    {
+        fatx_free_map_free(fs);
+    }
+    return retval;
+}
+
+/*
+ * Release the memory held by the free cluster map.
+ */
+void fatx_free_map_free(struct fatx_fs *fs)
+{
+    free(fs->free_map.bits);
+    free(fs->free_map.summary);
+    memset(&fs->free_map, 0, sizeof(fs->free_map));
+}
+
+/*
+ * Find the first word at or after start which has a free cluster in it,
+ * without wrapping around.
+ */
+static bool fatx_free_map_find_word(struct fatx_free_map *map, size_t start, size_t *word)
+{
+    size_t index = start / 64;
+    uint64_t summary;
+
+    if (start >= map->num_words)
+    {
+        return false;
+    }
+
+    summary = map->summary[index] & (~(uint64_t)0 << (start % 64));
+
+    while (!summary)
+    {
+        if (++index >= fatx_free_map_summary_words(map))
+        {
+            return false;
+        }
+        summary = map->summary[index];
+    }
+
+    *word = index * 64 + fatx_free_map_ffs(summary);
+    return true;
+}
+
+/*
+ * Find a free cluster, starting the search from the allocation cursor. The
+ * cluster is not marked as used; that happens when its FAT entry is written.
+ */
+int fatx_free_map_find(struct fatx_fs *fs, size_t *cluster)
+{
+    struct fatx_free_map *map = &fs->free_map;
+    size_t start, word;
+    uint64_t bits;
+
+    if (!map->num_free)
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    start = map->cursor;
+    if (start >= fs->num_clusters)
+    {
+        start = FATX_FREE_MAP_FIRST_CLUSTER;
+    }
+
+    /* Check the remainder of the word the cursor is in first. */
+    word = start / 64;
+    bits = map->bits[word] & (~(uint64_t)0 << (start % 64));
+
+    if (!bits)
+    {
+        if (!fatx_free_map_find_word(map, word + 1, &word) &&
+            !fatx_free_map_find_word(map, 0, &word))
+        {
+            return FATX_STATUS_ERROR;
+        }
+        bits = map->bits[word];
+    }
+
+    *cluster    = word * 64 + fatx_free_map_ffs(bits);
+    map->cursor = *cluster + 1;
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Find the first free cluster at or after from, without wrapping around.
+ */
+static bool fatx_free_map_next_free(struct fatx_fs *fs, size_t from, size_t *cluster)
+{
+    struct fatx_free_map *map = &fs->free_map;
+    size_t word = from / 64;
+    uint64_t bits;
+
+    if (from >= fs->num_clusters)
+    {
+        return false;
+    }
+
+    bits = map->bits[word] & (~(uint64_t)0 << (from % 64));
+
+    if (!bits)
+    {
+        if (!fatx_free_map_find_word(map, word + 1, &word))
+        {
+            return false;
+        }
+        bits = map->bits[word];
+    }
+
+    *cluster = word * 64 + fatx_free_map_ffs(bits);
+    return true;
+}
+
+/*
+ * Count the free clusters from cluster onwards, up to max_count.
+ */
+static size_t fatx_free_map_run_length(struct fatx_fs *fs, size_t cluster, size_t max_count)
+{
+    struct fatx_free_map *map = &fs->free_map;
+    size_t count, shift, ones, take;
+    uint64_t inverted;
+
+    count = 0;
+
+    while (count < max_count && cluster < fs->num_clusters)
+    {
+        /* Count the free clusters from here to the next used one in this word. */
+        shift    = cluster % 64;
+        inverted = ~(map->bits[cluster / 64] >> shift);
+        ones     = inverted ? fatx_free_map_ffs(inverted) : 64;
+        ones     = MIN(ones, 64 - shift);
+
+        take = MIN(ones, max_count - count);
+        take = MIN(take, fs->num_clusters - cluster);
+
+        count   += take;
+        cluster += take;
+
+        if (take < 64 - shift)
+        {
+            break;
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Find a run of up to max_count contiguous free clusters.
+ *
+ * The free runs are looked at in order from the allocation cursor, wrapping
+ * around once, and the first one that can hold all max_count clusters is
+ * taken. So that a badly fragmented partition doesn't make every allocation
+ * walk the whole map, only FATX_FREE_MAP_SEARCH_RUNS runs are looked at;
+ * if none of them is long enough, the longest of them is taken instead.
+ */
+int fatx_free_map_find_run(struct fatx_fs *fs, size_t max_count, size_t *start, size_t *count)
+{
+    struct fatx_free_map *map = &fs->free_map;
+    size_t origin, pos, cluster, length, runs;
+    bool wrapped;
+
+    if (!map->num_free || max_count == 0)
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    origin = map->cursor;
+    if (origin < FATX_FREE_MAP_FIRST_CLUSTER || origin >= fs->num_clusters)
+    {
+        origin = FATX_FREE_MAP_FIRST_CLUSTER;
+    }
+
+    *count  = 0;
+    pos     = origin;
+    wrapped = false;
+
+    for (runs = 0; runs < FATX_FREE_MAP_SEARCH_RUNS; runs++)
+    {
+        if (!fatx_free_map_next_free(fs, pos, &cluster))
+        {
+            /* Ran off the end of the map, carry on from the start. */
+            if (wrapped ||
+                !fatx_free_map_next_free(fs, FATX_FREE_MAP_FIRST_CLUSTER, &cluster))
+            {
+                break;
+            }
+
+            wrapped = true;
+        }
+
+        if (wrapped && cluster >= origin)
+        {
+            break;
+        }
+
+        length = fatx_free_map_run_length(fs, cluster, max_count);
+        if (length > *count)
+        {
+            *start = cluster;
+            *count = length;
+        }
+
+        if (length == max_count)
+        {
+            break;
+        }
+
+        pos = cluster + length;
+    }
+
+    if (!*count)
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+    map->cursor = *start + *count;
+    return FATX_STATUS_SUCCESS;
+}
@@ -41,9 +41,46 @@
 /* Offset of the File Allocation Table (FAT). */
 #define FATX_FAT_OFFSET              4096
 
+/* Size of the FAT pages held by the FAT cache and tracked by the FAT mirror. */
+#define FATX_FAT_PAGE_SIZE           4096
+
 /* Number of reserved entries in the FAT. */
 #define FATX_FAT_RESERVED_ENTRIES_COUNT 1
 
+/* Number of files whose extent maps are cached. */
+#define FATX_EXTENT_CACHE_SIZE       32
+
+/* Number of path lookups remembered by the dentry cache. */
+#define FATX_DENTRY_CACHE_SIZE       1024
+
+/* Number of directories whose name index is kept. */
+#define FATX_DIR_INDEX_CACHE_SIZE    16
+
+/* Parent used to key dentries by their full path instead of by name. */
+#define FATX_DENTRY_PATH             ((size_t)-1)
+
+/* Number of directory clusters read ahead on a directory cache miss. */
+#define FATX_DIR_PREFETCH_CLUSTERS   8
+
+/* Number of device I/Os queued before a batch is submitted. */
+#define FATX_DEV_BATCH_SIZE          32
+
+/* Size of the page of zeros written out when a range can't be zeroed in place. */
+#define FATX_DEV_ZERO_PAGE_SIZE      0x10000
+
+/* Number of zero pages written with a single vectored write. */
+#define FATX_DEV_ZERO_IOVECS         16
+
+/* Number of bytes of FAT cleared between progress reports while formatting. */
+#define FATX_FORMAT_PROGRESS_CHUNK   0x1000000
+
+/*
+ * Open flag used internally to open a partition that is about to be
+ * formatted. The old FAT is not scanned for free clusters, as it is wiped
+ * right away.
+ */
+#define FATX_OPEN_FORMAT             (1u<<31)
+
 /* Markers used in the filename_size field of the directory entry. */
 #define FATX_DELETED_FILE_MARKER     0xe5
 #define FATX_END_OF_DIR_MARKER       0xff
@@ -131,6 +168,14 @@ struct fatx_raw_directory_entry {
 
 typedef uint32_t fatx_fat_entry;
 
+/*
+ * Device I/Os waiting to be submitted together.
+ */
+struct fatx_dev_batch {
+    struct fatx_dev_io ios[FATX_DEV_BATCH_SIZE];
+    size_t             count;
+};
+
 /* Partition Functions */
 int fatx_check_partition_signature(struct fatx_fs *fs);
 int fatx_init_superblock(struct fatx_fs *fs, size_t sectors_per_cluster);
@@ -138,14 +183,82 @@ int fatx_read_superblock(struct fatx_fs *fs);
 int fatx_write_superblock(struct fatx_fs *fs);
 
 /* Device Functions */
-int fatx_dev_seek(struct fatx_fs *fs, uint64_t offset);
-int fatx_dev_seek_cluster(struct fatx_fs *fs, size_t cluster, off_t offset);
-size_t fatx_dev_read(struct fatx_fs *fs, void *buf, size_t size, size_t items);
-size_t fatx_dev_write(struct fatx_fs *fs, const void *buf, size_t size, size_t items);
+int fatx_dev_open(struct fatx_fs *fs, struct fatx_open_options const *options);
+int fatx_dev_close(struct fatx_fs *fs);
+int fatx_dev_read_at(struct fatx_fs *fs, void *buf, size_t size, uint64_t offset);
+int fatx_dev_write_at(struct fatx_fs *fs, const void *buf, size_t size, uint64_t offset);
+int fatx_dev_flush(struct fatx_fs *fs);
+int fatx_dev_size(struct fatx_fs *fs, uint64_t *size);
+int fatx_dev_discard(struct fatx_fs *fs, uint64_t offset, uint64_t size);
+int fatx_dev_zero(struct fatx_fs *fs, uint64_t offset, uint64_t size);
+int fatx_dev_wipe(struct fatx_fs *fs, uint64_t offset, uint64_t size);
+int fatx_dev_read_cluster(struct fatx_fs *fs, void *buf, size_t size, size_t cluster, size_t offset);
+int fatx_dev_write_cluster(struct fatx_fs *fs, const void *buf, size_t size, size_t cluster, size_t offset);
+int fatx_dev_submit(struct fatx_fs *fs, struct fatx_dev_io *ios, size_t count);
+void fatx_dev_batch_init(struct fatx_dev_batch *batch);
+int fatx_dev_batch_add(struct fatx_fs *fs, struct fatx_dev_batch *batch, bool write, void *buf, size_t size, uint64_t offset);
+int fatx_dev_batch_submit(struct fatx_fs *fs, struct fatx_dev_batch *batch);
+int fatx_dev_map(struct fatx_fs *fs);
+const void *fatx_dev_map_ptr(struct fatx_fs *fs, uint64_t offset, size_t size);
+int fatx_dev_fd(struct fatx_fs *fs);
+
+/* Cache Functions */
+int fatx_cache_init(struct fatx_fs *fs, struct fatx_cache *cache, uint64_t offset, size_t block_size, size_t num_blocks);
+void fatx_cache_free(struct fatx_cache *cache);
+void fatx_cache_reset(struct fatx_cache *cache);
+int fatx_cache_get(struct fatx_fs *fs, struct fatx_cache *cache, size_t block, bool write, void **data);
+int fatx_cache_flush(struct fatx_fs *fs, struct fatx_cache *cache);
+bool fatx_cache_contains(struct fatx_cache *cache, size_t block);
+void fatx_cache_invalidate(struct fatx_cache *cache, size_t block);
+int fatx_cache_prefetch(struct fatx_fs *fs, struct fatx_cache *cache, size_t const *blocks, size_t count);
+
+/* Free Cluster Map */
+int fatx_free_map_init(struct fatx_fs *fs);
+void fatx_free_map_free(struct fatx_fs *fs);
+void fatx_free_map_reset(struct fatx_fs *fs);
+void fatx_free_map_update(struct fatx_fs *fs, size_t cluster, bool free);
+int fatx_free_map_find(struct fatx_fs *fs, size_t *cluster);
+int fatx_free_map_find_run(struct fatx_fs *fs, size_t max_count, size_t *start, size_t *count);
+
+/* Extent Map Functions */
+int fatx_extent_cache_init(struct fatx_fs *fs);
+void fatx_extent_cache_free(struct fatx_fs *fs);
+void fatx_extent_cache_reset(struct fatx_fs *fs);
+int fatx_extent_map_get(struct fatx_fs *fs, size_t first_cluster, struct fatx_extent_map **result);
+int fatx_extent_map_lookup(struct fatx_extent_map *map, size_t file_cluster, size_t *cluster, size_t *contiguous);
+size_t fatx_extent_map_last_cluster(struct fatx_extent_map *map);
+void fatx_extent_cache_append(struct fatx_fs *fs, size_t tail, size_t cluster, size_t count);
+void fatx_extent_cache_truncate(struct fatx_fs *fs, size_t first_cluster, size_t num_clusters);
+void fatx_extent_cache_invalidate(struct fatx_fs *fs, size_t first_cluster);
+
+/* Dentry Cache Functions */
+int fatx_dentry_cache_init(struct fatx_fs *fs);
+void fatx_dentry_cache_free(struct fatx_fs *fs);
+void fatx_dentry_cache_reset(struct fatx_fs *fs);
+char *fatx_dentry_path(char const *dirname, char const *basename);
+int fatx_dentry_lookup(struct fatx_fs *fs, size_t parent, char const *name, char const *filename, struct fatx_dir *dir, struct fatx_dirent *dirent, struct fatx_attr *attr);
+void fatx_dentry_insert(struct fatx_fs *fs, size_t parent, char const *name, struct fatx_dir const *dir);
+void fatx_dentry_forget_name(struct fatx_fs *fs, size_t parent, char const *name);
+void fatx_dentry_forget_path(struct fatx_fs *fs, char const *dirname, char const *basename);
+void fatx_dentry_forget_parent(struct fatx_fs *fs, size_t parent);
+
+/* Directory Index Functions */
+int fatx_dir_index_init(struct fatx_fs *fs);
+void fatx_dir_index_free(struct fatx_fs *fs);
+void fatx_dir_index_reset(struct fatx_fs *fs);
+int fatx_dir_index_lookup(struct fatx_fs *fs, size_t first_cluster, char const *name, struct fatx_dir *dir, struct fatx_dirent *dirent, struct fatx_attr *attr);
+void fatx_dir_index_add(struct fatx_fs *fs, size_t first_cluster, char const *name, struct fatx_dir const *dir);
+void fatx_dir_index_remove(struct fatx_fs *fs, size_t first_cluster, char const *name, struct fatx_dir const *dir);
+void fatx_dir_index_invalidate(struct fatx_fs *fs, size_t first_cluster);
+int fatx_dir_index_get_free(struct fatx_fs *fs, size_t first_cluster, struct fatx_dir *dir, bool *at_end, size_t *tail_cluster);
+void fatx_dir_index_add_free(struct fatx_fs *fs, size_t first_cluster, struct fatx_dir const *dir);
+void fatx_dir_index_set_end(struct fatx_fs *fs, size_t first_cluster, struct fatx_dir const *end, size_t tail_cluster);
 
 /* FAT Functions */
-int fatx_init_fat(struct fatx_fs *fs);
+int fatx_init_fat(struct fatx_fs *fs, void (*progress)(void *ctx, uint64_t done), void *progress_ctx);
 int fatx_init_root(struct fatx_fs *fs);
+int fatx_init_fat_cache(struct fatx_fs *fs, struct fatx_open_options const *options);
+void fatx_free_fat_cache(struct fatx_fs *fs);
 int fatx_flush_fat_cache(struct fatx_fs *fs);
 int fatx_read_fat(struct fatx_fs *fs, size_t index, fatx_fat_entry *entry);
 int fatx_write_fat(struct fatx_fs *fs, size_t index, fatx_fat_entry entry);
@@ -156,15 +269,45 @@ int fatx_mark_cluster_available(struct fatx_fs *fs, size_t cluster);
 int fatx_mark_cluster_end(struct fatx_fs *fs, size_t cluster);
 int fatx_free_cluster_chain(struct fatx_fs *fs, size_t first_cluster);
 int fatx_alloc_cluster(struct fatx_fs *fs, size_t *cluster, bool zero);
+int fatx_alloc_clusters(struct fatx_fs *fs, size_t tail, size_t count, bool zero, size_t *first, size_t *last);
+int fatx_zero_clusters(struct fatx_fs *fs, size_t start, size_t count);
 int fatx_attach_cluster(struct fatx_fs *fs, size_t tail, size_t cluster);
 
 /* Directory Functions */
-int fatx_dirent_to_attr(struct fatx_fs *fs, struct fatx_raw_directory_entry *entry, struct fatx_attr *attr);
+int fatx_init_dir_cache(struct fatx_fs *fs, struct fatx_open_options const *options);
+void fatx_free_dir_cache(struct fatx_fs *fs);
+int fatx_flush_dir_cache(struct fatx_fs *fs);
+void fatx_dir_cache_invalidate(struct fatx_fs *fs, size_t cluster);
+int fatx_dirent_to_attr(struct fatx_fs *fs, const struct fatx_raw_directory_entry *entry, struct fatx_attr *attr);
 int fatx_attr_to_dirent(struct fatx_fs *fs, struct fatx_attr *attr, struct fatx_raw_directory_entry *entry);
 int fatx_mark_dir_entry_deleted(struct fatx_fs *fs, struct fatx_dir *dir);
 int fatx_mark_end_of_dir(struct fatx_fs *fs, struct fatx_dir *dir);
 
+/* File Handle Functions */
+void fatx_file_attr_read(struct fatx_fs *fs, struct fatx_dir const *dir, struct fatx_attr *attr);
+void fatx_file_attr_written(struct fatx_fs *fs, struct fatx_dir const *dir, struct fatx_attr const *attr);
+bool fatx_file_is_open(struct fatx_fs *fs, struct fatx_dir const *dir);
+void fatx_file_entry_removed(struct fatx_fs *fs, struct fatx_dir const *dir);
+void fatx_file_entry_swapped(struct fatx_fs *fs, struct fatx_dir const *dir1, struct fatx_dir const *dir2);
+int fatx_file_flush_all(struct fatx_fs *fs);
+
+/* Attribute Functions */
+int fatx_get_attr_dir(struct fatx_fs *fs, char const *start, struct fatx_dir *dir, struct fatx_dirent *dirent, struct fatx_attr *attr);
+
+/* Locking Functions */
+int fatx_lock_init(struct fatx_fs *fs);
+void fatx_lock_free(struct fatx_fs *fs);
+void fatx_lock(struct fatx_fs *fs);
+void fatx_lock_shared(struct fatx_fs *fs);
+void fatx_unlock(struct fatx_fs *fs);
+bool fatx_lock_writable(struct fatx_fs *fs);
+void fatx_lock_caches(struct fatx_fs *fs);
+void fatx_unlock_caches(struct fatx_fs *fs);
+
 /* Misc Functions */
+int fatx_check_writable(struct fatx_fs *fs);
+size_t fatx_name_hash(struct fatx_fs *fs, size_t seed, char const *name);
+bool fatx_name_match(struct fatx_fs *fs, char const *a, char const *b, size_t len);
 int fatx_get_path_component(char const *path, size_t component, char const **start, size_t *len);
 int fatx_unpack_date(uint16_t in, struct fatx_ts *out);
 int fatx_unpack_time(uint16_t in, struct fatx_ts *out);
@@ -0,0 +1,218 @@
+/*
+ * FATX Filesystem Library
+ *
+ * Copyright (C) 2015  Matt Borgerson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The filesystem lock.
+ *
+ * Public operations call each other, so the exclusive lock is recursive: the
+ * owning thread is recorded, and nested acquisitions (exclusive or shared) by
+ * that thread only count the depth. A thread is identified by the address of
+ * a thread-local variable, which can be compared without taking any lock.
+ *
+ * A shared holder must not ask for the exclusive lock, as that would never
+ * be granted.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include "fatx_internal.h"
+
+#ifndef _WIN32
+
+static _Thread_local char fatx_lock_thread;
+
+#define FATX_LOCK_SELF ((uintptr_t)&fatx_lock_thread)
+
+static bool fatx_lock_owned(struct fatx_lock *lock)
+{
+    return __atomic_load_n(&lock->owner, __ATOMIC_RELAXED) == FATX_LOCK_SELF;
+}
+
+/*
+ * Set up the lock of a filesystem.
+ */
+int fatx_lock_init(struct fatx_fs *fs)
+{
+    struct fatx_lock *lock = &fs->lock;
+    pthread_rwlockattr_t attr;
+    int status;
+
+    lock->owner   = 0;
+    lock->depth   = 0;
+    lock->readers = 0;
+
+    if (pthread_rwlockattr_init(&attr))
+    {
+        return FATX_STATUS_ERROR;
+    }
+
+#ifdef __GLIBC__
+    /* Don't let a steady stream of reads starve out everything else. */
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+
+    status = pthread_rwlock_init(&lock->rwlock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+
+    if (status)
+    {
+        fatx_error(fs, "failed to initialize filesystem lock\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    if (pthread_mutex_init(&lock->cache_lock, NULL))
+    {
+        fatx_error(fs, "failed to initialize filesystem lock\n");
+        pthread_rwlock_destroy(&lock->rwlock);
+        return FATX_STATUS_ERROR;
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
+/*
+ * Release the lock of a filesystem.
+ */
+void fatx_lock_free(struct fatx_fs *fs)
+{
+    pthread_mutex_destroy(&fs->lock.cache_lock);
+    pthread_rwlock_destroy(&fs->lock.rwlock);
+}
+
+/*
+ * Take the lock exclusively.
+ */
+void fatx_lock(struct fatx_fs *fs)
+{
+    struct fatx_lock *lock = &fs->lock;
+
+    if (fatx_lock_owned(lock))
+    {
+        lock->depth++;
+        return;
+    }
+
+    pthread_rwlock_wrlock(&lock->rwlock);
+    __atomic_store_n(&lock->owner, FATX_LOCK_SELF, __ATOMIC_RELAXED);
+    lock->depth = 1;
+}
+
+/*
+ * Take the lock shared, unless it is already held exclusively.
+ */
+void fatx_lock_shared(struct fatx_fs *fs)
+{
+    struct fatx_lock *lock = &fs->lock;
+
+    if (fatx_lock_owned(lock))
+    {
+        lock->depth++;
+        return;
+    }
+
+    pthread_rwlock_rdlock(&lock->rwlock);
+    __atomic_add_fetch(&lock->readers, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Drop the lock, as taken by the matching fatx_lock(...) or
+ * fatx_lock_shared(...).
+ */
+void fatx_unlock(struct fatx_fs *fs)
+{
+    struct fatx_lock *lock = &fs->lock;
+
+    if (fatx_lock_owned(lock))
+    {
+        if (--lock->depth > 0)
+        {
+            return;
+        }
+
+        __atomic_store_n(&lock->owner, 0, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_sub_fetch(&lock->readers, 1, __ATOMIC_RELAXED);
+    }
+
+    pthread_rwlock_unlock(&lock->rwlock);
+}
+
+/*
+ * Check whether the calling thread may write to the device, which it may
+ * while it holds the lock exclusively or while nobody holds it shared.
+ */
+bool fatx_lock_writable(struct fatx_fs *fs)
+{
+    return fatx_lock_owned(&fs->lock) || __atomic_load_n(&fs->lock.readers, __ATOMIC_RELAXED) == 0;
+}
+
+/*
+ * Serialize cache access among the holders of the shared lock.
+ */
+void fatx_lock_caches(struct fatx_fs *fs)
+{
+    pthread_mutex_lock(&fs->lock.cache_lock);
+}
+
+void fatx_unlock_caches(struct fatx_fs *fs)
+{
+    pthread_mutex_unlock(&fs->lock.cache_lock);
+}
+
+#else
+
+int fatx_lock_init(struct fatx_fs *fs)
+{
+    return FATX_STATUS_SUCCESS;
+}
+
+void fatx_lock_free(struct fatx_fs *fs)
+{
+}
+
+void fatx_lock(struct fatx_fs *fs)
+{
+}
+
+void fatx_lock_shared(struct fatx_fs *fs)
+{
+}
+
+void fatx_unlock(struct fatx_fs *fs)
+{
+}
+
+bool fatx_lock_writable(struct fatx_fs *fs)
+{
+    return true;
+}
+
+void fatx_lock_caches(struct fatx_fs *fs)
+{
+}
+
+void fatx_unlock_caches(struct fatx_fs *fs)
+{
+}
+
+#endif
@@ -130,6 +130,74 @@ char *fatx_basename(const char *path)
     return path_basename;
 }
 
+/*
+ * Fold a name character for comparison, when names are looked up without
+ * regard to case.
+ */
+static unsigned char fatx_name_fold(struct fatx_fs *fs, unsigned char c)
+{
+    if ((fs->open_flags & FATX_OPEN_IGNORE_CASE) && c >= 'a' && c <= 'z')
+    {
+        return c - 'a' + 'A';
+    }
+    return c;
+}
+
+/*
+ * Hash a name (FNV-1a), folding its case if names are looked up without
+ * regard to case.
+ */
+size_t fatx_name_hash(struct fatx_fs *fs, size_t seed, char const *name)
+{
+    size_t hash = 2166136261u ^ seed;
+
+    while (*name)
+    {
+        hash ^= fatx_name_fold(fs, *name++);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+/*
+ * Check whether the first len characters of two names are the same, in the
+ * way names are looked up on this filesystem.
+ */
+bool fatx_name_match(struct fatx_fs *fs, char const *a, char const *b, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        if (fatx_name_fold(fs, a[i]) != fatx_name_fold(fs, b[i]))
+        {
+            return false;
+        }
+        if (a[i] == '\0')
+        {
+            break;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Check that the filesystem may be modified. Called on entry to every
+ * operation that writes to the device.
+ */
+int fatx_check_writable(struct fatx_fs *fs)
+{
+    if (fs->open_flags & FATX_OPEN_READ_ONLY)
+    {
+        fatx_error(fs, "filesystem is read-only\n");
+        return FATX_STATUS_ERROR;
+    }
+
+    return FATX_STATUS_SUCCESS;
+}
+
 /*
  * Pack a FATX date.
  */
@@ -30,13 +30,7 @@ int fatx_check_partition_signature(struct fatx_fs *fs)
 {
     uint32_t signature;
 
-    if (fatx_dev_seek(fs, fs->partition_offset))
-    {
-        fatx_error(fs, "failed to seek to signature\n");
-        return FATX_STATUS_ERROR;
-    }
-
-    if (fatx_dev_read(fs, &signature, sizeof(uint32_t), 1) != 1)
+    if (fatx_dev_read_at(fs, &signature, sizeof(uint32_t), fs->partition_offset))
     {
         fatx_error(fs, "failed to read signature from device\n");
         return FATX_STATUS_ERROR;
@@ -92,13 +86,7 @@ int fatx_read_superblock(struct fatx_fs *fs)
 {
     struct fatx_superblock superblock;
 
-    if (fatx_dev_seek(fs, fs->partition_offset))
-    {
-        fatx_error(fs, "failed to seek to superblock\n");
-        return FATX_STATUS_ERROR;
-    }
-
-    if (fatx_dev_read(fs, &superblock, sizeof(struct fatx_superblock), 1) != 1)
+    if (fatx_dev_read_at(fs, &superblock, sizeof(struct fatx_superblock), fs->partition_offset))
     {
         fatx_error(fs, "failed to read superblock\n");
         return FATX_STATUS_ERROR;
@@ -124,12 +112,6 @@ int fatx_write_superblock(struct fatx_fs *fs)
 {
     struct fatx_superblock superblock;
 
-    if (fatx_dev_seek(fs, fs->partition_offset))
-    {
-        fatx_error(fs, "failed to seek to superblock\n");
-        return FATX_STATUS_ERROR;
-    }
-
     memset(&superblock, 0xFF, sizeof(struct fatx_superblock));
 
     superblock.signature = FATX_SIGNATURE;
@@ -138,7 +120,7 @@ int fatx_write_superblock(struct fatx_fs *fs)
     superblock.root_cluster = fs->root_cluster;
     superblock.unknown1 = 0;
 
-    if (fatx_dev_write(fs, &superblock, sizeof(struct fatx_superblock), 1) != 1)
+    if (fatx_dev_write_at(fs, &superblock, sizeof(struct fatx_superblock), fs->partition_offset))
     {
         fatx_error(fs, "failed to write superblock\n");
         return FATX_STATUS_ERROR;
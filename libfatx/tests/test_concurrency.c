@@ -0,0 +1,327 @@
+/*
+ * FATX Filesystem Library
+ *
+ * Copyright (C) 2015  Matt Borgerson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Reads of open files through fatx_file_pread run in parallel with each
+ * other, and with writes, truncates and unlinks of other files. This test
+ * runs them all at once on a small partition and checks that every read
+ * returns the data that was written there.
+ *
+ * Each file holds a pattern that depends on the file and the offset, so data
+ * read from the wrong clusters (for example from ones that were freed by a
+ * truncate and handed to another file) doesn't match.
+ *
+ * There are more files than extent maps are cached for, and the FAT cache is
+ * kept small, so readers keep loading FAT pages in place of ones the writers
+ * have modified. The device backend checks that they never write them back.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fatx.h"
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+#define IMAGE_SIZE          (64*1024*1024)
+#define SECTORS_PER_CLUSTER 1
+
+#define NUM_STABLE_FILES    40
+#define NUM_HOT_FILES       2
+#define NUM_READERS         6
+#define FAT_CACHE_SIZE      (2*4096)
+#define FILE_SIZE           (300*1024+123)
+#define CHUNK_SIZE          (24*1024)
+#define READ_SIZE           (40*1024)
+
+#define READER_ITERATIONS   200
+#define WRITER_ITERATIONS   40
+#define CHURN_ITERATIONS    300
+
+/* Files 0 to NUM_STABLE_FILES-1 are only read; the rest are also written. */
+#define NUM_FILES           (NUM_STABLE_FILES + NUM_HOT_FILES)
+#define CHURN_FILE          NUM_FILES
+
+static struct fatx_fs fs;
+static int fd;
+
+/* Set while a thread is in fatx_file_pread, which must not write to the device. */
+static _Thread_local bool in_pread;
+
+static int dev_read_at(void *ctx, void *buf, size_t size, uint64_t offset)
+{
+    return pread(fd, buf, size, offset) == (ssize_t)size ? FATX_STATUS_SUCCESS : FATX_STATUS_ERROR;
+}
+
+static int dev_write_at(void *ctx, const void *buf, size_t size, uint64_t offset)
+{
+    CHECK(!in_pread);
+    return pwrite(fd, buf, size, offset) == (ssize_t)size ? FATX_STATUS_SUCCESS : FATX_STATUS_ERROR;
+}
+
+static int dev_flush(void *ctx)
+{
+    CHECK(!in_pread);
+    return FATX_STATUS_SUCCESS;
+}
+
+static int dev_size(void *ctx, uint64_t *size)
+{
+    *size = IMAGE_SIZE;
+    return FATX_STATUS_SUCCESS;
+}
+
+static struct fatx_dev_ops const dev_ops = {
+    .read_at  = dev_read_at,
+    .write_at = dev_write_at,
+    .flush    = dev_flush,
+    .size     = dev_size,
+};
+
+static uint8_t pattern_byte(int file, size_t offset)
+{
+    return (uint8_t)(offset * 7 + (offset >> 11) + file * 13 + 1);
+}
+
+static void fill_pattern(uint8_t *buf, int file, size_t offset, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++)
+    {
+        buf[i] = pattern_byte(file, offset + i);
+    }
+}
+
+static void file_path(char *path, int file)
+{
+    sprintf(path, "/f%d", file);
+}
+
+/*
+ * Write the pattern of a file from offset to FILE_SIZE, a chunk at a time.
+ */
+static void write_pattern(int file, size_t offset)
+{
+    uint8_t buf[CHUNK_SIZE];
+    char path[16];
+    size_t size;
+
+    file_path(path, file);
+
+    for (; offset < FILE_SIZE; offset += size)
+    {
+        size = FILE_SIZE - offset < CHUNK_SIZE ? FILE_SIZE - offset : CHUNK_SIZE;
+        fill_pattern(buf, file, offset, size);
+        CHECK(fatx_write(&fs, path, offset, size, buf) == (int)size);
+    }
+}
+
+/*
+ * Repeatedly open a file, read parts of it and check them against the
+ * pattern. Hot files may be shorter than FILE_SIZE while they are being
+ * rewritten, so a short read is fine as long as what was read matches.
+ */
+static void *reader(void *arg)
+{
+    int id = (int)(intptr_t)arg;
+    uint8_t buf[READ_SIZE], expected[READ_SIZE];
+    struct fatx_file file;
+    char path[16];
+    size_t offset, want;
+    int i, j, f, got;
+
+    for (i = 0; i < READER_ITERATIONS; i++)
+    {
+        f = (id * 7 + i) % NUM_FILES;
+        file_path(path, f);
+        CHECK(fatx_file_open(&fs, path, &file) == FATX_STATUS_SUCCESS);
+
+        for (j = 0; j < 4; j++)
+        {
+            offset = ((size_t)i * 7919 + (size_t)j * 104729 + (size_t)id * 4099) % FILE_SIZE;
+            want   = FILE_SIZE - offset < READ_SIZE ? FILE_SIZE - offset : READ_SIZE;
+
+            in_pread = true;
+            got = fatx_file_pread(&fs, &file, offset, READ_SIZE, buf);
+            in_pread = false;
+            CHECK(got >= 0 && (size_t)got <= want);
+            if (f < NUM_STABLE_FILES)
+            {
+                CHECK((size_t)got == want);
+            }
+
+            fill_pattern(expected, f, offset, got);
+            CHECK(memcmp(buf, expected, got) == 0);
+        }
+
+        CHECK(fatx_file_close(&fs, &file) == FATX_STATUS_SUCCESS);
+    }
+
+    return NULL;
+}
+
+/*
+ * Repeatedly truncate a hot file and write its pattern back, so its clusters
+ * are freed and allocated again while it is being read.
+ */
+static void *writer(void *arg)
+{
+    int f = (int)(intptr_t)arg;
+    char path[16];
+    size_t size;
+    int i;
+
+    file_path(path, f);
+
+    for (i = 0; i < WRITER_ITERATIONS; i++)
+    {
+        size = ((size_t)i * 65537 + (size_t)f * 4096) % FILE_SIZE;
+        CHECK(fatx_truncate(&fs, path, size) == FATX_STATUS_SUCCESS);
+        write_pattern(f, size);
+    }
+
+    return NULL;
+}
+
+/*
+ * Create, grow and delete another file, so that clusters freed by the
+ * writers go to a file with a different pattern.
+ */
+static void *churn(void *arg)
+{
+    static uint8_t buf[CHUNK_SIZE];
+    char path[16];
+    int i;
+
+    (void)arg;
+    file_path(path, CHURN_FILE);
+
+    for (i = 0; i < CHURN_ITERATIONS; i++)
+    {
+        if (i % 4 == 3)
+        {
+            CHECK(fatx_unlink(&fs, path) == FATX_STATUS_SUCCESS);
+            continue;
+        }
+
+        if (i % 4 == 0)
+        {
+            CHECK(fatx_mknod(&fs, path) == FATX_STATUS_SUCCESS);
+        }
+
+        fill_pattern(buf, CHURN_FILE, (i % 4) * CHUNK_SIZE, CHUNK_SIZE);
+        CHECK(fatx_write(&fs, path, (i % 4) * CHUNK_SIZE, CHUNK_SIZE, buf) == CHUNK_SIZE);
+    }
+
+    return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+    char const *image = argc > 1 ? argv[1] : "test_concurrency.img";
+    pthread_t readers[NUM_READERS], writers[NUM_HOT_FILES], churner;
+    struct fatx_open_options options = {
+        .fat_cache_size = FAT_CACHE_SIZE,
+        .dev_ops        = &dev_ops,
+    };
+    struct fatx_attr attr;
+    uint8_t *data, *expected;
+    char path[16];
+    FILE *f;
+    int i;
+
+    f = fopen(image, "wb");
+    CHECK(f != NULL);
+    CHECK(ftruncate(fileno(f), IMAGE_SIZE) == 0);
+    fclose(f);
+
+    fatx_log_init(&fs, stderr, FATX_LOG_LEVEL_FATAL);
+    CHECK(fatx_disk_format_partition(&fs, image, 0, IMAGE_SIZE, 512, SECTORS_PER_CLUSTER) == FATX_STATUS_SUCCESS);
+
+    fd = open(image, O_RDWR);
+    CHECK(fd >= 0);
+    CHECK(fatx_open_device_ex(&fs, image, 0, IMAGE_SIZE, 512, FATX_READ_FROM_SUPERBLOCK, &options) == FATX_STATUS_SUCCESS);
+
+    for (i = 0; i < NUM_FILES; i++)
+    {
+        file_path(path, i);
+        CHECK(fatx_mknod(&fs, path) == FATX_STATUS_SUCCESS);
+        write_pattern(i, 0);
+    }
+
+    for (i = 0; i < NUM_READERS; i++)
+    {
+        CHECK(pthread_create(&readers[i], NULL, reader, (void *)(intptr_t)i) == 0);
+    }
+
+    for (i = 0; i < NUM_HOT_FILES; i++)
+    {
+        CHECK(pthread_create(&writers[i], NULL, writer, (void *)(intptr_t)(NUM_STABLE_FILES + i)) == 0);
+    }
+
+    CHECK(pthread_create(&churner, NULL, churn, NULL) == 0);
+
+    for (i = 0; i < NUM_READERS; i++)
+    {
+        pthread_join(readers[i], NULL);
+    }
+
+    for (i = 0; i < NUM_HOT_FILES; i++)
+    {
+        pthread_join(writers[i], NULL);
+    }
+
+    pthread_join(churner, NULL);
+
+    /* Once everything has settled, every file must hold its whole pattern. */
+    data     = malloc(FILE_SIZE);
+    expected = malloc(FILE_SIZE);
+    CHECK(data != NULL && expected != NULL);
+
+    for (i = 0; i < NUM_FILES; i++)
+    {
+        file_path(path, i);
+        CHECK(fatx_get_attr(&fs, path, &attr) == FATX_STATUS_SUCCESS);
+        CHECK(attr.file_size == FILE_SIZE);
+
+        CHECK(fatx_read(&fs, path, 0, FILE_SIZE, data) == FILE_SIZE);
+        fill_pattern(expected, i, 0, FILE_SIZE);
+        CHECK(memcmp(data, expected, FILE_SIZE) == 0);
+    }
+
+    free(data);
+    free(expected);
+
+    CHECK(fatx_close_device(&fs) == FATX_STATUS_SUCCESS);
+    close(fd);
+    unlink(image);
+
+    return 0;
+}
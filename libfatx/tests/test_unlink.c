@@ -0,0 +1,139 @@
+/*
+ * FATX Filesystem Library
+ *
+ * Copyright (C) 2015  Matt Borgerson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A file that is unlinked, or renamed over, while it is open keeps its
+ * clusters until its last handle is closed. This test removes open files,
+ * writes other files that would take over their clusters if they had been
+ * freed, and checks that the handles still read and write the old data, and
+ * that the clusters are freed once the handles are closed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "fatx_internal.h"
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) \
+        { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+#define IMAGE_SIZE          (64*1024*1024)
+#define SECTORS_PER_CLUSTER 8
+#define FILE_SIZE           (100*1024+123)
+
+static struct fatx_fs fs;
+static uint8_t data[2*FILE_SIZE], expected[2*FILE_SIZE];
+
+static void fill_pattern(uint8_t *buf, int file, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i < size; i++)
+    {
+        buf[i] = (uint8_t)(i * 7 + (i >> 11) + file * 13 + 1);
+    }
+}
+
+static void write_file(char const *path, int file)
+{
+    fill_pattern(expected, file, FILE_SIZE);
+    CHECK(fatx_mknod(&fs, path) == FATX_STATUS_SUCCESS);
+    CHECK(fatx_write(&fs, path, 0, FILE_SIZE, expected) == FILE_SIZE);
+}
+
+static void check_handle(struct fatx_file *handle, int file, size_t size)
+{
+    fill_pattern(expected, file, size);
+    CHECK(fatx_file_pread(&fs, handle, 0, sizeof(data), data) == (int)size);
+    CHECK(memcmp(data, expected, size) == 0);
+}
+
+static bool cluster_free(size_t cluster)
+{
+    fatx_fat_entry entry;
+
+    CHECK(fatx_read_fat(&fs, cluster, &entry) == FATX_STATUS_SUCCESS);
+    return entry == FATX_CLUSTER_AVAILABLE;
+}
+
+int main(int argc, char *argv[])
+{
+    char const *image = argc > 1 ? argv[1] : "test_unlink.img";
+    struct fatx_file a1, a2, c;
+    struct fatx_attr attr;
+    FILE *f;
+
+    f = fopen(image, "wb");
+    CHECK(f != NULL);
+    CHECK(ftruncate(fileno(f), IMAGE_SIZE) == 0);
+    fclose(f);
+
+    fatx_log_init(&fs, stderr, FATX_LOG_LEVEL_FATAL);
+    CHECK(fatx_disk_format_partition(&fs, image, 0, IMAGE_SIZE, 512, SECTORS_PER_CLUSTER) == FATX_STATUS_SUCCESS);
+    CHECK(fatx_open_device(&fs, image, 0, IMAGE_SIZE, 512, FATX_READ_FROM_SUPERBLOCK) == FATX_STATUS_SUCCESS);
+
+    /* Unlink a file with two handles open on it. */
+    write_file("/a", 0);
+    CHECK(fatx_file_open(&fs, "/a", &a1) == FATX_STATUS_SUCCESS);
+    CHECK(fatx_file_open(&fs, "/a", &a2) == FATX_STATUS_SUCCESS);
+    CHECK(fatx_unlink(&fs, "/a") == FATX_STATUS_SUCCESS);
+    CHECK(fatx_get_attr(&fs, "/a", &attr) == FATX_STATUS_FILE_NOT_FOUND);
+
+    write_file("/b", 1);
+    check_handle(&a1, 0, FILE_SIZE);
+
+    /* Writes through one handle are seen through the other. */
+    fill_pattern(expected, 0, 2*FILE_SIZE);
+    CHECK(fatx_file_pwrite(&fs, &a2, FILE_SIZE, FILE_SIZE, expected + FILE_SIZE) == FILE_SIZE);
+    check_handle(&a1, 0, 2*FILE_SIZE);
+
+    CHECK(fatx_file_close(&fs, &a2) == FATX_STATUS_SUCCESS);
+    CHECK(!cluster_free(a1.attr.first_cluster));
+    check_handle(&a1, 0, 2*FILE_SIZE);
+
+    CHECK(fatx_file_close(&fs, &a1) == FATX_STATUS_SUCCESS);
+    CHECK(cluster_free(a1.attr.first_cluster));
+
+    /* Rename over an open file. */
+    write_file("/c", 2);
+    CHECK(fatx_file_open(&fs, "/c", &c) == FATX_STATUS_SUCCESS);
+    CHECK(fatx_rename(&fs, "/b", "/c", false, false) == FATX_STATUS_SUCCESS);
+
+    write_file("/d", 3);
+    check_handle(&c, 2, FILE_SIZE);
+
+    CHECK(fatx_read(&fs, "/c", 0, sizeof(data), data) == FILE_SIZE);
+    fill_pattern(expected, 1, FILE_SIZE);
+    CHECK(memcmp(data, expected, FILE_SIZE) == 0);
+
+    CHECK(fatx_file_close(&fs, &c) == FATX_STATUS_SUCCESS);
+    CHECK(cluster_free(c.attr.first_cluster));
+
+    CHECK(fatx_close_device(&fs) == FATX_STATUS_SUCCESS);
+    unlink(image);
+
+    return 0;
+}
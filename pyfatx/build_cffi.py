@@ -74,6 +74,11 @@ def ffibuilder():
             size_t entry;
         };
 
+        struct fatx_dir_iter {
+            struct fatx_dir dir;
+            ...;
+        };
+
         struct fatx_ts {
             uint16_t year;
             uint8_t  month;
@@ -97,18 +102,55 @@ def ffibuilder():
             struct fatx_ts accessed;
         };
 
+        struct fatx_statfs {
+            size_t   bytes_per_cluster;
+            size_t   total_clusters;
+            size_t   free_clusters;
+            size_t   used_clusters;
+            uint64_t total_dirents;
+            uint64_t free_dirents;
+        };
+
         typedef long int off_t;
 
+        #define FATX_STATUS_END_OF_DIR ...
+
+        #define FATX_OPEN_FAT_MIRROR ...
+        #define FATX_OPEN_READ_ONLY ...
+        #define FATX_OPEN_MMAP ...
+        #define FATX_OPEN_IO_URING ...
+        #define FATX_OPEN_IGNORE_CASE ...
+        #define FATX_OPEN_DISCARD ...
+
+        struct fatx_open_options {
+            uint32_t flags;
+            size_t   fat_cache_size;
+            ...;
+        };
+
+        #define FATX_FORMAT_SEQUENTIAL ...
+
+        struct fatx_format_options {
+            uint32_t   flags;
+            void     (*progress)(void *ctx, size_t partition, uint64_t done, uint64_t total);
+            void      *progress_ctx;
+        };
+
         struct fatx_fs *pyfatx_open_helper(void);
 
         int fatx_open_device(struct fatx_fs *fs, char const *path, uint64_t offset, uint64_t size, size_t sector_size, size_t sectors_per_cluster);
+        int fatx_open_device_ex(struct fatx_fs *fs, char const *path, uint64_t offset, uint64_t size, size_t sector_size, size_t sectors_per_cluster, struct fatx_open_options const *options);
         int fatx_close_device(struct fatx_fs *fs);
+        int fatx_statfs(struct fatx_fs *fs, struct fatx_statfs *st);
         int fatx_open_dir(struct fatx_fs *fs, char const *path, struct fatx_dir *dir);
         int fatx_read_dir(struct fatx_fs *fs, struct fatx_dir *dir, struct fatx_dirent *entry, struct fatx_attr *attr, struct fatx_dirent **result);
         int fatx_write_dir(struct fatx_fs *fs, struct fatx_dir *dir, struct fatx_dirent *entry, struct fatx_attr *attr);
         int fatx_next_dir_entry(struct fatx_fs *fs, struct fatx_dir *dir);
         int fatx_alloc_dir_entry(struct fatx_fs *fs, struct fatx_dir *dir);
         int fatx_close_dir(struct fatx_fs *fs, struct fatx_dir *dir);
+        int fatx_dir_iter_open(struct fatx_fs *fs, char const *path, struct fatx_dir_iter *iter);
+        int fatx_dir_iter_next(struct fatx_fs *fs, struct fatx_dir_iter *iter, struct fatx_attr *attr);
+        int fatx_dir_iter_close(struct fatx_fs *fs, struct fatx_dir_iter *iter);
         int fatx_get_attr(struct fatx_fs *fs, char const *path, struct fatx_attr *attr);
         int fatx_set_attr(struct fatx_fs *fs, char const *path, struct fatx_attr *attr);
         int fatx_utime(struct fatx_fs *fs, char const *path, struct fatx_ts ts[2]);
@@ -125,6 +167,7 @@ def ffibuilder():
         int fatx_disk_size_remaining(char const *path, uint64_t offset, uint64_t *size);
         int fatx_disk_format(struct fatx_fs *fs, char const *path, size_t sector_size, enum fatx_format format_type, size_t sectors_per_cluster);
         int fatx_disk_format_partition(struct fatx_fs *fs, char const *path, uint64_t offset, uint64_t size, size_t sector_size, size_t sectors_per_cluster);
+        int fatx_disk_format_ex(struct fatx_fs *fs, char const *path, size_t sector_size, enum fatx_format format_type, size_t sectors_per_cluster, struct fatx_format_options const *options);
         int fatx_drive_to_offset_size(char drive_letter, uint64_t *offset, uint64_t *size);
         int fatx_disk_write_refurb_info(char const *path, uint32_t number_of_boots, uint64_t first_power_on);
         """)
@@ -3,7 +3,7 @@ import os
 import platform
 import subprocess
 import logging
-from typing import AnyStr, Generator, Optional, Sequence, Tuple
+from typing import AnyStr, Callable, Generator, Optional, Sequence, Tuple
 
 from .libfatx import ffi
 from .libfatx.lib import *
@@ -51,27 +51,68 @@ class FatxAttr:
 		return f'<FatxAttr name={self.filename} attr={attr_desc} size={self.file_size:#x}>'
 
 
+class FatxStatfs:
+	"""
+	FATX Filesystem Space Usage
+	"""
+
+	def __init__(self, bytes_per_cluster: int, total_clusters: int, free_clusters: int, used_clusters: int,
+		         total_dirents: int, free_dirents: int):
+		self.bytes_per_cluster = bytes_per_cluster
+		self.total_clusters = total_clusters
+		self.free_clusters = free_clusters
+		self.used_clusters = used_clusters
+		self.total_dirents = total_dirents
+		self.free_dirents = free_dirents
+
+	@property
+	def total_bytes(self): return self.total_clusters * self.bytes_per_cluster
+
+	@property
+	def free_bytes(self): return self.free_clusters * self.bytes_per_cluster
+
+	@property
+	def used_bytes(self): return self.used_clusters * self.bytes_per_cluster
+
+	def __repr__(self):
+		return f'<FatxStatfs total={self.total_bytes:#x} free={self.free_bytes:#x} used={self.used_bytes:#x}>'
+
+
 class Fatx:
 	"""
 	FATX Filesystem Interface
 	"""
 
+	# Offset and size of each retail partition, in the order they are laid out
+	PARTITIONS = {
+		'x': (0x00080000, 0x02ee00000),
+		'y': (0x2ee80000, 0x02ee00000),
+		'z': (0x5dc80000, 0x02ee00000),
+		'c': (0x8ca80000, 0x01f400000),
+		'e': (0xabe80000, 0x1312d6000),
+	}
+
 	def __init__(self, path: str, offset: Optional[int] = None, size: Optional[int] = None, drive: str = 'c',
-		         sector_size: int = 512):
+		         sector_size: int = 512, read_only: bool = False, mmap: bool = False,
+		         io_uring: bool = False, ignore_case: bool = False, discard: bool = False):
 		self.fs = pyfatx_open_helper()
 		assert self.fs
 		if offset is None:
-			partitions = {
-				'x': (0x00080000, 0x02ee00000),
-				'y': (0x2ee80000, 0x02ee00000),
-				'z': (0x5dc80000, 0x02ee00000),
-				'c': (0x8ca80000, 0x01f400000),
-				'e': (0xabe80000, 0x1312d6000),
-			}
-			offset, size = partitions[drive]
+			offset, size = self.PARTITIONS[drive]
 		if isinstance(path, str):
 			path = path.encode('utf-8')
-		s = fatx_open_device(self.fs, path, offset, size, sector_size, 0)
+		options = ffi.new('struct fatx_open_options *')
+		if read_only:
+			options.flags |= FATX_OPEN_READ_ONLY
+		if mmap:
+			options.flags |= FATX_OPEN_READ_ONLY | FATX_OPEN_MMAP
+		if io_uring:
+			options.flags |= FATX_OPEN_IO_URING
+		if ignore_case:
+			options.flags |= FATX_OPEN_IGNORE_CASE
+		if discard:
+			options.flags |= FATX_OPEN_DISCARD
+		s = fatx_open_device_ex(self.fs, path, offset, size, sector_size, 0, options)
 		if s != 0:
 			self.fs = None
 		assert s == 0
@@ -103,32 +144,36 @@ class Fatx:
 		assert s == 0
 		return self._create_attr(attr)
 
+	def statfs(self) -> FatxStatfs:
+		"""
+		Get the size of the filesystem and how much of it is free.
+		"""
+		st = ffi.new('struct fatx_statfs *')
+		s = fatx_statfs(self.fs, st)
+		assert s == 0
+		return FatxStatfs(st.bytes_per_cluster, st.total_clusters, st.free_clusters, st.used_clusters,
+		                  st.total_dirents, st.free_dirents)
+
 	def listdir(self, path: str) -> Generator[FatxAttr, None, None]:
 		"""
 		List the files in a directory.
 		"""
 		path = self._sanitize_path(path)
-		d = ffi.new('struct fatx_dir *')
-		s = fatx_open_dir(self.fs, path, d)
+		it = ffi.new('struct fatx_dir_iter *')
+		s = fatx_dir_iter_open(self.fs, path, it)
 		assert s == 0
 
-		dirent = ffi.new('struct fatx_dirent *')
 		attr = ffi.new('struct fatx_attr *')
-		next_dirent = ffi.new('struct fatx_dirent **')
-
-		while True:
-			s = fatx_read_dir(self.fs, d, dirent, attr, next_dirent)
-			if s != 0:
-				break
 
-			yield self._create_attr(attr)
-
-			s = fatx_next_dir_entry(self.fs, d)
-			if s != 0:
-				break
-
-		s = fatx_close_dir(self.fs, d)
-		assert s == 0
+		try:
+			while True:
+				s = fatx_dir_iter_next(self.fs, it, attr)
+				if s == FATX_STATUS_END_OF_DIR:
+					break
+				assert s == 0
+				yield self._create_attr(attr)
+		finally:
+			fatx_dir_iter_close(self.fs, it)
 
 	def walk(self, path: str) -> Generator[Tuple[str, Sequence[FatxAttr], Sequence[FatxAttr]], None, None]:
 		"""
@@ -260,13 +305,27 @@ class Fatx:
 		assert s == 0
 
 	@classmethod
-	def format(cls, path:str):
+	def format(cls, path:str, sequential: bool = False,
+		       progress: Optional[Callable[[int, int, int], None]] = None):
 		"""
 		Format a device.
+
+		The partitions are formatted concurrently unless `sequential` is set.
+		`progress`, if given, is called with the partition number (from 0 for
+		the x partition) and the bytes of metadata written so far and in total
+		for that partition.
 		"""
 		log.info('Formatting...')
 		fs = pyfatx_open_helper()
-		s = fatx_disk_format(fs, path.encode('utf-8'), 512, 1, 128)
+		options = ffi.new('struct fatx_format_options *')
+		if sequential:
+			options.flags |= FATX_FORMAT_SEQUENTIAL
+		if progress is not None:
+			@ffi.callback('void(void *, size_t, uint64_t, uint64_t)')
+			def report(ctx, partition, done, total):
+				progress(partition, done, total)
+			options.progress = report
+		s = fatx_disk_format_ex(fs, path.encode('utf-8'), 512, 1, 128, options)
 		# FIXME: Leaks fs
 		assert s == 0
 
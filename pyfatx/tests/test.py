@@ -1,6 +1,7 @@
 #!/usr/bin/env python3
 import functools
 import os
+import platform
 import tempfile
 import unittest
 import random
@@ -445,6 +446,207 @@ class BasicTest(unittest.TestCase):
 
 		assert d2 == b1
 
+	@unittest.skipUnless(platform.system() == 'Linux', 'discard punches holes on Linux only')
+	@with_formatted_disk
+	def test_discard_releases_image_space(self, path):
+		fs = Fatx(path, discard=True)
+		fs.write('/file', os.urandom(4*1024*1024))
+		del fs
+		used = os.stat(path).st_blocks
+
+		fs = Fatx(path, discard=True)
+		fs.unlink('/file')
+		del fs
+		assert os.stat(path).st_blocks <= used - (4*1024*1024) // 512
+
+
+	@with_formatted_disk
+	def test_mmap_read_only(self, path):
+		test_file_path = '/test_file.txt'
+		fs = Fatx(path)
+
+		rng = random.Random()
+		rng.seed(12345)
+
+		b = bytes([rng.getrandbits(8) for _ in range(1024 * 64)])
+		fs.write(test_file_path, b)
+		del fs
+
+		fs = Fatx(path, mmap=True)
+		assert [attr.filename for attr in fs.listdir('/')] == ['test_file.txt']
+		assert fs.read(test_file_path) == b
+
+		write_failed = False
+		try:
+			fs.write(test_file_path, b'12345')
+		except AssertionError:
+			write_failed = True
+		assert write_failed
+		assert fs.read(test_file_path) == b
+
+
+	@with_formatted_disk
+	def test_io_uring_fragmented_file(self, path):
+		test_file1 = '/frag1'
+		test_file2 = '/frag2'
+		fs = Fatx(path, io_uring=True)
+
+		rng = random.Random()
+		rng.seed(12345)
+
+		# Interleave the writes so that both files end up fragmented
+		b1 = bytes([rng.getrandbits(8) for _ in range(1024 * 256)])
+		b2 = bytes([rng.getrandbits(8) for _ in range(1024 * 256)])
+		chunk = 20000
+		for offset in range(0, len(b1), chunk):
+			fs.write(test_file1, b1[offset:offset + chunk], offset=offset)
+			fs.write(test_file2, b2[offset:offset + chunk], offset=offset)
+
+		assert fs.read(test_file1) == b1
+		assert fs.read(test_file2) == b2
+		del fs
+
+		fs = Fatx(path)
+		assert fs.read(test_file1) == b1
+		assert fs.read(test_file2) == b2
+
+
+	@with_formatted_disk
+	def test_rename_directory_moves_children(self, path):
+		fs = Fatx(path)
+		fs.mkdir('/dir1')
+		fs.mkdir('/dir1/sub')
+		fs.write('/dir1/sub/file', b'12345')
+		assert fs.read('/dir1/sub/file') == b'12345'
+
+		fs.rename('/dir1', '/dir2')
+		assert fs.read('/dir2/sub/file') == b'12345'
+
+		old_path_still_available = False
+		try:
+			fs.get_attr('/dir1/sub/file')
+			old_path_still_available = True
+		except AssertionError:
+			pass
+		assert not old_path_still_available
+
+		fs.mkdir('/dir1')
+		assert [attr.filename for attr in fs.listdir('/dir1')] == []
+
+
+	@with_formatted_disk
+	def test_listdir_skips_deleted_files(self, path):
+		fs = Fatx(path)
+		for name in ['/a', '/b', '/c']:
+			fs.write(name, b'1234')
+		fs.unlink('/b')
+
+		assert [attr.filename for attr in fs.listdir('/')] == ['a', 'c']
+
+
+	@with_formatted_disk
+	def test_empty_file_grows_and_shrinks(self, path):
+		fs = Fatx(path)
+		fs.mknod('/file')
+		assert fs.read('/file') == b''
+
+		fs.write('/file', b'1234', offset=70000)
+		assert fs.read('/file') == bytes(70000) + b'1234'
+
+		fs.truncate('/file', 0)
+		assert fs.read('/file') == b''
+		fs.write('/file', b'5678')
+		del fs
+
+		fs = Fatx(path)
+		assert fs.read('/file') == b'5678'
+
+	@with_formatted_disk
+	def test_directory_spanning_clusters(self, path):
+		fs = Fatx(path)
+		fs.mkdir('/dir')
+
+		# One 64 KiB cluster holds 1024 directory entries
+		names = ['file%04d' % i for i in range(1100)]
+		for name in names:
+			fs.write('/dir/' + name, name.encode('ascii'))
+		for name in names[::2]:
+			fs.unlink('/dir/' + name)
+		for name in names[::2]:
+			fs.write('/dir/new' + name, b'')
+		del fs
+
+		fs = Fatx(path)
+		listed = sorted(attr.filename for attr in fs.listdir('/dir'))
+		assert listed == sorted(names[1::2] + ['new' + name for name in names[::2]])
+		assert fs.read('/dir/' + names[-1]) == names[-1].encode('ascii')
+
+	@with_formatted_disk
+	def test_ignore_case(self, path):
+		fs = Fatx(path)
+		fs.write('/Default.xbe', b'1234')
+
+		found_with_other_case = False
+		try:
+			fs.get_attr('/default.XBE')
+			found_with_other_case = True
+		except AssertionError:
+			pass
+		assert not found_with_other_case
+		del fs
+
+		fs = Fatx(path, ignore_case=True)
+		assert fs.read('/default.XBE') == b'1234'
+		fs.rename('/default.xbe', '/DEFAULT.XBE')
+		assert [attr.filename for attr in fs.listdir('/')] == ['DEFAULT.XBE']
+
+	@with_formatted_disk
+	def test_format_progress(self, path):
+		def format_and_read_metadata(sequential):
+			reports = []
+			Fatx.format(path, sequential=sequential, progress=lambda *report: reports.append(report))
+
+			if sequential:
+				assert [p for p, _, _ in reports] == sorted(p for p, _, _ in reports)
+
+			metadata = []
+			with open(path, 'rb') as f:
+				for partition, (offset, _) in enumerate(Fatx.PARTITIONS.values()):
+					done = [d for p, d, _ in reports if p == partition]
+					totals = {t for p, _, t in reports if p == partition}
+					assert done == sorted(done)
+					assert len(totals) == 1
+					total = totals.pop()
+					assert done[-1] == total
+
+					# The superblock, the FAT and the root directory, without the volume id
+					f.seek(offset)
+					data = bytearray(f.read(total))
+					data[4:8] = bytes(4)
+					metadata.append(data)
+			return metadata
+
+		assert format_and_read_metadata(sequential=False) == format_and_read_metadata(sequential=True)
+
+	@with_formatted_disk
+	def test_statfs(self, path):
+		fs = Fatx(path)
+		st = fs.statfs()
+		assert st.used_clusters + st.free_clusters == st.total_clusters
+		assert 0 < st.free_clusters < st.total_clusters
+
+		fs.write('/file', bytes(3 * st.bytes_per_cluster + 1))
+		assert fs.statfs().free_clusters == st.free_clusters - 4
+		fs.truncate('/file', st.bytes_per_cluster)
+		assert fs.statfs().free_clusters == st.free_clusters - 1
+		del fs
+
+		# The free count is rebuilt from the FAT when the device is opened
+		fs = Fatx(path)
+		assert fs.statfs().free_clusters == st.free_clusters - 1
+		fs.unlink('/file')
+		assert fs.statfs().free_clusters == st.free_clusters
+
 
 if __name__ == '__main__':
 	unittest.main()